@@ -35,6 +35,41 @@ carrier::run(int argc, char * const * argv) {
   return cc->start_mission(argc, argv);
 }
 
+void
+carrier::set_intercept_mode(cmdcenter::intercept_mode mode) {
+  cc->set_intercept_mode(mode);
+}
+
+void
+carrier::set_patch_syscall(bool enable) {
+  cc->set_patch_syscall(enable);
+}
+
+void
+carrier::set_msg_ring(bool enable) {
+  cc->set_msg_ring(enable);
+}
+
+bool
+carrier::add_local_path(const char* path) {
+  return cc->add_local_path(path);
+}
+
+void
+carrier::set_file_images(bool enable) {
+  cc->set_file_images(enable);
+}
+
+void
+carrier::set_fd_cache(bool enable) {
+  cc->set_fd_cache(enable);
+}
+
+void
+carrier::set_exec_stub(bool enable) {
+  cc->set_exec_stub(enable);
+}
+
 void
 carrier::handle_messages() {
   cc->handle_messages();
@@ -44,3 +79,8 @@ void
 carrier::stop_msg_loop() {
   cc->stop_msg_loop();
 }
+
+void
+carrier::print_shm_stats(FILE* fp) {
+  cc->print_shm_stats(fp);
+}
@@ -44,8 +44,45 @@ public:
    */
   int run(int argc, char * const * argv);
 
+  /**
+   * Select how scouts of the mission intercept syscalls.  It should
+   * be called before |run()|.
+   */
+  void set_intercept_mode(cmdcenter::intercept_mode mode);
+  /**
+   * Rewrite the sites of trapped syscalls of the mission.  It should
+   * be called before |run()|.
+   */
+  void set_patch_syscall(bool enable);
+  /**
+   * Send requests of scouts through rings in shared memory.  It
+   * should be called before |run()|.
+   */
+  void set_msg_ring(bool enable);
+  /**
+   * Let scouts make calls on paths under the directory |path| by
+   * themselves.  It should be called before |run()|.
+   */
+  bool add_local_path(const char* path);
+  /**
+   * Serve small files opened for reading from images in memory.  It
+   * should be called before |run()|.
+   */
+  void set_file_images(bool enable);
+  /**
+   * Reopen files opened for reading through a cache of the Command
+   * Center.  It should be called before |run()|.
+   */
+  void set_fd_cache(bool enable);
+  /**
+   * Exec programs through the exec stub instead of attaching
+   * subjects with ptrace.  It should be called before |run()|.
+   */
+  void set_exec_stub(bool enable);
+
   void handle_messages();
   void stop_msg_loop();
+  void print_shm_stats(FILE* fp);
 
 private:
   cmdcenter* cc;
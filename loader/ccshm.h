@@ -0,0 +1,251 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#ifndef __ccshm_h_
+#define __ccshm_h_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+
+// The fd of the memory shared by the Command Center with scouts.
+#define CC_SHM_FD 74
+#define CC_SHM_MAGIC 0x4d6f53696e674172UL
+// Number of entries of the metadata table.
+#define CC_SHM_SLOTS 4096
+// Longer paths are not published.
+#define CC_SHM_PATH_MAX 128
+// Sizes of the trie of local paths.
+#define CC_SHM_LOCAL_NODES 64
+#define CC_SHM_LOCAL_NAMES 1024
+// Sizes of what the exec stub needs.
+#define CC_SHM_EXEC_PATH_MAX 1024
+#define CC_SHM_EXEC_DATA 8192
+
+/**
+ * Kinds of metadata calls.  The results of these calls are
+ * remembered by scouts and published by the Command Center.
+ */
+enum meta_kind {
+  META_STAT = 1,
+  META_LSTAT,
+  META_ACCESS,
+  META_READLINK,
+};
+
+/**
+ * Return the hash of a metadata call, and the length of the path in
+ * |*len|.  |arg| is the mode of access(), 0 for others.
+ */
+inline unsigned int
+meta_hash(int kind, const char* path, int arg, size_t* len) {
+  // FNV-1a
+  unsigned int h = 2166136261u;
+  auto p = path;
+  for (; *p; p++) {
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  }
+  *len = p - path;
+  h = (h ^ kind) * 16777619u;
+  h = (h ^ arg) * 16777619u;
+  return h;
+}
+
+/**
+ * Only results that depend on nothing but the file system are
+ * remembered and published.
+ */
+inline bool
+meta_is_cacheable(int result) {
+  return result >= 0 || result == -ENOENT || result == -ENOTDIR ||
+    result == -EINVAL;
+}
+
+/**
+ * An entry of the metadata table.
+ *
+ * It is protected by a seqlock.  The Command Center, the only
+ * writer, makes |seq| odd before updating the entry, and even again
+ * after.  A reader copies the entry, and retries or gives up if
+ * |seq| is odd or has changed meanwhile.
+ */
+struct cc_shm_entry {
+  unsigned long seq;
+  // The generation that the entry was published at.
+  unsigned long gen;
+  unsigned int hash;
+  int kind;
+  int arg;
+  int result;
+  unsigned int data_size;
+  char path[CC_SHM_PATH_MAX];
+  // struct stat, or the link of readlink().
+  char data[sizeof(struct stat)];
+};
+
+/**
+ * Counters updated by scouts.  It is the only page of cc_shm that
+ * scouts can write.
+ */
+struct cc_shm_stats {
+  unsigned long hits;
+  unsigned long misses;
+  // Calls on local paths made by scouts by themselves.
+  unsigned long local;
+} __attribute__((aligned(4096)));
+
+/**
+ * A node of the trie of local paths, a component of a path.  Node 0
+ * is the root.  Children of a node are linked with |sibling|, 0 ends
+ * the list.
+ */
+struct cc_shm_local_node {
+  unsigned short child;
+  unsigned short sibling;
+  // The name of the component in |cc_shm_local_trie::names|.
+  unsigned short name_off;
+  unsigned char name_len;
+  // Everything under the node is local.
+  unsigned char local;
+};
+
+/**
+ * Paths local to every subject, /proc, /dev, /sys and private temp
+ * directories.  They mean something different for each process, or
+ * nothing to others.  Scouts make calls on them by themselves
+ * instead of sending requests.
+ */
+struct cc_shm_local_trie {
+  unsigned int num_nodes;
+  unsigned int names_bytes;
+  cc_shm_local_node nodes[CC_SHM_LOCAL_NODES];
+  char names[CC_SHM_LOCAL_NAMES];
+};
+
+/**
+ * Return true if the absolute |path| is under a local path of
+ * |trie|.
+ *
+ * Components are matched as they are, without following symlinks.
+ * A path with ".." is never local, it may get out of a local
+ * directory.
+ */
+inline bool
+cc_shm_is_local(const cc_shm_local_trie* trie, const char* path) {
+  if (path[0] != '/' || trie->num_nodes == 0) {
+    return false;
+  }
+  unsigned int node = 0;
+  auto p = path;
+  for (;;) {
+    while (*p == '/') {
+      p++;
+    }
+    if (*p == 0) {
+      return false;
+    }
+    auto comp = p;
+    while (*p != 0 && *p != '/') {
+      p++;
+    }
+    auto len = (unsigned int)(p - comp);
+    if (len == 1 && comp[0] == '.') {
+      continue;
+    }
+    if (len == 2 && comp[0] == '.' && comp[1] == '.') {
+      return false;
+    }
+    auto child = (unsigned int)trie->nodes[node].child;
+    while (child != 0 && child < CC_SHM_LOCAL_NODES) {
+      auto& n = trie->nodes[child];
+      if (n.name_len == len &&
+          memcmp(trie->names + n.name_off, comp, len) == 0) {
+        break;
+      }
+      child = n.sibling;
+    }
+    if (child == 0 || child >= CC_SHM_LOCAL_NODES) {
+      return false;
+    }
+    if (trie->nodes[child].local) {
+      return true;
+    }
+    node = child;
+  }
+}
+
+/**
+ * What the exec stub needs to load libmosingar.so by itself.  See
+ * execstub.cpp.
+ *
+ * |data| holds the arguments of load_shared_object() prepared by the
+ * Flight Deck at the given offsets, the list of prog_header, the
+ * init functions and the relocation records.  The values of
+ * global_flags and cc_shm_addr are left 0 in their records, the stub
+ * adds |flags| and the address that it maps cc_shm at to the
+ * addends.
+ */
+struct cc_shm_exec {
+  // The flags of scouts loaded by the stub, 0 if there is no stub.
+  unsigned long flags;
+  char stub_path[CC_SHM_EXEC_PATH_MAX];
+  char so_path[CC_SHM_EXEC_PATH_MAX];
+  unsigned int header_num;
+  unsigned int headers_off;
+  unsigned int init_off;
+  unsigned int rela_off;
+  // Indices of the records of global_flags and cc_shm_addr.
+  unsigned int flags_rela;
+  unsigned int shm_rela;
+  char data[CC_SHM_EXEC_DATA] __attribute__((aligned(8)));
+};
+
+/**
+ * The memory shared by the Command Center with all scouts.
+ *
+ * The Command Center creates it as a memfd, and every subject
+ * inherits it with the fixed fd number CC_SHM_FD like CARRIER_SOCK.
+ * The Flight Deck maps it into a subject at takeoff, read-only except
+ * |stats|, and passes the address to the scout.
+ */
+struct cc_shm {
+  unsigned long magic;
+  /**
+   * Bumped by the Command Center whenever it sees a change of the
+   * file system, a file being created, truncated, written or
+   * unlinked.  Metadata remembered by a scout, or published in the
+   * table, are valid only if the generation has not changed since.
+   * It starts from 1.
+   */
+  unsigned long generation;
+  // Number of entries published by the Command Center.
+  unsigned long published;
+  // Number of valid entries replaced by others of the same slot.
+  unsigned long replaced;
+
+  cc_shm_stats stats;
+
+  /**
+   * Set up by the Command Center before any mission, it doesn't
+   * change after.
+   */
+  cc_shm_local_trie local;
+
+  /**
+   * Set up by the Command Center before any mission.
+   */
+  cc_shm_exec exec;
+
+  /**
+   * The metadata table published by the Command Center.
+   *
+   * It is direct-mapped with the hash of calls, a new entry replaces
+   * the old one in the same slot.
+   */
+  cc_shm_entry entries[CC_SHM_SLOTS];
+};
+
+#define CC_SHM_SIZE ((sizeof(cc_shm) + 4095) & ~4095UL)
+
+#endif /* __ccshm_h_ */
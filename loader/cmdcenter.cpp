@@ -7,6 +7,7 @@
 #include "ptracetools.h"
 #include "tinypack.h"
 #include "msghelper.h"
+#include "msgring.h"
 
 #include "log.h"
 #include "errhandle.h"
@@ -21,13 +22,27 @@
 #include <sys/epoll.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <linux/limits.h>
+#include <linux/futex.h>
+#include <linux/kcmp.h>
+#include <linux/openat2.h>
 #include <assert.h>
 #include <errno.h>
+#include <string.h>
 
 #include <memory>
 #include <algorithm>
 
 
+// What a reply can carry at most, through either the socket or the
+// ring.
+#define MAX_REPLY_DATA \
+  (std::min<unsigned int>(msg_receiver::data_buf_size, msgring::reply_size) - 64)
+
 bool sigchld_ignore = false;
 
 template<typename T>
@@ -40,10 +55,47 @@ send_msg_packer(int sock, T& packer, int fd1 = -1, int fd2 = -1) {
   return r;
 }
 
+/**
+ * Reply to a scout through the ring that the request came from, or
+ * through the socket if |ring| is null.
+ */
+template<typename T>
+static int
+reply_packer(int sock, msgring* ring, T& packer) {
+  if (ring == nullptr) {
+    return send_msg_packer(sock, packer);
+  }
+  if (!ring->put_reply(packer)) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  syscall(__NR_futex, ring->get_reply_futex(), FUTEX_WAKE, 1,
+          nullptr, nullptr, 0);
+  return 0;
+}
+
+/**
+ * Unpack the arguments of a command.  It is the counterpart of
+ * |sandbox_bridge::send_cmd()|.
+ */
+template<typename... Args>
+static void
+unpack_cmd(const char* ptr, const char* data_end, Args&... args) {
+  auto unpacker = tinyunpack_fields(tinyunpacker(ptr, data_end - ptr),
+                                    args...);
+  assert(unpacker.check_completed());
+  unpacker.unpack();
+}
+
 cmdcenter::cmdcenter(int fd)
   : stopping_message(false)
   , efd(-1)
-  , carrierfd(fd) {}
+  , carrierfd(fd)
+  , scout_flags(0)
+  , kept_fds(0)
+  , shm(nullptr)
+  , images(nullptr)
+  , fds(nullptr) {}
 
 cmdcenter::~cmdcenter() {
   for (auto itr = scoutfds.begin();
@@ -51,7 +103,20 @@ cmdcenter::~cmdcenter() {
        ++itr) {
     close(*itr);
   }
+  for (auto itr = notifyfds.begin();
+       itr != notifyfds.end();
+       ++itr) {
+    close(*itr);
+  }
+  while (!handles.empty()) {
+    drop_kept_fds(handles.front().sock);
+  }
   close(efd);
+  if (shm) {
+    munmap(shm, CC_SHM_SIZE);
+  }
+  delete images;
+  delete fds;
 }
 
 bool
@@ -71,9 +136,378 @@ cmdcenter::init() {
     return false;
   }
 
+  // The kernel may have bigger structures than the headers we are
+  // built with.
+  r = syscall(__NR_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &notif_sizes);
+  if (r < 0) {
+    notif_sizes.seccomp_notif = sizeof(seccomp_notif);
+    notif_sizes.seccomp_notif_resp = sizeof(seccomp_notif_resp);
+    notif_sizes.seccomp_data = sizeof(seccomp_data);
+  }
+
+  return init_shm();
+}
+
+/**
+ * Create the memory shared with scouts, and leave it at CC_SHM_FD
+ * for subjects to inherit.
+ */
+bool
+cmdcenter::init_shm() {
+  auto fd = memfd_create("mosingar-cc-shm", 0);
+  if (fd < 0) {
+    perror("memfd_create");
+    return false;
+  }
+  _EI(ftruncate, fd, CC_SHM_SIZE);
+  auto mem = mmap(nullptr, CC_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+  if (mem == MAP_FAILED) {
+    perror("mmap");
+    close(fd);
+    return false;
+  }
+  _EI(dup2, fd, CC_SHM_FD);
+  _EI(close, fd);
+
+  shm = (cc_shm*)mem;
+  shm->magic = CC_SHM_MAGIC;
+  shm->generation = 1;
+
+  // The root
+  shm->local.num_nodes = 1;
+  for (auto path : { "/proc", "/dev", "/sys" }) {
+    add_local_path(path);
+  }
   return true;
 }
 
+bool
+cmdcenter::add_local_path(const char* path) {
+  if (shm == nullptr || path[0] != '/') {
+    return false;
+  }
+  auto trie = &shm->local;
+  unsigned int node = 0;
+  auto p = path;
+  for (;;) {
+    while (*p == '/') {
+      p++;
+    }
+    if (*p == 0) {
+      break;
+    }
+    auto comp = p;
+    while (*p != 0 && *p != '/') {
+      p++;
+    }
+    auto len = (unsigned int)(p - comp);
+    if ((len == 1 && comp[0] == '.') ||
+        (len == 2 && comp[0] == '.' && comp[1] == '.') || len > 255) {
+      return false;
+    }
+    if (trie->nodes[node].local) {
+      // Covered by a shorter one.
+      return true;
+    }
+
+    auto child = (unsigned int)trie->nodes[node].child;
+    for (; child != 0; child = trie->nodes[child].sibling) {
+      auto& n = trie->nodes[child];
+      if (n.name_len == len &&
+          memcmp(trie->names + n.name_off, comp, len) == 0) {
+        break;
+      }
+    }
+    if (child == 0) {
+      if (trie->num_nodes >= CC_SHM_LOCAL_NODES ||
+          trie->names_bytes + len > CC_SHM_LOCAL_NAMES) {
+        return false;
+      }
+      child = trie->num_nodes;
+      auto& n = trie->nodes[child];
+      n.name_off = trie->names_bytes;
+      n.name_len = len;
+      memcpy(trie->names + n.name_off, comp, len);
+      trie->names_bytes += len;
+      n.sibling = trie->nodes[node].child;
+      trie->nodes[node].child = child;
+      trie->num_nodes++;
+    }
+    node = child;
+  }
+  if (node == 0) {
+    // Everything can not be local.
+    return false;
+  }
+  trie->nodes[node].local = 1;
+  return true;
+}
+
+bool
+cmdcenter::is_local_path(const char* path) {
+  return shm != nullptr && cc_shm_is_local(&shm->local, path);
+}
+
+void
+cmdcenter::bump_generation() {
+  if (shm) {
+    __atomic_add_fetch(&shm->generation, 1, __ATOMIC_RELEASE);
+  }
+}
+
+void
+cmdcenter::mark_dirty(int scoutfd) {
+  if (find(dirty_scoutfds.begin(), dirty_scoutfds.end(), scoutfd) ==
+      dirty_scoutfds.end()) {
+    dirty_scoutfds.push_back(scoutfd);
+  }
+}
+
+void
+cmdcenter::publish_meta(meta_kind kind, const char* path, int arg,
+                        int result, const void* data, size_t size) {
+  if (shm == nullptr || path[0] != '/' || !meta_is_cacheable(result) ||
+      is_local_path(path)) {
+    return;
+  }
+  size_t len;
+  auto hash = meta_hash(kind, path, arg, &len);
+  if (len >= CC_SHM_PATH_MAX ||
+      (result >= 0 && size > sizeof(shm->entries[0].data))) {
+    return;
+  }
+
+  // Scouts tell changes made by themselves after they are done (see
+  // SCOUT_FS_CHANGE_SYSCALLS), so a result made before a change is
+  // always stamped with an older generation.
+  auto gen = shm->generation;
+  auto entry = shm->entries + hash % CC_SHM_SLOTS;
+  if (entry->gen == gen &&
+      (entry->hash != hash || entry->kind != kind || entry->arg != arg ||
+       memcmp(entry->path, path, len + 1) != 0)) {
+    shm->replaced++;
+  }
+
+  auto seq = entry->seq;
+  __atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  entry->gen = gen;
+  entry->hash = hash;
+  entry->kind = kind;
+  entry->arg = arg;
+  entry->result = result;
+  entry->data_size = result >= 0 ? size : 0;
+  memcpy(entry->path, path, len + 1);
+  if (result >= 0) {
+    memcpy(entry->data, data, size);
+  }
+  __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+  shm->published++;
+}
+
+/**
+ * Publish the lstat() of the entries of a directory listed by a
+ * subject, and the stat() of the ones that are not symlinks.  Tools
+ * walking directories, find, ls -l and make, stat every entry right
+ * after listing them.
+ *
+ * The path of the directory is returned in |dirpath|, or an empty
+ * string if it is not known.
+ */
+void
+cmdcenter::prefetch_dents(int dirfd, const char* dents, int bytes,
+                          char* dirpath, size_t size) {
+  dirpath[0] = 0;
+  if (shm == nullptr) {
+    return;
+  }
+  char link[32];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+  auto len = readlink(link, dirpath, size - 1);
+  if (len <= 0 || dirpath[0] != '/') {
+    dirpath[0] = 0;
+    return;
+  }
+  dirpath[len] = 0;
+  static const char deleted[] = " (deleted)";
+  if ((size_t)len >= sizeof(deleted) &&
+      strcmp(dirpath + len - (sizeof(deleted) - 1), deleted) == 0) {
+    dirpath[0] = 0;
+    return;
+  }
+
+  char path[CC_SHM_PATH_MAX];
+  auto prefix = len == 1 ? 0 : len;
+  if (prefix + 2 > CC_SHM_PATH_MAX) {
+    return;
+  }
+  memcpy(path, dirpath, prefix);
+  path[prefix] = '/';
+  for (int off = 0; off < bytes;) {
+    auto ent = (const struct dirent64*)(dents + off);
+    off += ent->d_reclen;
+    auto name = ent->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+    auto name_len = strlen(name);
+    if (prefix + 1 + name_len >= CC_SHM_PATH_MAX) {
+      continue;
+    }
+    memcpy(path + prefix + 1, name, name_len + 1);
+
+    struct stat statbuf;
+    if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+      publish_meta(META_LSTAT, path, 0, -errno, nullptr, 0);
+      continue;
+    }
+    publish_meta(META_LSTAT, path, 0, 0, &statbuf, sizeof(statbuf));
+    if (!S_ISLNK(statbuf.st_mode)) {
+      publish_meta(META_STAT, path, 0, 0, &statbuf, sizeof(statbuf));
+    }
+  }
+}
+
+/**
+ * Return the value of |name| in the environment of |pid|, or an
+ * empty string.
+ */
+static std::string
+get_subject_env(pid_t pid, const char* name) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/environ", pid);
+  auto fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return std::string();
+  }
+  std::string env;
+  char buf[4096];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0) {
+    env.append(buf, r);
+  }
+  close(fd);
+
+  auto name_len = strlen(name);
+  for (size_t pos = 0; pos < env.size();) {
+    auto end = env.find('\0', pos);
+    if (end == std::string::npos) {
+      end = env.size();
+    }
+    if (end - pos > name_len && env[pos + name_len] == '=' &&
+        env.compare(pos, name_len, name) == 0) {
+      return env.substr(pos + name_len + 1, end - pos - name_len - 1);
+    }
+    pos = end + 1;
+  }
+  return std::string();
+}
+
+void
+cmdcenter::prefetch_libs(pid_t pid, const char* exe) {
+  if (shm == nullptr) {
+    return;
+  }
+  char link[64];
+  char exe_buf[PATH_MAX];
+  if (exe == nullptr) {
+    snprintf(link, sizeof(link), "/proc/%d/exe", pid);
+    auto len = readlink(link, exe_buf, sizeof(exe_buf) - 1);
+    if (len <= 0) {
+      return;
+    }
+    exe_buf[len] = 0;
+    exe = exe_buf;
+  }
+  struct stat statbuf;
+  if (stat(exe, &statbuf) < 0) {
+    return;
+  }
+  auto ld_library_path = get_subject_env(pid, "LD_LIBRARY_PATH");
+  char cwd[PATH_MAX];
+  cwd[0] = 0;
+  if (!ld_library_path.empty()) {
+    snprintf(link, sizeof(link), "/proc/%d/cwd", pid);
+    auto len = readlink(link, cwd, sizeof(cwd) - 1);
+    cwd[len > 0 ? len : 0] = 0;
+  }
+
+  char ids[64];
+  snprintf(ids, sizeof(ids), "%lx:%lx:%lx.%lx", (unsigned long)statbuf.st_dev,
+           (unsigned long)statbuf.st_ino, (unsigned long)statbuf.st_mtim.tv_sec,
+           (unsigned long)statbuf.st_mtim.tv_nsec);
+  std::string key(exe);
+  key.append(1, 0).append(ids).append(1, 0).append(ld_library_path)
+    .append(1, 0).append(cwd);
+
+  auto itr = std::find_if(libmaps.begin(), libmaps.end(),
+                          [&](const exe_libmap& v) { return v.key == key; });
+  if (itr != libmaps.end()) {
+    libmaps.splice(libmaps.begin(), libmaps, itr);
+  } else {
+    libmaps.emplace_front();
+    libmaps.front().key = key;
+    libmaps.front().map.build(exe,
+                              ld_library_path.empty() ? nullptr :
+                              ld_library_path.c_str(),
+                              cwd[0] ? cwd : nullptr);
+    if (libmaps.size() > max_libmaps) {
+      libmaps.pop_back();
+    }
+  }
+
+  // The map doesn't change, but the files may.
+  for (auto& path : libmaps.front().map.get_probes()) {
+    auto r = stat(path.c_str(), &statbuf);
+    publish_meta(META_STAT, path.c_str(), 0, r < 0 ? -errno : 0,
+                 &statbuf, sizeof(statbuf));
+  }
+}
+
+void
+cmdcenter::print_shm_stats(FILE* fp) {
+  if (shm == nullptr) {
+    return;
+  }
+  auto used = 0;
+  for (auto i = 0; i < CC_SHM_SLOTS; i++) {
+    if (shm->entries[i].gen == shm->generation) {
+      used++;
+    }
+  }
+  fprintf(fp,
+          "metadata table: %lu hits, %lu misses, %lu published, "
+          "%lu replaced, %d/%d slots valid, generation %lu, "
+          "%lu local calls\n",
+          shm->stats.hits, shm->stats.misses, shm->published,
+          shm->replaced, used, CC_SHM_SLOTS, shm->generation,
+          shm->stats.local);
+  if (images) {
+    fprintf(fp, "file images: %lu hits, %lu misses\n",
+            images->get_hits(), images->get_misses());
+  }
+  if (fds) {
+    fprintf(fp, "fd cache: %lu hits, %lu misses, %zu entries",
+            fds->get_hits(), fds->get_misses(), fds->get_size());
+    unsigned long hits;
+    auto hottest = fds->get_hottest(&hits);
+    if (hottest) {
+      fprintf(fp, ", %s hit %lu times", hottest, hits);
+    }
+    fprintf(fp, "\n");
+  }
+}
+
+/**
+ * Return true if the file system may be changed by opening a file
+ * with |flags|.
+ */
+static bool
+is_opening_for_write(int flags) {
+  return (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) != 0;
+}
+
 bool
 cmdcenter::handle_message() {
   epoll_event events[max_events];
@@ -102,9 +536,16 @@ cmdcenter::handle_message() {
         if (!r) {
           return r;
         }
+      } else if (is_notify(sock)) {
+        handle_notify(sock);
+      } else if (auto ring = find_ring(sock)) {
+        handle_ring(ring);
       } else {
         handle_scout_msg(sock);
       }
+    } else if (ev->events & EPOLLHUP) {
+      // All subjects sharing the filter are gone.
+      remove_notify(ev->data.fd);
     }
   }
 
@@ -119,7 +560,7 @@ cmdcenter::handle_messages() {
 }
 
 bool
-cmdcenter::handle_exec(pid_t pid, int sock) {
+cmdcenter::handle_exec(pid_t pid, int sock, unsigned int id) {
   LOGU(handle_exec);
 
   // Attach & trace the process
@@ -129,6 +570,7 @@ cmdcenter::handle_exec(pid_t pid, int sock) {
   ptrace_cont(pid);
   int ok = 1;
   auto packer = tinypacker()
+    .field(id)
     .field(ok);
   auto reply = packer.pack_size_prefix();
   _E(send_msg, sock, reply, packer.get_size_prefix());
@@ -150,7 +592,10 @@ cmdcenter::handle_exec(pid_t pid, int sock) {
 
     // Install the signal handler and establish a channel, but not
     // install the seccomp filter.
-    _E(flightdeck::scout_takeoff, pid, scout::FLAG_FILTER_INSTALLED);
+    _E(flightdeck::scout_takeoff, pid,
+       scout::FLAG_FILTER_INSTALLED | scout_flags);
+    // Before ld.so starts looking for libraries.
+    prefetch_libs(pid);
   } else {
     // execve() fails! Stop tracing.
     //
@@ -192,6 +637,15 @@ cmdcenter::add_scout(int scoutfd) {
 
 bool
 cmdcenter::remove_scout(int scoutfd) {
+  remove_ring(scoutfd);
+  drop_kept_fds(scoutfd);
+  auto dirty = find(dirty_scoutfds.begin(), dirty_scoutfds.end(), scoutfd);
+  if (dirty != dirty_scoutfds.end()) {
+    // The subject has exited or exec'ed, and is done with writing.
+    dirty_scoutfds.erase(dirty);
+    bump_generation();
+  }
+
   bool success = false;
   scoutfds.remove_if([&](const int& v) {
       if (v == scoutfd) {
@@ -207,6 +661,432 @@ cmdcenter::remove_scout(int scoutfd) {
   return success;
 }
 
+bool
+cmdcenter::add_notify(int notifyfd) {
+  assert(!is_notify(notifyfd));
+  notifyfds.push_back(notifyfd);
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = notifyfd;
+  auto r = epoll_ctl(efd, EPOLL_CTL_ADD, notifyfd, &ev);
+  if (r < 0) {
+    perror("epoll_ctl");
+    return false;
+  }
+  return true;
+}
+
+bool
+cmdcenter::remove_notify(int notifyfd) {
+  bool success = false;
+  notifyfds.remove_if([&](const int& v) {
+      if (v == notifyfd) {
+        auto r = epoll_ctl(efd, EPOLL_CTL_DEL, notifyfd, nullptr);
+        if (r < 0) {
+          perror("epoll_ctl");
+        }
+        close(notifyfd);
+        success = true;
+      }
+      return success;
+    });
+  return success;
+}
+
+bool
+cmdcenter::is_notify(int fd) {
+  return find(notifyfds.begin(), notifyfds.end(), fd) != notifyfds.end();
+}
+
+bool
+cmdcenter::add_ring(int scoutfd, int memfd, int ringfd) {
+  struct stat st;
+  if (fstat(memfd, &st) < 0 || st.st_size < (off_t)sizeof(msgring)) {
+    return false;
+  }
+  auto mem = mmap(nullptr, sizeof(msgring), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, memfd, 0);
+  if (mem == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = ringfd;
+  auto r = epoll_ctl(efd, EPOLL_CTL_ADD, ringfd, &ev);
+  if (r < 0) {
+    perror("epoll_ctl");
+    munmap(mem, sizeof(msgring));
+    return false;
+  }
+  rings.push_back(scout_ring{ scoutfd, ringfd, (msgring*)mem });
+  return true;
+}
+
+bool
+cmdcenter::remove_ring(int scoutfd) {
+  bool success = false;
+  rings.remove_if([&](const scout_ring& v) {
+      if (v.sock == scoutfd) {
+        auto r = epoll_ctl(efd, EPOLL_CTL_DEL, v.efd, nullptr);
+        if (r < 0) {
+          perror("epoll_ctl");
+        }
+        close(v.efd);
+        munmap(v.ring, sizeof(msgring));
+        success = true;
+        return true;
+      }
+      return false;
+    });
+  return success;
+}
+
+cmdcenter::scout_ring*
+cmdcenter::find_ring(int ringfd) {
+  for (auto itr = rings.begin(); itr != rings.end(); ++itr) {
+    if (itr->efd == ringfd) {
+      return &*itr;
+    }
+  }
+  return nullptr;
+}
+
+cmdcenter::scout_handles*
+cmdcenter::find_handles(int sock, bool create) {
+  for (auto itr = handles.begin(); itr != handles.end(); ++itr) {
+    if (itr->sock == sock) {
+      return &*itr;
+    }
+  }
+  if (!create) {
+    return nullptr;
+  }
+
+  // The scout created the socket in its process.
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+    perror("getsockopt");
+    return nullptr;
+  }
+  scout_handles sh;
+  sh.sock = sock;
+  sh.pid = cred.pid;
+  sh.last_handle = 0;
+  for (int i = 0; i < handle_slots; i++) {
+    sh.handles[i] = 0;
+    sh.fds[i] = -1;
+  }
+  handles.push_back(sh);
+  return &handles.back();
+}
+
+unsigned int
+cmdcenter::keep_fd(int sock, int fd) {
+  auto sh = find_handles(sock, true);
+  if (sh == nullptr) {
+    return 0;
+  }
+  if (++sh->last_handle == 0) {
+    sh->last_handle = 1;
+  }
+  auto slot = sh->last_handle % handle_slots;
+  if (sh->fds[slot] >= 0) {
+    close(sh->fds[slot]);
+    kept_fds--;
+  }
+  sh->handles[slot] = 0;
+  sh->fds[slot] = -1;
+  // Leave room for fds of requests.
+  if (kept_fds >= max_kept_fds) {
+    return 0;
+  }
+  sh->handles[slot] = sh->last_handle;
+  sh->fds[slot] = fd;
+  kept_fds++;
+  return sh->last_handle;
+}
+
+int
+cmdcenter::find_kept_fd(int sock, unsigned int handle, int scout_fd) {
+  auto sh = find_handles(sock, false);
+  if (sh == nullptr || handle == 0) {
+    return -1;
+  }
+  auto slot = handle % handle_slots;
+  if (sh->handles[slot] != handle) {
+    return -1;
+  }
+  auto fd = sh->fds[slot];
+  auto r = syscall(__NR_kcmp, sh->pid, getpid(), KCMP_FILE, scout_fd, fd);
+  return r == 0 ? fd : -1;
+}
+
+void
+cmdcenter::drop_kept_fds(int sock) {
+  handles.remove_if([&](const scout_handles& v) {
+      if (v.sock != sock) {
+        return false;
+      }
+      for (int i = 0; i < handle_slots; i++) {
+        if (v.fds[i] >= 0) {
+          close(v.fds[i]);
+          kept_fds--;
+        }
+      }
+      return true;
+    });
+}
+
+/**
+ * Open the directory that a relative path given by a subject is
+ * relative to.
+ */
+static int
+open_subject_dir(pid_t pid, int dirfd) {
+  char path[64];
+  if (dirfd == AT_FDCWD) {
+    snprintf(path, sizeof(path), "/proc/%d/cwd", pid);
+  } else {
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, dirfd);
+  }
+  auto fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  return fd;
+}
+
+/**
+ * Return the umask of the process |pid|, or the one of the Command
+ * Center if it is not found.
+ */
+static mode_t
+get_subject_umask(pid_t pid) {
+  auto mask = umask(0);
+  umask(mask);
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  auto fp = fopen(path, "re");
+  if (fp == nullptr) {
+    return mask;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, "Umask:", 6) == 0) {
+      mask = strtol(line + 6, nullptr, 8) & 0777;
+      break;
+    }
+  }
+  fclose(fp);
+  return mask;
+}
+
+/**
+ * Open the cwd of the subject of a scout if |path| is relative, or
+ * return AT_FDCWD.  The subject may have changed its cwd, so the
+ * one of the Command Center can not be used.
+ */
+int
+cmdcenter::open_scout_cwd(int sock, const char* path) {
+  if (path[0] == '/' || path[0] == 0) {
+    return AT_FDCWD;
+  }
+  auto sh = find_handles(sock, true);
+  if (sh == nullptr) {
+    return AT_FDCWD;
+  }
+  auto fd = open_subject_dir(sh->pid, AT_FDCWD);
+  return fd < 0 ? AT_FDCWD : fd;
+}
+
+bool
+cmdcenter::get_scout_fd(int sock, msg_receiver* rcvr, unsigned int handle,
+                        int* fd, int* passed_fd, const char* path) {
+  *passed_fd = -1;
+  if (*fd < 0) {
+    // AT_FDCWD or an invalid fd.
+    if (*fd == AT_FDCWD && path != nullptr) {
+      *fd = open_scout_cwd(sock, path);
+      if (*fd >= 0) {
+        *passed_fd = *fd;
+      }
+    }
+    return handle == 0;
+  }
+  if (handle != 0) {
+    *fd = find_kept_fd(sock, handle, *fd);
+    return *fd >= 0;
+  }
+  assert(rcvr != nullptr && rcvr->get_fd_rcvd_num() == 1);
+  *fd = *passed_fd = rcvr->get_fd_rcvd()[0];
+  return true;
+}
+
+/**
+ * Reply the result of opening a file, passing the fd along.
+ */
+bool
+cmdcenter::reply_open(int sock, unsigned int id, int fd, int flags) {
+  if (fd >= 0 && is_opening_for_write(flags)) {
+    bump_generation();
+    mark_dirty(sock);
+  }
+
+  // Reply the stat of the file along with the fd.  ld.so calls
+  // fstat() right after opening a library, the scout serves it with
+  // this.  It may change soon for files opened for writing.
+  struct stat statbuf;
+  int stat_r = -1;
+  // The file of |fd| itself, an image may stand for the file.  The
+  // scout checks that the fd is still this file before serving.
+  dev_t fd_dev = 0;
+  ino_t fd_ino = 0;
+  if (fd >= 0 && !is_opening_for_write(flags)) {
+    stat_r = fstat(fd, &statbuf);
+    fd_dev = statbuf.st_dev;
+    fd_ino = statbuf.st_ino;
+    if (stat_r == 0 && images) {
+      images->fix_stat(&statbuf);
+    }
+  }
+  if (stat_r < 0) {
+    bzero(&statbuf, sizeof(statbuf));
+  }
+  // Files for writing are not kept to not delay the release of their
+  // space if they are unlinked.
+  unsigned int handle = 0;
+  if (fd >= 0 && !is_opening_for_write(flags)) {
+    handle = keep_fd(sock, fd);
+  }
+
+  auto packer = tinypacker()
+    .field(id)
+    .field(fd)
+    .field(handle)
+    .field(stat_r)
+    .field(statbuf)
+    .field(fd_dev)
+    .field(fd_ino);
+  auto r = send_msg_packer(sock, packer, fd);
+  if (handle == 0 && fd >= 0) {
+    close(fd);
+  }
+  return r >= 0;
+}
+
+/**
+ * Handle all requests in the ring of a scout.
+ */
+bool
+cmdcenter::handle_ring(scout_ring* sr) {
+  LOGU(handle_ring);
+  uint64_t cnt;
+  if (read(sr->efd, &cnt, sizeof(cnt)) < 0) {
+    perror("read");
+    return false;
+  }
+
+  unsigned int bytes;
+  const char* msg;
+  while ((msg = sr->ring->front(&bytes)) != nullptr) {
+    if (bytes < sizeof(int)) {
+      return false;
+    }
+    auto ok = handle_scout_cmd(sr->sock, sr->ring, nullptr, msg, msg + bytes);
+    sr->ring->pop();
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+cmdcenter::set_intercept_mode(intercept_mode mode) {
+  scout_flags &= ~(scout::FLAG_USER_NOTIF | scout::FLAG_USER_DISPATCH);
+  if (mode == INTERCEPT_USER_NOTIF) {
+    scout_flags |= scout::FLAG_USER_NOTIF;
+  } else if (mode == INTERCEPT_USER_DISPATCH) {
+    scout_flags |= scout::FLAG_USER_DISPATCH;
+  }
+}
+
+void
+cmdcenter::set_patch_syscall(bool enable) {
+  scout_flags &= ~scout::FLAG_PATCH_SYSCALL;
+  if (enable) {
+    scout_flags |= scout::FLAG_PATCH_SYSCALL;
+  }
+}
+
+void
+cmdcenter::set_msg_ring(bool enable) {
+  scout_flags &= ~scout::FLAG_MSG_RING;
+  if (enable) {
+    scout_flags |= scout::FLAG_MSG_RING;
+  }
+}
+
+void
+cmdcenter::set_file_images(bool enable) {
+  if (enable && images == nullptr) {
+    images = new file_images();
+  } else if (!enable) {
+    delete images;
+    images = nullptr;
+  }
+}
+
+void
+cmdcenter::set_fd_cache(bool enable) {
+  if (enable && fds == nullptr) {
+    fds = new fd_cache();
+  } else if (!enable) {
+    delete fds;
+    fds = nullptr;
+  }
+}
+
+void
+cmdcenter::set_exec_stub(bool enable) {
+  scout_flags &= ~scout::FLAG_EXEC_STUB;
+  if (enable) {
+    scout_flags |= scout::FLAG_EXEC_STUB;
+  }
+}
+
+/**
+ * The stub is mosingar-exec next to the Carrier.
+ */
+bool
+cmdcenter::init_exec_stub() {
+  auto exec = &shm->exec;
+  exec->flags = 0;
+
+  char path[PATH_MAX];
+  auto len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (len <= 0) {
+    return false;
+  }
+  path[len] = 0;
+  std::string stub(path);
+  stub.resize(stub.rfind('/') + 1);
+  stub.append("mosingar-exec");
+  if (stub.size() >= sizeof(exec->stub_path) ||
+      access(stub.c_str(), X_OK) < 0 ||
+      !flightdeck::prepare_exec_stub(exec)) {
+    return false;
+  }
+  strcpy(exec->stub_path, stub.c_str());
+  exec->flags = scout::FLAG_FILTER_INSTALLED | scout::FLAG_CC_COMM_READY |
+    scout_flags;
+  return true;
+}
+
 void
 cmdcenter::stop_msg_loop() {
   int cmd = STOP_MSG_LOOP_CMD;
@@ -220,6 +1100,12 @@ cmdcenter::stop_msg_loop() {
  */
 pid_t
 cmdcenter::start_mission(int argc, char*const* argv) {
+  if ((scout_flags & scout::FLAG_EXEC_STUB) &&
+      (shm == nullptr || !init_exec_stub())) {
+    fprintf(stderr, "The exec stub is not available, exec with ptrace\n");
+    scout_flags &= ~scout::FLAG_EXEC_STUB;
+  }
+
   int toffsocks[2];
   _EI(socketpair, AF_UNIX, SOCK_STREAM, 0, toffsocks);
 
@@ -245,7 +1131,7 @@ cmdcenter::start_mission(int argc, char*const* argv) {
       _EA(waitpid, childpid, &status, 0);
     } while(!WIFSTOPPED(status) && WSTOPSIG(status) != SIGTRAP);
 
-    _EI(flightdeck::scout_takeoff, childpid, 0);
+    _EI(flightdeck::scout_takeoff, childpid, scout_flags);
 
     // Detach the process or it might be blocked for serveral reasons.
     r = ptrace(PTRACE_DETACH, childpid, nullptr, 0);
@@ -304,14 +1190,34 @@ cmdcenter::handle_scout_msg(int sock) {
     return false;
   }
 
+  // A datagram may carry notifications before the request.  See
+  // bridge.cpp for the protocol.
   auto ptr = rcvr->get_data();
-  auto payload_bytes = *(int*)ptr;
-  ptr += sizeof(int);
-  auto data_end = ptr + payload_bytes;
-  assert((unsigned)rcvr->get_data_bytes() == (payload_bytes + sizeof(int)));
+  auto end = ptr + rcvr->get_data_bytes();
+  while (ptr < end) {
+    assert((unsigned)(end - ptr) >= sizeof(int));
+    auto payload_bytes = *(int*)ptr;
+    ptr += sizeof(int);
+    auto data_end = ptr + payload_bytes;
+    assert(data_end <= end);
+    if (!handle_scout_cmd(sock, nullptr, rcvr.get(), ptr, data_end)) {
+      return false;
+    }
+    ptr = data_end;
+  }
+  return true;
+}
 
+bool
+cmdcenter::handle_scout_cmd(int sock, msgring* ring, msg_receiver* rcvr,
+                            const char* ptr, const char* data_end) {
+  // 0 for notifications.
+  auto id = *(unsigned int*)ptr;
+  ptr += sizeof(int);
   auto cmd = *(int*)ptr;
   ptr += sizeof(int);
+  // Requests carrying fds come from the socket only.
+  assert(rcvr != nullptr || ring != nullptr);
 
   switch (cmd) {
   case scout::cmd_hello:
@@ -323,11 +1229,13 @@ cmdcenter::handle_scout_msg(int sock) {
     {
       LOGU(cmd_openat);
       int dirfd;
+      unsigned int dir_handle;
       const char* path;
       int flags;
       mode_t mode;
       auto unpacker = tinyunpacker(ptr, data_end - ptr)
         .field(dirfd)
+        .field(dir_handle)
         .field(path)
         .field(flags)
         .field(mode);
@@ -335,30 +1243,73 @@ cmdcenter::handle_scout_msg(int sock) {
       assert(unpacker.check_completed());
       unpacker.unpack();
 
-      assert(rcvr->get_fd_rcvd_num() == 1 || dirfd < 0);
-      if (dirfd >= 0) {
-        dirfd = rcvr->get_fd_rcvd()[0];
+      int passed_fd = -1;
+      auto fd = -ENOSYS;
+      if (images && dirfd == AT_FDCWD && shm) {
+        fd = images->open(path, flags, shm->generation);
       }
-
-      auto fd = openat(dirfd, path, flags, mode);
-      if (fd < 0) {
-        fd = -errno;
+      if (fd == -ENOSYS && fds && dirfd == AT_FDCWD && shm) {
+        fd = fds->open(path, flags, shm->generation);
       }
-      if (dirfd >= 0) {
-        close(dirfd);
+      if (fd != -ENOSYS) {
+        // Served by images or the cache.
+      } else if (!get_scout_fd(sock, rcvr, dir_handle, &dirfd, &passed_fd,
+                               path)) {
+        fd = -ESTALE;
+      } else {
+        // Kept fds should not leak to subjects of new missions.
+        fd = openat(dirfd, path, flags | O_CLOEXEC, mode);
+        if (fd < 0) {
+          fd = -errno;
+        }
       }
-
-      auto packer = tinypacker()
-        .field(fd);
-      auto reply = packer.pack_size_prefix();
-      auto r = send_msg(sock, reply, packer.get_size_prefix(), fd);
-      close(fd);
-      if (r < 0) {
+      if (passed_fd >= 0) {
+        close(passed_fd);
+      }
+      free((void*)path);
+      if (!reply_open(sock, id, fd, flags)) {
         return false;
       }
+    }
+    break;
+
+  case scout::cmd_openat2:
+    {
+      LOGU(cmd_openat2);
+      int dirfd;
+      unsigned int dir_handle;
+      const char* path;
+      open_how how;
+      auto unpacker = tinyunpacker(ptr, data_end - ptr)
+        .field(dirfd)
+        .field(dir_handle)
+        .field(path)
+        .field(how);
+
+      assert(unpacker.check_completed());
+      unpacker.unpack();
 
+      int passed_fd;
+      int fd;
+      if (!get_scout_fd(sock, rcvr, dir_handle, &dirfd, &passed_fd,
+                        path)) {
+        fd = -ESTALE;
+      } else {
+        auto flags = how.flags;
+        how.flags |= O_CLOEXEC;
+        fd = syscall(__NR_openat2, dirfd, path, &how, sizeof(how));
+        if (fd < 0) {
+          fd = -errno;
+        }
+        how.flags = flags;
+      }
+      if (passed_fd >= 0) {
+        close(passed_fd);
+      }
       free((void*)path);
-      free(reply);
+      if (!reply_open(sock, id, fd, (int)how.flags)) {
+        return false;
+      }
     }
     break;
 
@@ -367,27 +1318,23 @@ cmdcenter::handle_scout_msg(int sock) {
       LOGU(cmd_access);
       char* path;
       int mode;
-      auto unpacker = tinyunpacker(ptr, data_end -ptr)
-        .field(path)
-        .field(mode);
-
-      assert(unpacker.check_completed());
-      unpacker.unpack();
-      LOGU(access);
+      unpack_cmd(ptr, data_end, path, mode);
 
-      auto r = access(path, mode);
+      auto dirfd = open_scout_cwd(sock, path);
+      auto r = faccessat(dirfd, path, mode, 0);
       if (r < 0) {
         r = -errno;
       }
+      if (dirfd >= 0) {
+        close(dirfd);
+      }
+      publish_meta(META_ACCESS, path, mode, r, nullptr, 0);
 
-      LOGU(packer);
       auto packer = tinypacker()
+        .field(id)
         .field(r);
-      packer.pack();
-      auto result = packer.pack_size_prefix();
-      send_msg(sock, result, packer.get_size_prefix());
+      _E(reply_packer, sock, ring, packer);
 
-      free(result);
       free(path);
     }
     break;
@@ -396,32 +1343,182 @@ cmdcenter::handle_scout_msg(int sock) {
     {
       LOGU(cmd_fstat);
       int fd;
-      auto unpacker = tinyunpacker(ptr, data_end - ptr)
-        .field(fd);
+      unsigned int handle;
+      unpack_cmd(ptr, data_end, fd, handle);
 
-      assert(unpacker.check_completed());
-      unpacker.unpack();
-      if (fd >= 0) {
-        if (rcvr->get_fd_rcvd_num() != 1) {
-          sleep(300);
+      int passed_fd;
+      struct stat statbuf;
+      int r;
+      if (!get_scout_fd(sock, rcvr, handle, &fd, &passed_fd)) {
+        r = -ESTALE;
+        bzero(&statbuf, sizeof(statbuf));
+      } else {
+        r = fstat(fd, &statbuf);
+        if (r < 0) {
+          r = -errno;
+        } else if (images) {
+          images->fix_stat(&statbuf);
         }
-        assert(rcvr->get_fd_rcvd_num() == 1);
-        fd = rcvr->get_fd_rcvd()[0];
       }
+      if (passed_fd >= 0) {
+        close(passed_fd);
+      }
+
+      auto packer = tinypacker()
+        .field(id)
+        .field(r)
+        .field(statbuf);
+      _E(reply_packer, sock, ring, packer);
+    }
+    break;
+
+  case scout::cmd_newfstatat:
+    {
+      LOGU(cmd_newfstatat);
+      int dirfd;
+      unsigned int handle;
+      const char* path;
+      int flags;
+      unpack_cmd(ptr, data_end, dirfd, handle, path, flags);
 
+      int passed_fd;
       struct stat statbuf;
-      auto r = fstat(fd, &statbuf);
-      if (r < 0) {
-        r = -errno;
+      int r;
+      if (!get_scout_fd(sock, rcvr, handle, &dirfd, &passed_fd, path)) {
+        r = -ESTALE;
+        bzero(&statbuf, sizeof(statbuf));
+      } else {
+        r = fstatat(dirfd, path, &statbuf, flags);
+        if (r < 0) {
+          r = -errno;
+        } else if (images) {
+          images->fix_stat(&statbuf);
+        }
       }
-      if (fd >= 0) {
-        close(fd);
+      if (passed_fd >= 0) {
+        close(passed_fd);
       }
+      free((void*)path);
 
       auto packer = tinypacker()
+        .field(id)
         .field(r)
         .field(statbuf);
-      _E(send_msg_packer, sock, packer);
+      _E(reply_packer, sock, ring, packer);
+    }
+    break;
+
+  case scout::cmd_statx:
+    {
+      LOGU(cmd_statx);
+      int dirfd;
+      unsigned int handle;
+      const char* path;
+      int flags;
+      unsigned int mask;
+      unpack_cmd(ptr, data_end, dirfd, handle, path, flags, mask);
+
+      int passed_fd;
+      struct statx statxbuf;
+      int r;
+      bzero(&statxbuf, sizeof(statxbuf));
+      if (!get_scout_fd(sock, rcvr, handle, &dirfd, &passed_fd, path)) {
+        r = -ESTALE;
+      } else {
+        r = statx(dirfd, path, flags, mask, &statxbuf);
+        if (r < 0) {
+          r = -errno;
+        } else if (images) {
+          images->fix_statx(&statxbuf);
+        }
+      }
+      if (passed_fd >= 0) {
+        close(passed_fd);
+      }
+      free((void*)path);
+
+      auto packer = tinypacker()
+        .field(id)
+        .field(r)
+        .field(statxbuf);
+      _E(reply_packer, sock, ring, packer);
+    }
+    break;
+
+  case scout::cmd_faccessat:
+  case scout::cmd_faccessat2:
+    {
+      LOGU(cmd_faccessat2);
+      int dirfd;
+      unsigned int handle;
+      const char* path;
+      int mode;
+      int flags;
+      unpack_cmd(ptr, data_end, dirfd, handle, path, mode, flags);
+
+      int passed_fd;
+      int r;
+      if (!get_scout_fd(sock, rcvr, handle, &dirfd, &passed_fd, path)) {
+        r = -ESTALE;
+      } else {
+        r = faccessat(dirfd, path, mode, flags);
+        if (r < 0) {
+          r = -errno;
+        }
+      }
+      if (passed_fd >= 0) {
+        close(passed_fd);
+      }
+      free((void*)path);
+
+      auto packer = tinypacker()
+        .field(id)
+        .field(r);
+      _E(reply_packer, sock, ring, packer);
+    }
+    break;
+
+  case scout::cmd_getdents64:
+    {
+      LOGU(cmd_getdents64);
+      int fd;
+      unsigned int handle;
+      unsigned int count;
+      unpack_cmd(ptr, data_end, fd, handle, count);
+      if (count > MAX_REPLY_DATA) {
+        count = MAX_REPLY_DATA;
+      }
+
+      // The fd shares the offset with the one of the subject.
+      int passed_fd;
+      auto buf = new char[count];
+      char dirpath[CC_SHM_PATH_MAX];
+      dirpath[0] = 0;
+      int r;
+      if (!get_scout_fd(sock, rcvr, handle, &fd, &passed_fd)) {
+        r = -ESTALE;
+      } else {
+        r = syscall(__NR_getdents64, fd, buf, count);
+        if (r < 0) {
+          r = -errno;
+        } else if (r > 0) {
+          prefetch_dents(fd, buf, r, dirpath, sizeof(dirpath));
+        }
+      }
+      if (passed_fd >= 0) {
+        close(passed_fd);
+      }
+
+      // The scout looks up the entries with the path of the
+      // directory.
+      varbuf vbuf(buf, r < 0 ? 0 : r);
+      auto packer = tinypacker()
+        .field(id)
+        .field(r)
+        .field((const char*)dirpath)
+        .field(vbuf);
+      _E(reply_packer, sock, ring, packer);
+      delete[] buf;
     }
     break;
 
@@ -429,23 +1526,25 @@ cmdcenter::handle_scout_msg(int sock) {
     {
       LOGU(cmd_fstat);
       const char* path;
-      auto unpacker = tinyunpacker(ptr, data_end - ptr)
-        .field(path);
-
-      assert(unpacker.check_completed());
-      unpacker.unpack();
+      unpack_cmd(ptr, data_end, path);
 
       struct stat statbuf;
-      auto r = stat(path, &statbuf);
+      auto dirfd = open_scout_cwd(sock, path);
+      auto r = fstatat(dirfd, path, &statbuf, 0);
       if (r < 0) {
         r = -errno;
       }
+      if (dirfd >= 0) {
+        close(dirfd);
+      }
+      publish_meta(META_STAT, path, 0, r, &statbuf, sizeof(statbuf));
       free((void*)path);
 
       auto packer = tinypacker()
+        .field(id)
         .field(r)
         .field(statbuf);
-      _E(send_msg_packer, sock, packer);
+      _E(reply_packer, sock, ring, packer);
     }
     break;
 
@@ -453,23 +1552,25 @@ cmdcenter::handle_scout_msg(int sock) {
     {
       LOGU(cmd_fstat);
       const char* path;
-      auto unpacker = tinyunpacker(ptr, data_end - ptr)
-        .field(path);
-
-      assert(unpacker.check_completed());
-      unpacker.unpack();
+      unpack_cmd(ptr, data_end, path);
 
       struct stat statbuf;
-      auto r = lstat(path, &statbuf);
+      auto dirfd = open_scout_cwd(sock, path);
+      auto r = fstatat(dirfd, path, &statbuf, AT_SYMLINK_NOFOLLOW);
       if (r < 0) {
         r = -errno;
       }
+      if (dirfd >= 0) {
+        close(dirfd);
+      }
+      publish_meta(META_LSTAT, path, 0, r, &statbuf, sizeof(statbuf));
       free((void*)path);
 
       auto packer = tinypacker()
+        .field(id)
         .field(r)
         .field(statbuf);
-      _E(send_msg_packer, sock, packer);
+      _E(reply_packer, sock, ring, packer);
     }
     break;
 
@@ -488,7 +1589,7 @@ cmdcenter::handle_scout_msg(int sock) {
 
       extern bool sigchld_ignore;
       sigchld_ignore = true;
-      auto ok = handle_exec(pid, sock);
+      auto ok = handle_exec(pid, sock, id);
       sigchld_ignore = false;
       if (!ok) {
         return false;
@@ -497,6 +1598,27 @@ cmdcenter::handle_scout_msg(int sock) {
     }
     break;
 
+  case scout::cmd_stub_exec:
+    {
+      LOGU(cmd_stub_exec);
+      int pid;
+      const char* path;
+      unpack_cmd(ptr, data_end, pid, path);
+
+      // Before ld.so starts looking for libraries, like
+      // handle_exec().
+      prefetch_libs(pid, path);
+
+      int r = 0;
+      auto packer = tinypacker()
+        .field(id)
+        .field(r);
+      _E(reply_packer, sock, ring, packer);
+
+      free((void*)path);
+    }
+    break;
+
   case scout::cmd_readlink:
     {
       LOGU(cmd_readlink);
@@ -510,18 +1632,27 @@ cmdcenter::handle_scout_msg(int sock) {
       unpacker.unpack();
 
       auto buf = new char[bufsize];
-      auto retv = (int)readlink(path, buf, bufsize);
+      auto dirfd = open_scout_cwd(sock, path);
+      auto retv = (int)readlinkat(dirfd, path, buf, bufsize);
       if (retv < 0) {
         retv = -errno;
       }
+      if (dirfd >= 0) {
+        close(dirfd);
+      }
+      // A truncated link can not serve bigger buffers.
+      if (retv < 0 || (size_t)retv < bufsize) {
+        publish_meta(META_READLINK, path, 0, retv, buf, retv < 0 ? 0 : retv);
+      }
 
       fixedbuf fbuf(buf, bufsize);
       auto packer = tinypacker()
+        .field(id)
         .field(retv)
         .field(fbuf);
-      _E(send_msg_packer, sock, packer);
+      _E(reply_packer, sock, ring, packer);
 
-      delete buf;
+      delete[] buf;
       free((void*)path);
     }
     break;
@@ -530,25 +1661,97 @@ cmdcenter::handle_scout_msg(int sock) {
     {
       LOGU(cmd_unlink);
       const char* path;
-      auto unpacker = tinyunpacker(ptr, data_end - ptr)
-        .field(path);
-
-      assert(unpacker.check_completed());
-      unpacker.unpack();
+      unpack_cmd(ptr, data_end, path);
 
-      auto r = unlink(path);
+      auto dirfd = open_scout_cwd(sock, path);
+      auto r = unlinkat(dirfd, path, 0);
       if (r < 0) {
         r = -errno;
       }
+      if (dirfd >= 0) {
+        close(dirfd);
+      }
+      if (r == 0) {
+        bump_generation();
+      }
 
       auto packer = tinypacker()
+        .field(id)
         .field(r);
-      _E(send_msg_packer, sock, packer);
+      _E(reply_packer, sock, ring, packer);
 
       free((void*)path);
     }
     break;
 
+  case scout::cmd_vfork:
+    {
+      // A notification, no reply.
+      LOGU(cmd_vfork);
+      pid_t pid;
+      unpack_cmd(ptr, data_end, pid);
+    }
+    break;
+
+  case scout::cmd_fs_changed:
+    {
+      LOGU(cmd_fs_changed);
+      assert(ptr == data_end);
+      bump_generation();
+
+      auto packer = tinypacker()
+        .field(id)
+        .field(0);
+      _E(reply_packer, sock, ring, packer);
+    }
+    break;
+
+  case scout::cmd_wake:
+    {
+      // The reply of the request |id| has been taken by a request
+      // nested in it, wake the request up from recvmsg().
+      LOGU(cmd_wake);
+      assert(ptr == data_end);
+
+      auto packer = tinypacker()
+        .field(id)
+        .field(0);
+      _E(reply_packer, sock, ring, packer);
+    }
+    break;
+
+  case scout::cmd_notify_fd:
+    {
+      LOGU(cmd_notify_fd);
+      assert(ptr == data_end);
+      assert(rcvr->get_fd_rcvd_num() == 1);
+      if (!add_notify(rcvr->get_fd_rcvd()[0])) {
+        return false;
+      }
+    }
+    break;
+
+  case scout::cmd_ring:
+    {
+      LOGU(cmd_ring);
+      assert(ptr == data_end);
+      assert(rcvr->get_fd_rcvd_num() == 2);
+      auto memfd = rcvr->get_fd_rcvd()[0];
+      auto ringefd = rcvr->get_fd_rcvd()[1];
+      int r = 0;
+      if (!add_ring(sock, memfd, ringefd)) {
+        close(ringefd);
+        r = -1;
+      }
+      close(memfd);
+
+      auto packer = tinypacker()
+        .field(id)
+        .field(r);
+      _E(send_msg_packer, sock, packer);
+    }
+    break;
+
   default:
     printf("Unknown cmd %x\n", cmd);
     return false;
@@ -556,3 +1759,206 @@ cmdcenter::handle_scout_msg(int sock) {
 
   return true;
 }
+
+/**
+ * Install |fd| to the subject as the result of the notified open.
+ *
+ * The reply is sent along with the fd atomically.  Return a negative
+ * error code if the caller should reply the error instead.
+ */
+static int
+notify_addfd(int notifyfd, const seccomp_notif* req, int fd, int flags) {
+  seccomp_notif_addfd addfd;
+  memset(&addfd, 0, sizeof(addfd));
+  addfd.id = req->id;
+  addfd.flags = SECCOMP_ADDFD_FLAG_SEND;
+  addfd.srcfd = fd;
+  addfd.newfd_flags = flags & O_CLOEXEC;
+  auto r = ioctl(notifyfd, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+  if (r >= 0 || errno == ENOENT) {
+    // ENOENT: the subject was interrupted or killed.
+    return 0;
+  }
+  return -errno;
+}
+
+/**
+ * Serve a syscall from the listener fd of a seccomp filter.
+ *
+ * Arguments are read from the memory of the subject, and results
+ * are written back to the memory of the subject before replying.
+ * Relative paths are resolved against the cwd or the dirfd of the
+ * subject.
+ */
+bool
+cmdcenter::handle_notify(int notifyfd) {
+  LOGU(handle_notify);
+  char req_buf[notif_sizes.seccomp_notif];
+  char resp_buf[notif_sizes.seccomp_notif_resp];
+  auto req = (seccomp_notif*)req_buf;
+  auto resp = (seccomp_notif_resp*)resp_buf;
+
+  memset(req_buf, 0, sizeof(req_buf));
+  auto r = ioctl(notifyfd, SECCOMP_IOCTL_NOTIF_RECV, req);
+  if (r < 0) {
+    if (errno == ENOENT) {
+      // The subject has been interrupted or killed.
+      return true;
+    }
+    perror("ioctl SECCOMP_IOCTL_NOTIF_RECV");
+    return false;
+  }
+
+  auto pid = req->pid;
+  auto nr = req->data.nr;
+  auto args = req->data.args;
+  int dirfd = nr == __NR_openat ? (int)args[0] : AT_FDCWD;
+  auto path_addr = (void*)(nr == __NR_openat ? args[1] : args[0]);
+
+  long val = 0;
+  int error = 0;
+  char path[PATH_MAX];
+  auto plen = read_cstr(pid, path_addr, path, sizeof(path));
+  if (plen < 0) {
+    error = plen == -ENAMETOOLONG ? plen : -EFAULT;
+  }
+  // Make sure that what we have read is from the subject, not from
+  // a new process reusing the pid.
+  r = ioctl(notifyfd, SECCOMP_IOCTL_NOTIF_ID_VALID, &req->id);
+  if (r < 0) {
+    return true;
+  }
+
+  if (!error && is_local_path(path)) {
+    // Let the kernel make the call for the subject.  The path is read
+    // again, the subject may have changed it meanwhile, but it is
+    // the subject's own business.
+    LOGU(notify local);
+    __atomic_add_fetch(&shm->stats.local, 1, __ATOMIC_RELAXED);
+    memset(resp_buf, 0, sizeof(resp_buf));
+    resp->id = req->id;
+    resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+    r = ioctl(notifyfd, SECCOMP_IOCTL_NOTIF_SEND, resp);
+    if (r < 0 && errno != ENOENT) {
+      perror("ioctl SECCOMP_IOCTL_NOTIF_SEND");
+      return false;
+    }
+    return true;
+  }
+
+  int dfd = AT_FDCWD;
+  if (!error && path[0] != '/') {
+    dfd = open_subject_dir(pid, dirfd);
+    if (dfd < 0) {
+      error = dfd;
+    }
+  }
+
+  if (!error) {
+    switch (nr) {
+    case __NR_open:
+    case __NR_openat:
+      {
+        LOGU(notify open);
+        auto flags = (int)(nr == __NR_open ? args[1] : args[2]);
+        auto mode = (mode_t)(nr == __NR_open ? args[2] : args[3]);
+        // Create files with the umask of the subject.
+        auto creating = (flags & O_CREAT) ||
+          (flags & O_TMPFILE) == O_TMPFILE;
+        auto saved_mask = creating ? umask(get_subject_umask(pid)) : 0;
+        auto fd = openat(dfd, path, flags | O_CLOEXEC, mode);
+        error = fd < 0 ? -errno : 0;
+        if (creating) {
+          umask(saved_mask);
+        }
+        if (fd < 0) {
+          break;
+        }
+        if (is_opening_for_write(flags)) {
+          // The writes that follow are not seen here.
+          bump_generation();
+        }
+        error = notify_addfd(notifyfd, req, fd, flags);
+        close(fd);
+        if (!error) {
+          if (dfd >= 0) {
+            close(dfd);
+          }
+          return true;
+        }
+      }
+      break;
+
+    case __NR_stat:
+      {
+        LOGU(notify stat);
+        struct stat statbuf;
+        if (fstatat(dfd, path, &statbuf, 0) < 0) {
+          error = -errno;
+          publish_meta(META_STAT, path, 0, error, nullptr, 0);
+          break;
+        }
+        publish_meta(META_STAT, path, 0, 0, &statbuf, sizeof(statbuf));
+        error = write_mem(pid, (void*)args[1], &statbuf, sizeof(statbuf));
+      }
+      break;
+
+    case __NR_access:
+      LOGU(notify access);
+      if (faccessat(dfd, path, (int)args[1], 0) < 0) {
+        error = -errno;
+      }
+      publish_meta(META_ACCESS, path, (int)args[1], error, nullptr, 0);
+      break;
+
+    case __NR_readlink:
+      {
+        LOGU(notify readlink);
+        auto bufsize = (size_t)args[2];
+        if (bufsize > PATH_MAX) {
+          bufsize = PATH_MAX;
+        }
+        char buf[PATH_MAX];
+        auto sz = readlinkat(dfd, path, buf, bufsize);
+        if (sz < 0) {
+          error = -errno;
+          publish_meta(META_READLINK, path, 0, error, nullptr, 0);
+          break;
+        }
+        if ((size_t)sz < bufsize) {
+          publish_meta(META_READLINK, path, 0, sz, buf, sz);
+        }
+        error = write_mem(pid, (void*)args[1], buf, sz);
+        val = sz;
+      }
+      break;
+
+    case __NR_unlink:
+      LOGU(notify unlink);
+      if (unlinkat(dfd, path, 0) < 0) {
+        error = -errno;
+      } else {
+        bump_generation();
+      }
+      break;
+
+    default:
+      error = -ENOSYS;
+      break;
+    }
+  }
+  if (dfd >= 0) {
+    close(dfd);
+  }
+
+  memset(resp_buf, 0, sizeof(resp_buf));
+  resp->id = req->id;
+  resp->val = error ? 0 : val;
+  resp->error = error;
+  r = ioctl(notifyfd, SECCOMP_IOCTL_NOTIF_SEND, resp);
+  if (r < 0 && errno != ENOENT) {
+    perror("ioctl SECCOMP_IOCTL_NOTIF_SEND");
+    return false;
+  }
+  return true;
+}
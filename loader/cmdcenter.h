@@ -4,8 +4,19 @@
 #ifndef __cmdcenter_h_
 #define __cmdcenter_h_
 
+#include "ccshm.h"
+#include "libmap.h"
+#include "fileimages.h"
+#include "fdcache.h"
+
+#include <stdio.h>
 #include <sys/types.h>
+#include <linux/seccomp.h>
 #include <list>
+#include <string>
+
+class msg_receiver;
+class msgring;
 
 // Use this is the unix socket to talk to the command center.
 #define CARRIER_SOCK 73
@@ -25,15 +36,55 @@
  *
  * The socket created by a scout will be removed when it is
  * disconncted either for error and death.
+ *
+ * The Command Center also shares a piece of memory, cc_shm, with all
+ * scouts through the fixed fd CC_SHM_FD.  It publishes the generation
+ * of the file system there for scouts to know when the metadata that
+ * they remember become stale.
+ *
+ * Scouts may also pass a ring in shared memory (see msgring.h) along
+ * with an eventfd.  Requests without fds are sent through the ring
+ * and the eventfd wakes up the Command Center.  Replies are written
+ * back to the ring.
+ *
+ * Files opened for reading by the Command Center for a scout are kept
+ * open for a while, and the scout is given a handle along with the
+ * fd.  Following requests on the fd, fstat() and openat() relative to
+ * it, carry the handle instead of passing the fd again.
+ *
+ * For a mission in the user notification mode, scouts also pass
+ * the listener fd of their seccomp filter.  The Command Center serves
+ * notified syscalls by reading and writing the memory of the subject
+ * directly, the scout doesn't take part in.
  */
 class cmdcenter {
 public:
   constexpr static int max_events = 16;
   constexpr static int max_cmsg_buf = 64;
+  // Number of fds kept open for a scout, see |keep_fd()|.
+  constexpr static int handle_slots = 16;
+  // Max number of fds kept open for all scouts.
+  constexpr static int max_kept_fds = 512;
+  // Max number of executables that library maps are kept for.
+  constexpr static int max_libmaps = 64;
 
   constexpr static int SCOUT_CONNECT_CMD = 0x37fa;
   constexpr static int STOP_MSG_LOOP_CMD = 0x37fb;
 
+  /**
+   * How scouts of a mission intercept syscalls.
+   */
+  enum intercept_mode {
+    // Every intercepted syscall traps with SIGSYS and is forwarded
+    // by the scout.
+    INTERCEPT_SIGSYS,
+    // Simple syscalls are served from the seccomp notification fd.
+    INTERCEPT_USER_NOTIF,
+    // Syscalls are trapped by Syscall User Dispatch, and the ones
+    // not intercepted are passed through by the scout.
+    INTERCEPT_USER_DISPATCH,
+  };
+
   /**
    * \param fd is the socket of the Carrier process.
    */
@@ -44,7 +95,7 @@ public:
 
   bool handle_message();
   void handle_messages();
-  bool handle_exec(pid_t pid, int sock);
+  bool handle_exec(pid_t pid, int sock, unsigned int id);
   /**
    * Whenever a new scout is deployed, it establishes a communication
    * channel with the Command Center, and the FD will be added to the
@@ -61,18 +112,188 @@ public:
     return scoutfds.size();
   }
 
+  /**
+   * The listener fd of the seccomp filter of a subject and its
+   * descendants.  It is removed once all of them are gone.
+   */
+  bool add_notify(int notifyfd);
+  bool remove_notify(int notifyfd);
+
+  /**
+   * The ring of a scout shared with the Command Center.  It is
+   * removed along with the socket of the scout.
+   */
+  bool add_ring(int scoutfd, int memfd, int ringfd);
+  bool remove_ring(int scoutfd);
+
+  /**
+   * Select how scouts of following missions intercept syscalls.
+   */
+  void set_intercept_mode(intercept_mode mode);
+  /**
+   * Let scouts of following missions rewrite the sites of trapped
+   * syscalls to skip SIGSYS next time.
+   */
+  void set_patch_syscall(bool enable);
+  /**
+   * Let scouts of following missions send requests through rings in
+   * shared memory.
+   */
+  void set_msg_ring(bool enable);
+  /**
+   * Let scouts make calls on the paths under the absolute directory
+   * |path| by themselves.  /proc, /dev and /sys are always local.
+   *
+   * Return false if |path| is not absolute or the trie is full.
+   */
+  bool add_local_path(const char* path);
+  /**
+   * Serve opens of small files for reading from images in memfds,
+   * see fileimages.h.
+   */
+  void set_file_images(bool enable);
+  /**
+   * Reopen files opened for reading through a cache, see fdcache.h.
+   */
+  void set_fd_cache(bool enable);
+  /**
+   * Let scouts of following missions exec programs through the exec
+   * stub, without being attached with ptrace.  See execstub.cpp.
+   */
+  void set_exec_stub(bool enable);
+
   void stop_msg_loop();
 
+  /**
+   * Print the counters of the metadata table to size it.
+   */
+  void print_shm_stats(FILE* fp);
+
   pid_t start_mission(int argc, char*const* argv);
 
 private:
+  struct scout_ring {
+    // The socket of the scout.
+    int sock;
+    // The eventfd that the scout wakes up the Command Center with.
+    int efd;
+    msgring* ring;
+  };
+
   bool handle_carrier_msg();
   bool handle_scout_msg(int sock);
+  /**
+   * Handle a command from a scout, received from |rcvr| or |ring|.
+   * The reply is sent back through the ring if |ring| is not null.
+   */
+  bool handle_scout_cmd(int sock, msgring* ring, msg_receiver* rcvr,
+                        const char* ptr, const char* data_end);
+  bool handle_ring(scout_ring* ring);
+  scout_ring* find_ring(int ringfd);
+  /**
+   * Keep |fd| opened for the scout at |sock| and return the handle,
+   * or 0 if it is not kept.  The oldest fd of the scout is closed to
+   * make room.
+   */
+  unsigned int keep_fd(int sock, int fd);
+  /**
+   * Return the fd kept for |handle| if it is still the same file as
+   * |scout_fd| in the subject, or -1.  The subject may have closed
+   * the fd and reused the number without the scout knowing.
+   */
+  int find_kept_fd(int sock, unsigned int handle, int scout_fd);
+  void drop_kept_fds(int sock);
+  /**
+   * Find the fd of the Command Center for |*fd| of a scout, either
+   * kept for |handle| or passed along with the request, and replace
+   * |*fd| with it.  |*passed_fd| is the one to close after serving
+   * the request, or -1.
+   *
+   * If |*fd| is AT_FDCWD and |path| is relative, it is replaced with
+   * the cwd of the subject.
+   *
+   * Return false if |handle| is stale, the scout should pass the fd.
+   */
+  bool get_scout_fd(int sock, msg_receiver* rcvr, unsigned int handle,
+                    int* fd, int* passed_fd, const char* path = nullptr);
+  int open_scout_cwd(int sock, const char* path);
+  bool reply_open(int sock, unsigned int id, int fd, int flags);
+  bool handle_notify(int notifyfd);
+  bool is_notify(int fd);
+  bool init_shm();
+  bool is_local_path(const char* path);
+  /**
+   * Tell scouts that the file system has been changed.
+   */
+  void bump_generation();
+  /**
+   * The subject of the scout has opened a file for writing.  Its
+   * writes are not seen, so the generation is bumped again once the
+   * scout is gone.
+   */
+  void mark_dirty(int scoutfd);
+  /**
+   * Publish the result of a metadata call in the shared memory for
+   * all scouts.  |data| is the struct stat or the link, |size|
+   * bytes.
+   */
+  void publish_meta(meta_kind kind, const char* path, int arg, int result,
+                    const void* data, size_t size);
+  void prefetch_dents(int dirfd, const char* dents, int bytes,
+                      char* dirpath, size_t size);
+  /**
+   * Publish the stat of the paths that the dynamic linker of a
+   * subject is going to probe, right after exec.  |exe| is the
+   * program, or nullptr for /proc/<pid>/exe.
+   */
+  void prefetch_libs(pid_t pid, const char* exe = nullptr);
+  /**
+   * Set up cc_shm_exec for the exec stub.
+   */
+  bool init_exec_stub();
+
+  /**
+   * The library map of an executable, keyed by its path, inode and
+   * mtime, and the LD_LIBRARY_PATH and the cwd that it runs with.
+   */
+  struct exe_libmap {
+    std::string key;
+    libmap map;
+  };
+
+  /**
+   * fds opened for a scout and kept by the Command Center.  Handles
+   * keep growing, a handle is at the slot of handle % handle_slots.
+   */
+  struct scout_handles {
+    int sock;
+    // The process that the scout lives in.
+    pid_t pid;
+    unsigned int last_handle;
+    unsigned int handles[handle_slots];
+    int fds[handle_slots];
+  };
+  scout_handles* find_handles(int sock, bool create);
 
   bool stopping_message;
   int efd;
   int carrierfd;
+  // Flags passed to all scouts taking off for missions.
+  unsigned long scout_flags;
   std::list<int> scoutfds;
+  std::list<int> notifyfds;
+  std::list<int> dirty_scoutfds;
+  std::list<scout_ring> rings;
+  std::list<scout_handles> handles;
+  // The most recent first.
+  std::list<exe_libmap> libmaps;
+  int kept_fds;
+  cc_shm* shm;
+  // nullptr if images are not served.
+  file_images* images;
+  // nullptr if opens are not cached.
+  fd_cache* fds;
+  seccomp_notif_sizes notif_sizes;
 };
 
 #endif /* __cmdcenter_h_ */
@@ -0,0 +1,352 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#ifndef __elfparser_h_
+#define __elfparser_h_
+
+#include "errhandle.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <assert.h>
+
+#include <elf.h>
+
+/**
+ * Read the headers and the dynamic information of an ELF file.
+ *
+ * It is used by the Flight Deck to load libmosingar.so into
+ * subjects, and by the Command Center to find the libraries that
+ * executables need.
+ */
+class ElfParser {
+public:
+  ElfParser(const char* so_path)
+    : so_path(so_path)
+    , fd(-1)
+    , hdr_valid(false)
+    , phdrs(nullptr)
+    , dyns(nullptr)
+    , dyn_num(0)
+    , shdrs(nullptr)
+    , shstrtab(nullptr)
+    , dynsym(nullptr)
+    , dynstr(nullptr)
+    , dyn_strtab(nullptr)
+    , dyn_strtab_bytes(0) {
+  }
+  ~ElfParser() {
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (phdrs) {
+      delete[] phdrs;
+    }
+    if (dyns) {
+      delete[] dyns;
+    }
+    if (shdrs) {
+      delete[] shdrs;
+    }
+    if (shstrtab) {
+      delete shstrtab;
+    }
+    if (dynsym) {
+      delete dynsym;
+    }
+    if (dynstr) {
+      delete dynstr;
+    }
+    if (dyn_strtab) {
+      delete[] dyn_strtab;
+    }
+  }
+
+  int open() {
+    assert(fd < 0);
+    fd = ::open(so_path, O_RDONLY);
+    if (fd < 0) {
+      perror("open");
+      return -1;
+    }
+    return 0;
+  }
+
+  int get_fd() {
+    return fd;
+  }
+
+  int parse_header() {
+    assert(fd >= 0);
+    assert(!hdr_valid);
+    _EI(read, fd, &hdr, sizeof(hdr));
+    hdr_valid = true;
+    return 0;
+  }
+
+  /**
+   * Check if the header is of an ELF64 file of the machine that
+   * can be parsed by others.
+   */
+  bool is_elf64() const {
+    assert(hdr_valid);
+    return memcmp(hdr.e_ident, ELFMAG, SELFMAG) == 0 &&
+      hdr.e_ident[EI_CLASS] == ELFCLASS64 &&
+      hdr.e_machine == EM_X86_64 &&
+      hdr.e_phentsize == sizeof(Elf64_Phdr);
+  }
+
+  int parse_prog_headers() {
+    assert(fd >= 0);
+    assert(hdr_valid);
+    assert(phdrs == nullptr);
+    assert(hdr.e_phentsize == sizeof(*phdrs));
+
+    _EI(lseek, fd, hdr.e_phoff, SEEK_SET);
+    auto bytes = hdr.e_phentsize * hdr.e_phnum;
+    phdrs = new Elf64_Phdr[hdr.e_phnum];
+    _EI(read, fd, phdrs, bytes);
+
+    return 0;
+  }
+
+  int get_prog_header_num() const {
+    assert(hdr_valid);
+    return hdr.e_phnum;
+  }
+
+  const Elf64_Phdr* get_prog_headers() const {
+    return phdrs;
+  }
+
+  int parse_dyanmic() {
+    assert(fd >= 0);
+    assert(phdrs);
+    assert(dyns == nullptr);
+    assert(dyn_num == 0);
+    for (int i = 0; i < get_prog_header_num(); i++) {
+      auto phdr = get_prog_headers() + i;
+      if (phdr->p_type == PT_DYNAMIC) {
+        auto bytes = phdr->p_filesz;
+        dyn_num = bytes / sizeof(Elf64_Dyn);
+        assert((bytes % sizeof(Elf64_Dyn)) == 0);
+        dyns = new Elf64_Dyn[dyn_num];
+        _EI(lseek, fd, phdr->p_offset, SEEK_SET);
+        _EI(read, fd, dyns, bytes);
+        break;
+      }
+    }
+    return 0;
+  }
+
+  int get_dynamic_num() {
+    return dyn_num;
+  }
+
+  Elf64_Dyn* get_dynamics() {
+    return dyns;
+  }
+
+  /**
+   * Read the string table of the dynamic section, DT_STRTAB.
+   *
+   * Unlike |parse_dynstr()|, it doesn't need section headers, that
+   * may be stripped.  The address of the table is translated to the
+   * file offset with PT_LOAD segments.
+   */
+  int parse_dynamic_strtab() {
+    assert(fd >= 0);
+    assert(phdrs);
+    assert(dyn_strtab == nullptr);
+    Elf64_Addr addr = 0;
+    Elf64_Xword bytes = 0;
+    for (int i = 0; i < dyn_num; i++) {
+      if (dyns[i].d_tag == DT_STRTAB) {
+        addr = dyns[i].d_un.d_ptr;
+      } else if (dyns[i].d_tag == DT_STRSZ) {
+        bytes = dyns[i].d_un.d_val;
+      }
+    }
+    if (addr == 0 || bytes == 0) {
+      return -1;
+    }
+    for (int i = 0; i < get_prog_header_num(); i++) {
+      auto phdr = get_prog_headers() + i;
+      if (phdr->p_type != PT_LOAD || addr < phdr->p_vaddr ||
+          addr + bytes > phdr->p_vaddr + phdr->p_filesz) {
+        continue;
+      }
+      dyn_strtab = new char[bytes + 1];
+      _EI(lseek, fd, phdr->p_offset + (addr - phdr->p_vaddr), SEEK_SET);
+      _EI(read, fd, dyn_strtab, bytes);
+      // Make sure that the last string is terminated.
+      dyn_strtab[bytes] = 0;
+      dyn_strtab_bytes = bytes;
+      return 0;
+    }
+    return -1;
+  }
+
+  /**
+   * Return the string at |off| of DT_STRTAB, DT_NEEDED, DT_RPATH or
+   * DT_RUNPATH for example, or nullptr if it is out of the table.
+   */
+  const char* get_dynamic_str(Elf64_Xword off) const {
+    if (dyn_strtab == nullptr || off >= dyn_strtab_bytes) {
+      return nullptr;
+    }
+    return dyn_strtab + off;
+  }
+
+  int parse_sect_headers() {
+    assert(fd >= 0);
+    assert(hdr_valid);
+    assert(shdrs == nullptr);
+    assert(hdr.e_shentsize == sizeof(*shdrs));
+
+    _EI(lseek, fd, hdr.e_shoff, SEEK_SET);
+    auto bytes = hdr.e_shentsize * hdr.e_shnum;
+    shdrs = new Elf64_Shdr[hdr.e_shnum];
+    _EI(read, fd, shdrs, bytes);
+
+    return 0;
+  }
+
+  unsigned int get_sect_header_num() const {
+    assert(hdr_valid);
+    return hdr.e_shnum;
+  }
+
+  const Elf64_Shdr* get_sect_headers() const {
+    return shdrs;
+  }
+
+  int parse_shstrtab() {
+    assert(shdrs);
+    assert(hdr_valid);
+    assert(shstrtab == nullptr);
+
+    auto shdr = shdrs + hdr.e_shstrndx;
+    shstrtab = new char[shdr->sh_size];
+    shstrtab_bytes = shdr->sh_size;
+
+    _EI(lseek, fd, shdr->sh_offset, SEEK_SET);
+    _EI(read, fd, shstrtab, shdr->sh_size);
+
+    return 0;
+  }
+
+  const char* get_shstrtab() const {
+    return shstrtab;
+  }
+
+  unsigned int get_shstrtab_size() const {
+    return shstrtab_bytes;
+  }
+
+  const char* get_sect_name(unsigned int ndx) const {
+    assert(ndx < get_sect_header_num());
+    auto shdr = get_sect_headers() + ndx;
+    assert(shdr->sh_name < get_shstrtab_size());
+    return get_shstrtab() + shdr->sh_name;
+  }
+
+  int find_section(const char* name) const {
+    for (unsigned int i = 0; i < get_sect_header_num(); i++) {
+      if (strcmp(name, get_sect_name(i)) == 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  int parse_dynsym() {
+    assert(hdr_valid);
+    assert(shdrs);
+    assert(shstrtab);
+
+    auto dynsym_ndx = find_section(".dynsym");
+    assert(dynsym_ndx >= 0);
+    auto shdr = get_sect_headers() + dynsym_ndx;
+    assert(shdr->sh_entsize == sizeof(Elf64_Sym));
+    dynsym_num = shdr->sh_size / shdr->sh_entsize;
+    dynsym = new Elf64_Sym[dynsym_num];
+    _EI(lseek, fd, shdr->sh_offset, SEEK_SET);
+    _EI(read, fd, dynsym, shdr->sh_size);
+    return 0;
+  }
+
+  Elf64_Sym* get_dynsym() const {
+    return dynsym;
+  }
+
+  unsigned int get_dynsym_num() const {
+    return dynsym_num;
+  }
+
+  int parse_dynstr() {
+    assert(hdr_valid);
+    assert(shdrs);
+    assert(shstrtab);
+
+    auto dynstr_ndx = find_section(".dynstr");
+    assert(dynstr_ndx >= 0);
+    auto shdr = get_sect_headers() + dynstr_ndx;
+    dynstr = new char[shdr->sh_size];
+    _EI(lseek, fd, shdr->sh_offset, SEEK_SET);
+    _EI(read, fd, dynstr, shdr->sh_size);
+    dynstr_bytes = shdr->sh_size;
+    return 0;
+  }
+
+  const char* get_dynstr() const {
+    return dynstr;
+  }
+
+  unsigned int get_dynstr_size() const {
+    return dynstr_bytes;
+  }
+
+  const char* get_dynsym_name(unsigned int ndx) const {
+    assert(ndx < get_dynsym_num());
+    auto sym = get_dynsym() + ndx;
+    assert(sym->st_name < get_dynstr_size());
+    return get_dynstr() + sym->st_name;
+  }
+
+  int find_dynsym(const char* name) {
+    for (unsigned int i = 0; i < get_dynsym_num(); i++) {
+      if (strcmp(name, get_dynsym_name(i)) == 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+private:
+  const char* so_path;
+  int fd;
+
+  bool hdr_valid;
+  Elf64_Ehdr hdr;
+  Elf64_Phdr* phdrs;
+  Elf64_Dyn* dyns;
+  int dyn_num;
+  Elf64_Shdr* shdrs;
+
+  char* shstrtab;
+  unsigned int shstrtab_bytes;
+
+  Elf64_Sym* dynsym;
+  int dynsym_num;
+  char* dynstr;
+  int dynstr_bytes;
+
+  char* dyn_strtab;
+  Elf64_Xword dyn_strtab_bytes;
+};
+
+#endif /* __elfparser_h_ */
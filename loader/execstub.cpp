@@ -0,0 +1,365 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+/*
+ * The exec stub, mosingar-exec.
+ *
+ * With scout::FLAG_EXEC_STUB, a scout execs this stub instead of the
+ * program that the subject asks for, with the argv and the envp of
+ * the program.  The program is opened at scout::EXEC_FD and a new
+ * channel to the Command Center is at scout::CMD_CENTER_SOCK.  The
+ * stub
+ *
+ *  - maps cc_shm and loads libmosingar.so with the loader and the
+ *    arguments prepared in cc_shm_exec by the Command Center; the
+ *    scout takes the channel and tells the Command Center which
+ *    program it runs,
+ *  - maps the program and its interpreter like the kernel does, and
+ *  - jumps to the interpreter, or the program, on its own stack with
+ *    the auxiliary vector fixed up for the program.
+ *
+ * So the Command Center doesn't attach the process with ptrace and
+ * inject the scout for every exec.
+ *
+ * It is a static program without libc, linked at an address far from
+ * where programs are loaded.  The seccomp filter is kept across exec,
+ * so syscalls are made through the trampoline once the loader has set
+ * it up.
+ */
+#include "loader.h"
+#include "ccshm.h"
+#include "scout.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <asm/unistd.h>
+
+#define PG_SZ 4096
+#define PG_MASK (PG_SZ - 1)
+// The same as loader.cpp.
+#define TRAMPOLINE_ADDR 0x200000000000
+// Max number of program headers of a program.
+#define MAX_PHNUM 64
+
+extern "C" {
+extern void execstub_main(unsigned long* sp) __attribute__((noreturn));
+extern void execstub_jump(unsigned long* sp, unsigned long entry)
+  __attribute__((noreturn));
+}
+
+// Set once the loader has set up the trampoline.
+static bool trampoline_ready;
+
+static long
+stub_syscall(long nr,
+             long arg1 = 0,
+             long arg2 = 0,
+             long arg3 = 0,
+             long arg4 = 0,
+             long arg5 = 0,
+             long arg6 = 0) {
+  if (trampoline_ready) {
+    auto trampo =
+      (long(*)(long, long, long, long, long, long, long))TRAMPOLINE_ADDR;
+    return trampo(nr, arg1, arg2, arg3, arg4, arg5, arg6);
+  }
+  register long r10 asm("r10") = arg4;
+  register long r8 asm("r8") = arg5;
+  register long r9 asm("r9") = arg6;
+  long r;
+  asm volatile("syscall"
+               : "=a"(r)
+               : "a"(nr), "D"(arg1), "S"(arg2), "d"(arg3),
+                 "r"(r10), "r"(r8), "r"(r9)
+               : "rcx", "r11", "memory");
+  return r;
+}
+
+static bool
+is_error(long r) {
+  return (unsigned long)r > -4096UL;
+}
+
+static unsigned long
+str_len(const char* s) {
+  unsigned long n = 0;
+  while (s[n]) {
+    n++;
+  }
+  return n;
+}
+
+static void
+mem_copy(void* dest, const void* src, unsigned long n) {
+  for (unsigned long i = 0; i < n; i++) {
+    ((char*)dest)[i] = ((const char*)src)[i];
+  }
+}
+
+/**
+ * The exec has succeeded for the parent, there is no way to return
+ * an error.  Exit like a shell failing to run a command.
+ */
+static void __attribute__((noreturn))
+fail(const char* what) {
+  static const char prefix[] = "mosingar-exec: ";
+  static const char suffix[] = " failed\n";
+  stub_syscall(__NR_write, 2, (long)prefix, sizeof(prefix) - 1);
+  stub_syscall(__NR_write, 2, (long)what, str_len(what));
+  stub_syscall(__NR_write, 2, (long)suffix, sizeof(suffix) - 1);
+  stub_syscall(__NR_exit_group, 127);
+  for (;;) {
+  }
+}
+
+/**
+ * A program or an interpreter mapped by the stub.
+ */
+struct elf_image {
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr phdrs[MAX_PHNUM];
+  // Added to addresses of the file.
+  unsigned long bias;
+};
+
+static bool
+read_elf(int fd, elf_image* img) {
+  auto eh = &img->ehdr;
+  auto r = stub_syscall(__NR_pread64, fd, (long)eh, sizeof(*eh), 0);
+  if (r != sizeof(*eh) ||
+      eh->e_ident[EI_MAG0] != ELFMAG0 || eh->e_ident[EI_MAG1] != ELFMAG1 ||
+      eh->e_ident[EI_MAG2] != ELFMAG2 || eh->e_ident[EI_MAG3] != ELFMAG3 ||
+      eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_machine != EM_X86_64 ||
+      (eh->e_type != ET_EXEC && eh->e_type != ET_DYN) ||
+      eh->e_phentsize != sizeof(Elf64_Phdr) || eh->e_phnum > MAX_PHNUM) {
+    return false;
+  }
+  auto bytes = (long)sizeof(Elf64_Phdr) * eh->e_phnum;
+  r = stub_syscall(__NR_pread64, fd, (long)img->phdrs, bytes, eh->e_phoff);
+  return r == bytes;
+}
+
+static int
+prot_of(const Elf64_Phdr* ph) {
+  return (ph->p_flags & PF_R ? PROT_READ : 0) |
+    (ph->p_flags & PF_W ? PROT_WRITE : 0) |
+    (ph->p_flags & PF_X ? PROT_EXEC : 0);
+}
+
+/**
+ * Map PT_LOAD segments of |img| from |fd|.  An ET_DYN file is placed
+ * anywhere the kernel likes, ET_EXEC at its addresses.
+ */
+static bool
+map_elf(int fd, elf_image* img) {
+  auto eh = &img->ehdr;
+  auto lo = ~0UL;
+  auto hi = 0UL;
+  for (int i = 0; i < eh->e_phnum; i++) {
+    auto ph = img->phdrs + i;
+    if (ph->p_type != PT_LOAD) {
+      continue;
+    }
+    if ((ph->p_vaddr & ~PG_MASK) < lo) {
+      lo = ph->p_vaddr & ~PG_MASK;
+    }
+    if (ph->p_vaddr + ph->p_memsz > hi) {
+      hi = ph->p_vaddr + ph->p_memsz;
+    }
+  }
+  if (hi <= lo) {
+    return false;
+  }
+  hi = (hi + PG_MASK) & ~PG_MASK;
+
+  img->bias = 0;
+  if (eh->e_type == ET_DYN) {
+    // Reserve the whole span, segments are mapped over it.
+    auto base = stub_syscall(__NR_mmap, 0, hi - lo, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (is_error(base)) {
+      return false;
+    }
+    img->bias = base - lo;
+  }
+
+  for (int i = 0; i < eh->e_phnum; i++) {
+    auto ph = img->phdrs + i;
+    if (ph->p_type != PT_LOAD) {
+      continue;
+    }
+    auto prot = prot_of(ph);
+    auto start = img->bias + (ph->p_vaddr & ~PG_MASK);
+    auto file_end = img->bias + ph->p_vaddr + ph->p_filesz;
+    auto mem_end = img->bias + ph->p_vaddr + ph->p_memsz;
+    auto anon_start = start;
+    if (ph->p_filesz) {
+      auto r = stub_syscall(__NR_mmap, start, file_end - start, prot,
+                            MAP_PRIVATE | MAP_FIXED, fd,
+                            ph->p_offset & ~PG_MASK);
+      if (is_error(r)) {
+        return false;
+      }
+      anon_start = (file_end + PG_MASK) & ~PG_MASK;
+      // Zero the rest of the last page of the file like the kernel
+      // does, ld.so allocates from the page after its bss.
+      if (mem_end > file_end && (prot & PROT_WRITE)) {
+        for (auto p = (char*)file_end; p < (char*)anon_start; p++) {
+          *p = 0;
+        }
+      }
+    }
+    if (mem_end > anon_start) {
+      auto r = stub_syscall(__NR_mmap, anon_start, mem_end - anon_start, prot,
+                            MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+      if (is_error(r)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Return the address of the program headers of |img| in memory, or 0
+ * if they are not mapped.
+ */
+static unsigned long
+phdr_addr(const elf_image* img) {
+  auto eh = &img->ehdr;
+  for (int i = 0; i < eh->e_phnum; i++) {
+    if (img->phdrs[i].p_type == PT_PHDR) {
+      return img->bias + img->phdrs[i].p_vaddr;
+    }
+  }
+  for (int i = 0; i < eh->e_phnum; i++) {
+    auto ph = img->phdrs + i;
+    if (ph->p_type == PT_LOAD && ph->p_offset <= eh->e_phoff &&
+        eh->e_phoff < ph->p_offset + ph->p_filesz) {
+      return img->bias + ph->p_vaddr + (eh->e_phoff - ph->p_offset);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Load libmosingar.so like the Flight Deck does with the shellcode,
+ * but with cc_shm mapped by the stub.
+ */
+static void
+load_scout() {
+  // Read-only except the counters, like map_cc_shm() of the Flight
+  // Deck.
+  auto shm_addr = stub_syscall(__NR_mmap, 0, CC_SHM_SIZE, PROT_READ,
+                               MAP_SHARED, CC_SHM_FD, 0);
+  if (is_error(shm_addr)) {
+    fail("mapping cc_shm");
+  }
+  auto r = stub_syscall(__NR_mprotect,
+                        shm_addr + __builtin_offsetof(cc_shm, stats),
+                        sizeof(cc_shm_stats), PROT_READ | PROT_WRITE);
+  auto shm = (cc_shm*)shm_addr;
+  auto exec = &shm->exec;
+  if (is_error(r) || shm->magic != CC_SHM_MAGIC || exec->flags == 0) {
+    fail("finding the scout");
+  }
+
+  // Relocation records are patched on a copy.
+  static char data[CC_SHM_EXEC_DATA];
+  mem_copy(data, exec->data, sizeof(data));
+  auto rela = (unsigned long*)(data + exec->rela_off);
+  rela[exec->flags_rela * 2 + 1] += exec->flags;
+  rela[exec->shm_rela * 2 + 1] += shm_addr;
+  r = load_shared_object(exec->so_path,
+                         (prog_header*)(data + exec->headers_off),
+                         exec->header_num,
+                         (void (**)())(data + exec->init_off),
+                         (void**)rela,
+                         0);
+  if (r < 0) {
+    fail("loading the scout");
+  }
+  trampoline_ready = true;
+}
+
+void
+execstub_main(unsigned long* sp) {
+  load_scout();
+
+  static char exe_path[CC_SHM_EXEC_PATH_MAX];
+  auto len = stub_syscall(__NR_readlink, (long)scout::EXEC_FD_PATH, (long)exe_path,
+                          sizeof(exe_path) - 1);
+  if (len < 0) {
+    fail("reading the path of the program");
+  }
+  exe_path[len] = 0;
+
+  static elf_image prog;
+  if (!read_elf(scout::EXEC_FD, &prog) || !map_elf(scout::EXEC_FD, &prog)) {
+    fail("mapping the program");
+  }
+  auto entry = prog.bias + prog.ehdr.e_entry;
+  auto base = 0UL;
+  for (int i = 0; i < prog.ehdr.e_phnum; i++) {
+    auto ph = prog.phdrs + i;
+    if (ph->p_type != PT_INTERP) {
+      continue;
+    }
+    static char interp_path[CC_SHM_EXEC_PATH_MAX];
+    static elf_image interp;
+    if (ph->p_filesz >= sizeof(interp_path) ||
+        stub_syscall(__NR_pread64, scout::EXEC_FD, (long)interp_path,
+                     ph->p_filesz, ph->p_offset) != (long)ph->p_filesz) {
+      fail("reading the interpreter");
+    }
+    interp_path[ph->p_filesz] = 0;
+    auto fd = stub_syscall(__NR_openat, AT_FDCWD, (long)interp_path,
+                           O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || !read_elf(fd, &interp) || !map_elf(fd, &interp)) {
+      fail("mapping the interpreter");
+    }
+    stub_syscall(__NR_close, fd);
+    base = interp.bias;
+    entry = interp.bias + interp.ehdr.e_entry;
+    break;
+  }
+  stub_syscall(__NR_close, scout::EXEC_FD);
+
+  auto name = exe_path + len;
+  while (name > exe_path && name[-1] != '/') {
+    name--;
+  }
+  stub_syscall(__NR_prctl, PR_SET_NAME, (long)name);
+
+  // Skip argc, argv and envp to the auxiliary vector.
+  auto auxv = sp + 1 + sp[0] + 1;
+  while (*auxv) {
+    auxv++;
+  }
+  for (auxv++; auxv[0] != AT_NULL; auxv += 2) {
+    switch (auxv[0]) {
+    case AT_PHDR:
+      auxv[1] = phdr_addr(&prog);
+      break;
+    case AT_PHENT:
+      auxv[1] = sizeof(Elf64_Phdr);
+      break;
+    case AT_PHNUM:
+      auxv[1] = prog.ehdr.e_phnum;
+      break;
+    case AT_BASE:
+      auxv[1] = base;
+      break;
+    case AT_ENTRY:
+      auxv[1] = prog.bias + prog.ehdr.e_entry;
+      break;
+    case AT_EXECFN:
+      auxv[1] = (unsigned long)exe_path;
+      break;
+    }
+  }
+
+  execstub_jump(sp, entry);
+}
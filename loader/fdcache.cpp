@@ -0,0 +1,124 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#include "fdcache.h"
+
+#include <unistd.h>
+#include <errno.h>
+
+// Flags that don't make a difference to an fd opened for reading.
+#define CACHE_OPEN_FLAGS (O_CLOEXEC | O_LARGEFILE | O_NOCTTY)
+
+fd_cache::~fd_cache() {
+  for (auto& d : dirs) {
+    close(d.second.fd);
+  }
+}
+
+bool
+fd_cache::is_same_file(const entry& ent, const struct stat* st) {
+  return ent.dev == st->st_dev && ent.ino == st->st_ino &&
+    ent.mtime.tv_sec == st->st_mtim.tv_sec &&
+    ent.mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+void
+fd_cache::drop_entry(std::list<entry>::iterator it) {
+  auto d = it->dir;
+  if (--d->second.refs == 0) {
+    close(d->second.fd);
+    dirs.erase(d);
+  }
+  by_path.erase(it->path);
+  entries.erase(it);
+}
+
+/**
+ * Remember the file |st| opened at |path|.
+ */
+void
+fd_cache::add_entry(const char* path, const struct stat* st,
+                    unsigned long gen) {
+  std::string dir_path(path);
+  auto slash = dir_path.rfind('/');
+  auto name = dir_path.substr(slash + 1);
+  if (name.empty()) {
+    return;
+  }
+  dir_path.resize(slash == 0 ? 1 : slash);
+
+  auto d = dirs.find(dir_path);
+  if (d == dirs.end()) {
+    auto fd = ::open(dir_path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    d = dirs.emplace(dir_path, dir { fd, 0 }).first;
+  }
+  d->second.refs++;
+
+  entries.push_front(entry { path, d, name, st->st_dev, st->st_ino,
+                             st->st_mtim, gen, 0 });
+  by_path[path] = entries.begin();
+  while (entries.size() > max_entries) {
+    drop_entry(std::prev(entries.end()));
+  }
+}
+
+int
+fd_cache::open(const char* path, int flags, unsigned long gen) {
+  if (path[0] != '/' || (flags & ~CACHE_OPEN_FLAGS) != O_RDONLY) {
+    return -ENOSYS;
+  }
+
+  auto found = by_path.find(path);
+  if (found != by_path.end()) {
+    auto ent = found->second;
+    auto dirfd = ent->dir->second.fd;
+    auto valid = true;
+    if (ent->gen != gen) {
+      struct stat st;
+      valid = fstatat(dirfd, ent->name.c_str(), &st, 0) == 0 &&
+        is_same_file(*ent, &st);
+      if (valid) {
+        ent->gen = gen;
+      }
+    }
+    if (valid) {
+      auto fd = openat(dirfd, ent->name.c_str(), flags | O_CLOEXEC);
+      if (fd >= 0) {
+        entries.splice(entries.begin(), entries, ent);
+        ent->hits++;
+        hits++;
+        return fd;
+      }
+    }
+    drop_entry(ent);
+  }
+
+  auto fd = ::open(path, flags | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  misses++;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    add_entry(path, &st, gen);
+  }
+  return fd;
+}
+
+const char*
+fd_cache::get_hottest(unsigned long* hits) {
+  const entry* hottest = nullptr;
+  for (auto& ent : entries) {
+    if (ent.hits > 0 && (hottest == nullptr || ent.hits > hottest->hits)) {
+      hottest = &ent;
+    }
+  }
+  if (hottest == nullptr) {
+    return nullptr;
+  }
+  *hits = hottest->hits;
+  return hottest->path.c_str();
+}
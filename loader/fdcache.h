@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#ifndef __fdcache_h_
+#define __fdcache_h_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+/**
+ * A cache of files opened for reading by the Command Center.
+ *
+ * Builds open the same headers for reading over and over.  An entry
+ * remembers the file found at an absolute path, (dev, ino, mtime),
+ * and keeps an O_PATH fd of the directory of the file.  Following
+ * opens of the path open the name in the directory fd, without
+ * walking the path again.
+ *
+ * A dup of a kept fd would be cheaper, but it shares the offset, and
+ * subjects read files with read().  So every open gets its own open
+ * file.
+ *
+ * Like file_images, an entry is trusted as long as the generation of
+ * cc_shm doesn't change, and checked against the stat of the file
+ * once after a change.  The least recently used entries are dropped
+ * beyond |max_entries|.
+ */
+class fd_cache {
+public:
+  constexpr static size_t max_entries = 1024;
+
+  fd_cache() : hits(0), misses(0) {}
+  ~fd_cache();
+
+  /**
+   * Open the absolute |path| for reading with |flags| at the
+   * generation |gen|.
+   *
+   * Return the fd, -errno for failures, or -ENOSYS if the call is not
+   * for the cache, writing or with flags changing the fd.
+   */
+  int open(const char* path, int flags, unsigned long gen);
+
+  unsigned long get_hits() { return hits; }
+  unsigned long get_misses() { return misses; }
+  size_t get_size() { return entries.size(); }
+  /**
+   * Return the path of the entry hit most, or nullptr if there is no
+   * hit, and its hits in |*hits|.
+   */
+  const char* get_hottest(unsigned long* hits);
+
+private:
+  struct dir {
+    int fd;
+    // Entries in the directory.
+    int refs;
+  };
+  typedef std::unordered_map<std::string, dir>::iterator dir_iter;
+  struct entry {
+    std::string path;
+    dir_iter dir;
+    // The name in the directory.
+    std::string name;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    // The generation that the entry was checked at last time.
+    unsigned long gen;
+    unsigned long hits;
+  };
+
+  void add_entry(const char* path, const struct stat* st, unsigned long gen);
+  void drop_entry(std::list<entry>::iterator it);
+  static bool is_same_file(const entry& ent, const struct stat* st);
+
+  // The most recent first.
+  std::list<entry> entries;
+  std::unordered_map<std::string, std::list<entry>::iterator> by_path;
+  std::unordered_map<std::string, dir> dirs;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+#endif /* __fdcache_h_ */
@@ -0,0 +1,185 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#include "fileimages.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <errno.h>
+
+#include <memory>
+
+// Flags that don't make a difference to an fd opened for reading.
+#define IMAGE_OPEN_FLAGS (O_CLOEXEC | O_LARGEFILE | O_NOCTTY)
+
+file_images::~file_images() {
+  for (auto& img : images) {
+    close(img.memfd);
+  }
+}
+
+bool
+file_images::is_same_file(const struct stat* a, const struct stat* b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+    a->st_mode == b->st_mode && a->st_size == b->st_size &&
+    a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+    a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+    a->st_ctim.tv_sec == b->st_ctim.tv_sec &&
+    a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+void
+file_images::drop_image(std::list<image>::iterator it) {
+  close(it->memfd);
+  by_path.erase(it->path);
+  images.erase(it);
+}
+
+/**
+ * Make an image of the file |fd| opened for |path|.  |st| is the stat
+ * of the file.
+ */
+int
+file_images::make_image(const char* path, int fd, const struct stat* st,
+                        unsigned long gen) {
+  size_t size = st->st_size;
+  std::unique_ptr<char[]> buf(new char[size + 1]);
+  size_t done = 0;
+  for (;;) {
+    // One more byte to see if the file has grown.
+    auto r = pread(fd, buf.get() + done, size + 1 - done, done);
+    if (r < 0) {
+      return -errno;
+    }
+    if (r == 0) {
+      break;
+    }
+    done += r;
+    if (done > size) {
+      return -EAGAIN;
+    }
+  }
+  struct stat after;
+  if (done != size || fstat(fd, &after) < 0 || !is_same_file(st, &after)) {
+    // Being changed
+    return -EAGAIN;
+  }
+  struct statx stx;
+  if (statx(fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS | STATX_BTIME,
+            &stx) < 0) {
+    return -errno;
+  }
+
+  auto memfd = memfd_create("mosingar-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0) {
+    return -errno;
+  }
+  for (size_t off = 0; off < size;) {
+    auto r = write(memfd, buf.get() + off, size - off);
+    if (r < 0) {
+      auto err = -errno;
+      close(memfd);
+      return err;
+    }
+    off += r;
+  }
+  struct stat memfd_st;
+  if (fcntl(memfd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 ||
+      fstat(memfd, &memfd_st) < 0) {
+    auto err = -errno;
+    close(memfd);
+    return err;
+  }
+  memfd_dev = memfd_st.st_dev;
+
+  stats[memfd_st.st_ino] = image_stat { *st, stx };
+  stats_order.push_back(memfd_st.st_ino);
+  while (stats.size() > max_stats) {
+    stats.erase(stats_order.front());
+    stats_order.pop_front();
+  }
+
+  images.push_front(image { path, gen, memfd, memfd_st.st_ino, size });
+  by_path[path] = images.begin();
+  while (images.size() > max_images) {
+    drop_image(std::prev(images.end()));
+  }
+  return 0;
+}
+
+int
+file_images::open(const char* path, int flags, unsigned long gen) {
+  if (path[0] != '/' || (flags & ~IMAGE_OPEN_FLAGS) != O_RDONLY) {
+    return -ENOSYS;
+  }
+
+  auto found = by_path.find(path);
+  if (found != by_path.end()) {
+    auto img = found->second;
+    auto valid = true;
+    if (img->gen != gen) {
+      struct stat st;
+      auto old = stats.find(img->memfd_ino);
+      valid = old != stats.end() && stat(path, &st) == 0 &&
+        is_same_file(&st, &old->second.st);
+      if (valid) {
+        img->gen = gen;
+      }
+    }
+    if (valid) {
+      // A new open file, the offset is not shared with others.
+      char proc_path[64];
+      snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", img->memfd);
+      auto fd = ::open(proc_path, O_RDONLY | O_CLOEXEC);
+      if (fd >= 0) {
+        images.splice(images.begin(), images, img);
+        hits++;
+        return fd;
+      }
+    }
+    drop_image(img);
+  }
+
+  auto fd = ::open(path, flags | O_CLOEXEC);
+  if (fd < 0) {
+    return -errno;
+  }
+  misses++;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size <= max_file_size) {
+    // Served by the file this time.
+    make_image(path, fd, &st, gen);
+  }
+  return fd;
+}
+
+bool
+file_images::fix_stat(struct stat* st) {
+  if (memfd_dev == 0 || st->st_dev != memfd_dev) {
+    return false;
+  }
+  auto found = stats.find(st->st_ino);
+  if (found == stats.end()) {
+    return false;
+  }
+  *st = found->second.st;
+  return true;
+}
+
+bool
+file_images::fix_statx(struct statx* stx) {
+  if (memfd_dev == 0 ||
+      makedev(stx->stx_dev_major, stx->stx_dev_minor) != memfd_dev) {
+    return false;
+  }
+  auto found = stats.find(stx->stx_ino);
+  if (found == stats.end()) {
+    return false;
+  }
+  *stx = found->second.stx;
+  return true;
+}
@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#ifndef __fileimages_h_
+#define __fileimages_h_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Images of small files in sealed memfds, served to subjects in place
+ * of the files.
+ *
+ * Compilers open the same headers and config files for reading over
+ * and over, one process after another.  The first open of a file
+ * reads it into an image.  Following opens of the path get a new open
+ * file of the image, reopened through /proc/self/fd, without walking
+ * the path or touching the file system, and all subjects share the
+ * pages of the image.
+ *
+ * An image stays valid as long as the generation of cc_shm doesn't
+ * change.  After a change, it is checked against the stat of the path
+ * once, the inode, the size and the times of the file, and replaced
+ * if the file has changed.
+ *
+ * A subject sees the stat of the file for an fd of an image, the
+ * Command Center fixes the stat of memfds with |fix_stat()| and
+ * |fix_statx()|.  Other things, like the link in /proc/self/fd and
+ * file locks, show that it is not the file.  So, images are served
+ * only if the Carrier is asked to.
+ */
+class file_images {
+public:
+  // Bigger files are opened as they are.
+  constexpr static off_t max_file_size = 64 * 1024;
+  constexpr static size_t max_images = 1024;
+  // The stat of images dropped are kept for subjects that still have
+  // them open.
+  constexpr static size_t max_stats = 8 * max_images;
+
+  file_images() : memfd_dev(0), hits(0), misses(0) {}
+  ~file_images();
+
+  /**
+   * Open the absolute |path| for reading with |flags| at the
+   * generation |gen|, from its image if any.
+   *
+   * Return the fd, of either the image or the file, -errno for
+   * failures, or -ENOSYS if the call is not for images, writing or
+   * with flags changing the fd.
+   */
+  int open(const char* path, int flags, unsigned long gen);
+
+  /**
+   * Replace the stat of an image with the stat of its file.  Return
+   * true if replaced.
+   */
+  bool fix_stat(struct stat* st);
+  bool fix_statx(struct statx* stx);
+
+  unsigned long get_hits() { return hits; }
+  unsigned long get_misses() { return misses; }
+
+private:
+  struct image {
+    std::string path;
+    // The generation that the image was checked at last time.
+    unsigned long gen;
+    int memfd;
+    ino_t memfd_ino;
+    size_t size;
+  };
+  // What a subject sees for an image.
+  struct image_stat {
+    struct stat st;
+    struct statx stx;
+  };
+
+  int make_image(const char* path, int fd, const struct stat* st,
+                 unsigned long gen);
+  void drop_image(std::list<image>::iterator it);
+  static bool is_same_file(const struct stat* a, const struct stat* b);
+
+  // The most recent first.
+  std::list<image> images;
+  std::unordered_map<std::string, std::list<image>::iterator> by_path;
+  std::unordered_map<ino_t, image_stat> stats;
+  // The inodes of |stats| in the order of creation.
+  std::list<ino_t> stats_order;
+  // The device of memfds, 0 before any image.
+  dev_t memfd_dev;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+#endif /* __fileimages_h_ */
@@ -4,6 +4,8 @@
 #include "flightdeck.h"
 #include "ptracetools.h"
 #include "loader.h"
+#include "ccshm.h"
+#include "elfparser.h"
 
 #include "errhandle.h"
 
@@ -13,6 +15,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <stdlib.h>
 
 #include <assert.h>
 #include <memory>
@@ -20,6 +24,7 @@
 #include <elf.h>
 
 #include <sys/mman.h>
+#include <asm/unistd.h>
 
 
 extern "C" {
@@ -44,6 +49,8 @@ struct trapped_shellcode {
   void (**init_funcs)();
 
   void** rela;
+  // Including the records of global_flags and cc_shm_addr at last.
+  int rela_num;
 
   ~trapped_shellcode() {
     delete (char*)code;
@@ -55,7 +62,51 @@ private:
     return reinterpret_cast<T*>((char*)base + ((char*)ptr - (char*)code));
   }
 
+  template<typename T>
+  T* moved_ptr(T* ptr, void* to) const {
+    return reinterpret_cast<T*>((char*)to + ((char*)ptr - (char*)code));
+  }
+
+  // The pointer to the entry point of the loader is at the end of
+  // shellcode_funcall_trap.
+  static long entry_ptr_offset() {
+    return (char*)shellcode_funcall_trap_end -
+      (char*)shellcode_funcall_trap - sizeof(void*);
+  }
+
+  void add_to_addend(int i, unsigned long value) {
+    rela[i * 2 + 1] = (void*)((unsigned long)rela[i * 2 + 1] + value);
+  }
+
 public:
+  /**
+   * Make a copy to relocate and patch, the code block is copied as
+   * well.
+   */
+  trapped_shellcode* copy() const {
+    assert(base == nullptr);
+    auto shellcode = new trapped_shellcode(*this);
+    auto code_copy = new char[size];
+    memcpy(code_copy, code, size);
+    shellcode->code = code_copy;
+    auto entry_ptr = (void**)(code_copy + entry_ptr_offset());
+    *entry_ptr = moved_ptr(*entry_ptr, code_copy);
+    shellcode->so_path = moved_ptr(so_path, code_copy);
+    shellcode->headers = moved_ptr(headers, code_copy);
+    shellcode->init_funcs = moved_ptr(init_funcs, code_copy);
+    shellcode->rela = moved_ptr(rela, code_copy);
+    return shellcode;
+  }
+
+  /**
+   * Set the values of global_flags and cc_shm_addr, which are left 0
+   * by prepare_shellcode().
+   */
+  void patch_globals(unsigned long global_flags, unsigned long shm_addr) {
+    add_to_addend(rela_num - 2, global_flags);
+    add_to_addend(rela_num - 1, shm_addr);
+  }
+
   /**
    * Relocate pointers.
    *
@@ -68,9 +119,7 @@ public:
     base = begin;
 
     // Relocate the entry point
-    auto funcall_trap_bytes =
-      (char*)shellcode_funcall_trap_end - (char*)shellcode_funcall_trap;
-    auto entry_ptr = (void**)((char*)code + (funcall_trap_bytes - sizeof(void*)));
+    auto entry_ptr = (void**)((char*)code + entry_ptr_offset());
     *entry_ptr = rptr(*entry_ptr);
 
     so_path = rptr(so_path);
@@ -80,262 +129,6 @@ public:
   }
 };
 
-class ElfParser {
-public:
-  ElfParser(const char* so_path)
-    : so_path(so_path)
-    , fd(-1)
-    , hdr_valid(false)
-    , phdrs(nullptr)
-    , dyns(nullptr)
-    , dyn_num(0)
-    , shdrs(nullptr)
-    , shstrtab(nullptr)
-    , dynsym(nullptr)
-    , dynstr(nullptr) {
-  }
-  ~ElfParser() {
-    if (fd >= 0) {
-      close(fd);
-    }
-    if (phdrs) {
-      delete[] phdrs;
-    }
-    if (dyns) {
-      delete[] dyns;
-    }
-    if (shdrs) {
-      delete[] shdrs;
-    }
-    if (shstrtab) {
-      delete shstrtab;
-    }
-    if (dynsym) {
-      delete dynsym;
-    }
-    if (dynstr) {
-      delete dynstr;
-    }
-  }
-
-  int open() {
-    assert(fd < 0);
-    fd = ::open(so_path, O_RDONLY);
-    if (fd < 0) {
-      perror("open");
-      return -1;
-    }
-    return 0;
-  }
-
-  int get_fd() {
-    return fd;
-  }
-
-  int parse_header() {
-    assert(fd >= 0);
-    assert(!hdr_valid);
-    _EI(read, fd, &hdr, sizeof(hdr));
-    hdr_valid = true;
-    return 0;
-  }
-
-  int parse_prog_headers() {
-    assert(fd >= 0);
-    assert(hdr_valid);
-    assert(phdrs == nullptr);
-    assert(hdr.e_phentsize == sizeof(*phdrs));
-
-    _EI(lseek, fd, hdr.e_phoff, SEEK_SET);
-    auto bytes = hdr.e_phentsize * hdr.e_phnum;
-    phdrs = new Elf64_Phdr[hdr.e_phnum];
-    _EI(read, fd, phdrs, bytes);
-
-    return 0;
-  }
-
-  int get_prog_header_num() const {
-    assert(hdr_valid);
-    return hdr.e_phnum;
-  }
-
-  const Elf64_Phdr* get_prog_headers() const {
-    return phdrs;
-  }
-
-  int parse_dyanmic() {
-    assert(fd >= 0);
-    assert(phdrs);
-    assert(dyns == nullptr);
-    assert(dyn_num == 0);
-    for (int i = 0; i < get_prog_header_num(); i++) {
-      auto phdr = get_prog_headers() + i;
-      if (phdr->p_type == PT_DYNAMIC) {
-        auto bytes = phdr->p_filesz;
-        dyn_num = bytes / sizeof(Elf64_Dyn);
-        assert((bytes % sizeof(Elf64_Dyn)) == 0);
-        dyns = new Elf64_Dyn[dyn_num];
-        _EI(lseek, fd, phdr->p_offset, SEEK_SET);
-        _EI(read, fd, dyns, bytes);
-        break;
-      }
-    }
-    return 0;
-  }
-
-  int get_dynamic_num() {
-    return dyn_num;
-  }
-
-  Elf64_Dyn* get_dynamics() {
-    return dyns;
-  }
-
-  int parse_sect_headers() {
-    assert(fd >= 0);
-    assert(hdr_valid);
-    assert(shdrs == nullptr);
-    assert(hdr.e_shentsize == sizeof(*shdrs));
-
-    _EI(lseek, fd, hdr.e_shoff, SEEK_SET);
-    auto bytes = hdr.e_shentsize * hdr.e_shnum;
-    shdrs = new Elf64_Shdr[hdr.e_shnum];
-    _EI(read, fd, shdrs, bytes);
-
-    return 0;
-  }
-
-  unsigned int get_sect_header_num() const {
-    assert(hdr_valid);
-    return hdr.e_shnum;
-  }
-
-  const Elf64_Shdr* get_sect_headers() const {
-    return shdrs;
-  }
-
-  int parse_shstrtab() {
-    assert(shdrs);
-    assert(hdr_valid);
-    assert(shstrtab == nullptr);
-
-    auto shdr = shdrs + hdr.e_shstrndx;
-    shstrtab = new char[shdr->sh_size];
-    shstrtab_bytes = shdr->sh_size;
-
-    _EI(lseek, fd, shdr->sh_offset, SEEK_SET);
-    _EI(read, fd, shstrtab, shdr->sh_size);
-
-    return 0;
-  }
-
-  const char* get_shstrtab() const {
-    return shstrtab;
-  }
-
-  unsigned int get_shstrtab_size() const {
-    return shstrtab_bytes;
-  }
-
-  const char* get_sect_name(unsigned int ndx) const {
-    assert(ndx < get_sect_header_num());
-    auto shdr = get_sect_headers() + ndx;
-    assert(shdr->sh_name < get_shstrtab_size());
-    return get_shstrtab() + shdr->sh_name;
-  }
-
-  int find_section(const char* name) const {
-    for (unsigned int i = 0; i < get_sect_header_num(); i++) {
-      if (strcmp(name, get_sect_name(i)) == 0) {
-        return i;
-      }
-    }
-    return -1;
-  }
-
-  int parse_dynsym() {
-    assert(hdr_valid);
-    assert(shdrs);
-    assert(shstrtab);
-
-    auto dynsym_ndx = find_section(".dynsym");
-    assert(dynsym_ndx >= 0);
-    auto shdr = get_sect_headers() + dynsym_ndx;
-    assert(shdr->sh_entsize == sizeof(Elf64_Sym));
-    dynsym_num = shdr->sh_size / shdr->sh_entsize;
-    dynsym = new Elf64_Sym[dynsym_num];
-    _EI(lseek, fd, shdr->sh_offset, SEEK_SET);
-    _EI(read, fd, dynsym, shdr->sh_size);
-    return 0;
-  }
-
-  Elf64_Sym* get_dynsym() const {
-    return dynsym;
-  }
-
-  unsigned int get_dynsym_num() const {
-    return dynsym_num;
-  }
-
-  int parse_dynstr() {
-    assert(hdr_valid);
-    assert(shdrs);
-    assert(shstrtab);
-
-    auto dynstr_ndx = find_section(".dynstr");
-    assert(dynstr_ndx >= 0);
-    auto shdr = get_sect_headers() + dynstr_ndx;
-    dynstr = new char[shdr->sh_size];
-    _EI(lseek, fd, shdr->sh_offset, SEEK_SET);
-    _EI(read, fd, dynstr, shdr->sh_size);
-    dynstr_bytes = shdr->sh_size;
-    return 0;
-  }
-
-  const char* get_dynstr() const {
-    return dynstr;
-  }
-
-  unsigned int get_dynstr_size() const {
-    return dynstr_bytes;
-  }
-
-  const char* get_dynsym_name(unsigned int ndx) const {
-    assert(ndx < get_dynsym_num());
-    auto sym = get_dynsym() + ndx;
-    assert(sym->st_name < get_dynstr_size());
-    return get_dynstr() + sym->st_name;
-  }
-
-  int find_dynsym(const char* name) {
-    for (unsigned int i = 0; i < get_dynsym_num(); i++) {
-      if (strcmp(name, get_dynsym_name(i)) == 0) {
-        return i;
-      }
-    }
-    return -1;
-  }
-
-private:
-  const char* so_path;
-  int fd;
-
-  bool hdr_valid;
-  Elf64_Ehdr hdr;
-  Elf64_Phdr* phdrs;
-  Elf64_Dyn* dyns;
-  int dyn_num;
-  Elf64_Shdr* shdrs;
-
-  char* shstrtab;
-  unsigned int shstrtab_bytes;
-
-  Elf64_Sym* dynsym;
-  int dynsym_num;
-  char* dynstr;
-  int dynstr_bytes;
-};
-
 const char* libmosingar_so_path = "../sandbox/libmosingar.so";
 
 namespace {
@@ -367,10 +160,16 @@ namespace {
  * shellcode_funcall_trap does not pass arguments, instead the carrier
  * should set the registers and the content on the stack properly to
  * pass the arguments.
+ *
+ * The values of global_flags and cc_shm_addr are left 0, see
+ * trapped_shellcode::patch_globals().  The path of the shared object
+ * is made absolute for subjects that have changed their cwd.
  */
 static trapped_shellcode*
-prepare_shellcode(unsigned long global_flags) {
-  auto so_path = libmosingar_so_path;
+prepare_shellcode() {
+  char abs_so_path[PATH_MAX];
+  auto so_path = realpath(libmosingar_so_path, abs_so_path) ?
+    abs_so_path : libmosingar_so_path;
 
   ElfParser solib(so_path);
   solib.open();
@@ -459,11 +258,13 @@ prepare_shellcode(unsigned long global_flags) {
   assert(rela_entsize == sizeof(Elf64_Rela));
   assert(rela_elf_bytes % rela_entsize == 0);
   unsigned int rela_num = rela_elf_bytes / rela_entsize;
-  rela_num++;                   // for global_flags in bootstrap.cpp
+  // for global_flags and cc_shm_addr in bootstrap.cpp
+  constexpr int patched_num = 2;
+  rela_num += patched_num;
   std::unique_ptr<void *[]> rela(new void*[rela_num * 2 + 1]);
   Elf64_Rela rela_ent;
   _ENull(lseek, solib.get_fd(), rela_offset, SEEK_SET);
-  for (unsigned int i = 0; i < (rela_num - 1); i++) {
+  for (unsigned int i = 0; i < (rela_num - patched_num); i++) {
     _ENull(read, solib.get_fd(), &rela_ent, rela_entsize);
     auto rela_type = 0xffffffff & rela_ent.r_info;
     // Assume only this type of entries are there.
@@ -488,11 +289,15 @@ prepare_shellcode(unsigned long global_flags) {
   // will be relocated with the real address of the variable.  By
   // subtracting the value of the variable with the address of itself,
   // the real value can be recovered.
-  auto global_flags_ndx = solib.find_dynsym("global_flags");
-  assert(global_flags_ndx >= 0);
-  auto global_flags_sym = solib.get_dynsym() + global_flags_ndx;
-  rela[rela_num * 2 - 2] = (void*)global_flags_sym->st_value;
-  rela[rela_num * 2 - 1] = (void*)(global_flags + global_flags_sym->st_value);
+  auto patch_global = [&](int i, const char* name) {
+    auto ndx = solib.find_dynsym(name);
+    assert(ndx >= 0);
+    auto sym = solib.get_dynsym() + ndx;
+    rela[i * 2] = (void*)sym->st_value;
+    rela[i * 2 + 1] = (void*)sym->st_value;
+  };
+  patch_global(rela_num - 2, "global_flags");
+  patch_global(rela_num - 1, "cc_shm_addr");
   rela[rela_num * 2] = nullptr;
 
   auto funcall_trap_bytes =
@@ -551,6 +356,7 @@ prepare_shellcode(unsigned long global_flags) {
 
   // The rela
   shellcode->rela = (void **)(code + pos);
+  shellcode->rela_num = rela_num;
   memcpy(code + pos, rela.get(), rela_bytes);
   pos += rela_bytes;
   ROUND8(pos);
@@ -567,6 +373,64 @@ prepare_shellcode(unsigned long global_flags) {
   return shellcode;
 }
 
+// The shellcode prepared last time, and the stat of the shared
+// object that it was prepared from.
+static std::unique_ptr<trapped_shellcode> cached_shellcode;
+static struct stat cached_so_stat;
+
+/**
+ * Return a shellcode with global_flags and cc_shm_addr patched.
+ *
+ * libmosingar.so is parsed once and kept in the cache, and parsed
+ * again only if the file at |libmosingar_so_path| has been replaced
+ * or modified, told by the inode and the mtime.  Every takeoff gets
+ * a copy of the cached shellcode.
+ */
+static trapped_shellcode*
+copy_shellcode(unsigned long global_flags, unsigned long shm_addr) {
+  struct stat st;
+  if (stat(libmosingar_so_path, &st) < 0) {
+    memset(&st, 0, sizeof(st));
+  }
+  if (cached_shellcode == nullptr ||
+      st.st_dev != cached_so_stat.st_dev ||
+      st.st_ino != cached_so_stat.st_ino ||
+      st.st_mtim.tv_sec != cached_so_stat.st_mtim.tv_sec ||
+      st.st_mtim.tv_nsec != cached_so_stat.st_mtim.tv_nsec) {
+    cached_shellcode.reset(prepare_shellcode());
+    cached_so_stat = st;
+  }
+  auto shellcode = cached_shellcode->copy();
+  shellcode->patch_globals(global_flags, shm_addr);
+  return shellcode;
+}
+
+/**
+ * Map the memory shared by the Command Center, inherited at
+ * CC_SHM_FD, into the subject.  Scouts can only write the counters.
+ *
+ * Return the address, or 0 if the subject has not the fd.
+ */
+static unsigned long
+map_cc_shm(pid_t pid, user_regs_struct* saved_regs) {
+  auto addr = (long)inject_mmap(pid, nullptr, CC_SHM_SIZE, PROT_READ,
+                                MAP_SHARED, CC_SHM_FD, 0, saved_regs);
+  if (addr < 0) {
+    return 0;
+  }
+  auto r = inject_run_syscall(pid, __NR_mprotect,
+                              addr + __builtin_offsetof(cc_shm, stats),
+                              sizeof(cc_shm_stats),
+                              PROT_READ | PROT_WRITE, 0, 0, 0,
+                              saved_regs);
+  if (r < 0) {
+    inject_run_syscall(pid, __NR_munmap, addr, CC_SHM_SIZE, 0, 0, 0, 0,
+                       saved_regs);
+    return 0;
+  }
+  return addr;
+}
+
 } // namespace
 
 namespace flightdeck {
@@ -574,15 +438,18 @@ namespace flightdeck {
  * Make a scout taking off for a subject/process.
  *
  * |scout_takeoff()| inject the loader to the target prcoess to load
- * libmosingar.so sandboxing the process.
+ * libmosingar.so sandboxing the process.  The memory shared by the
+ * Command Center is mapped into the process as well.
  */
 long
 scout_takeoff(pid_t pid, unsigned long global_flags) {
-  std::unique_ptr<trapped_shellcode> shellcode(prepare_shellcode(global_flags));
-
   user_regs_struct saved_regs;
   ptrace_getregs(pid, saved_regs);
 
+  auto shm_addr = map_cc_shm(pid, &saved_regs);
+  std::unique_ptr<trapped_shellcode>
+    shellcode(copy_shellcode(global_flags, shm_addr));
+
   auto request_size = (shellcode->size + 16384 + 4095) & ~4095;
   auto addr = inject_mmap(pid, nullptr, request_size,
                           PROT_EXEC | PROT_READ | PROT_WRITE,
@@ -616,6 +483,41 @@ scout_takeoff(pid_t pid, unsigned long global_flags) {
   return r;
 }
 
+/**
+ * Prepare the paths and the arguments of the loader for the exec
+ * stub, except the flags.
+ *
+ * The stub has the loader linked in, so only the data between the
+ * path of the shared object and the loader in the shellcode are
+ * taken.  Return false if they don't fit.
+ */
+bool
+prepare_exec_stub(cc_shm_exec* exec) {
+  std::unique_ptr<trapped_shellcode> shellcode(copy_shellcode(0, 0));
+
+  auto so_path = shellcode->so_path;
+  if (so_path[0] != '/' || strlen(so_path) >= sizeof(exec->so_path)) {
+    return false;
+  }
+  strcpy(exec->so_path, so_path);
+
+  auto rela_num = shellcode->rela_num;
+  auto begin = (char*)shellcode->headers;
+  auto end = (char*)(shellcode->rela + rela_num * 2 + 1);
+  if (end - begin > (long)sizeof(exec->data)) {
+    return false;
+  }
+  memcpy(exec->data, begin, end - begin);
+  exec->header_num = shellcode->header_num;
+  exec->headers_off = 0;
+  exec->init_off = (char*)shellcode->init_funcs - begin;
+  exec->rela_off = (char*)shellcode->rela - begin;
+  // The last two records, see trapped_shellcode::patch_globals().
+  exec->flags_rela = rela_num - 2;
+  exec->shm_rela = rela_num - 1;
+  return true;
+}
+
 } // namespace flightdeck
 
 #ifdef TEST
@@ -6,8 +6,11 @@
 
 #include <sys/types.h>
 
+struct cc_shm_exec;
+
 namespace flightdeck {
 extern long scout_takeoff(pid_t pid, unsigned long global_flags);
+extern bool prepare_exec_stub(cc_shm_exec* exec);
 }
 
 #endif /* __flightdeck_h_ */
@@ -0,0 +1,258 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#include "libmap.h"
+#include "elfparser.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+// The number of objects followed at most.
+#define LIBMAP_OBJECTS_MAX 256
+
+/**
+ * Subdirectories probed by ld.so in every directory before the
+ * directory itself on x86_64.  A miss of the top one says that
+ * nothing below it exists, see memo_cache.
+ */
+static const char* const hwcaps_dirs[] = {
+  "glibc-hwcaps",
+  "glibc-hwcaps/x86-64-v4",
+  "glibc-hwcaps/x86-64-v3",
+  "glibc-hwcaps/x86-64-v2",
+  "tls",
+  "haswell",
+  "avx512_1",
+  "x86_64",
+};
+
+// Where libraries of ld.so.cache come from.
+static const char* const default_dirs[] = {
+  "/lib/x86_64-linux-gnu",
+  "/usr/lib/x86_64-linux-gnu",
+  "/lib64",
+  "/usr/lib64",
+  "/lib",
+  "/usr/lib",
+};
+
+static bool
+is_file(const std::string& path) {
+  struct stat statbuf;
+  return stat(path.c_str(), &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+}
+
+static std::string
+join_path(const std::string& dir, const std::string& name) {
+  return dir == "/" ? dir + name : dir + "/" + name;
+}
+
+/**
+ * Collapse "." and ".." and duplicated slashes of an absolute path
+ * without following symlinks.
+ */
+static std::string
+normalize_path(const std::string& path) {
+  std::vector<std::string> comps;
+  size_t pos = 0;
+  while (pos < path.size()) {
+    auto end = path.find('/', pos);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    auto comp = path.substr(pos, end - pos);
+    pos = end + 1;
+    if (comp.empty() || comp == ".") {
+      continue;
+    }
+    if (comp == "..") {
+      if (!comps.empty()) {
+        comps.pop_back();
+      }
+      continue;
+    }
+    comps.push_back(comp);
+  }
+  std::string r;
+  for (auto& comp : comps) {
+    r += "/" + comp;
+  }
+  return r.empty() ? "/" : r;
+}
+
+/**
+ * Split a search path, DT_RPATH, DT_RUNPATH or LD_LIBRARY_PATH, to
+ * absolute directories.
+ *
+ * $ORIGIN is replaced with |origin|.  Directories with other
+ * dynamic string tokens are dropped.
+ */
+static std::vector<std::string>
+split_search_path(const char* search_path, const std::string& origin,
+                  const char* cwd) {
+  std::vector<std::string> dirs;
+  if (search_path == nullptr) {
+    return dirs;
+  }
+  std::string str(search_path);
+  size_t pos = 0;
+  while (pos <= str.size()) {
+    auto end = str.find(':', pos);
+    if (end == std::string::npos) {
+      end = str.size();
+    }
+    auto dir = str.substr(pos, end - pos);
+    pos = end + 1;
+
+    for (auto token : { "${ORIGIN}", "$ORIGIN" }) {
+      auto tpos = dir.find(token);
+      if (tpos != std::string::npos) {
+        dir.replace(tpos, strlen(token), origin);
+      }
+    }
+    if (dir.find('$') != std::string::npos) {
+      continue;
+    }
+    if (dir.empty() || dir[0] != '/') {
+      // An empty one is the cwd as well.
+      if (cwd == nullptr) {
+        continue;
+      }
+      dir = join_path(cwd, dir);
+    }
+    dirs.push_back(normalize_path(dir));
+  }
+  return dirs;
+}
+
+/**
+ * Read DT_NEEDED, DT_RPATH and DT_RUNPATH of an object.  Search paths
+ * are split and $ORIGIN is replaced.
+ */
+bool
+libmap::read_deps(const std::string& path, elf_deps* deps) {
+  if (!is_file(path)) {
+    return false;
+  }
+  ElfParser elf(path.c_str());
+  if (elf.open() < 0 || elf.parse_header() < 0 || !elf.is_elf64() ||
+      elf.parse_prog_headers() < 0 || elf.parse_dyanmic() < 0) {
+    return false;
+  }
+  if (elf.get_dynamic_num() == 0) {
+    // Static
+    return true;
+  }
+  if (elf.parse_dynamic_strtab() < 0) {
+    return false;
+  }
+
+  auto slash = path.rfind('/');
+  auto origin = slash == 0 ? std::string("/") : path.substr(0, slash);
+  auto dyns = elf.get_dynamics();
+  for (int i = 0; i < elf.get_dynamic_num(); i++) {
+    auto str = elf.get_dynamic_str(dyns[i].d_un.d_val);
+    if (str == nullptr) {
+      continue;
+    }
+    switch (dyns[i].d_tag) {
+    case DT_NEEDED:
+      deps->needed.push_back(str);
+      break;
+    case DT_RPATH:
+      deps->rpath = split_search_path(str, origin, nullptr);
+      break;
+    case DT_RUNPATH:
+      deps->runpath = split_search_path(str, origin, nullptr);
+      break;
+    }
+  }
+  return true;
+}
+
+void
+libmap::add_probe(const std::string& path) {
+  if (probed.insert(path).second) {
+    probes.push_back(path);
+  }
+}
+
+void
+libmap::add_dir_probes(const std::string& dir) {
+  add_probe(dir);
+  for (auto sub : hwcaps_dirs) {
+    add_probe(join_path(dir, sub));
+  }
+}
+
+void
+libmap::build(const char* exe, const char* ld_library_path,
+              const char* cwd) {
+  probes.clear();
+  probed.clear();
+
+  auto ld_dirs = split_search_path(ld_library_path, "", cwd);
+  std::vector<std::string> exe_rpath;
+  std::set<std::string> names;
+  std::vector<std::string> objs;
+  objs.push_back(exe);
+  for (size_t i = 0; i < objs.size() && i < LIBMAP_OBJECTS_MAX; i++) {
+    elf_deps deps;
+    if (!read_deps(objs[i], &deps)) {
+      continue;
+    }
+    if (i == 0 && deps.runpath.empty()) {
+      // DT_RPATH of the executable applies to all objects.
+      exe_rpath = deps.rpath;
+    }
+
+    for (auto& name : deps.needed) {
+      if (!names.insert(name).second) {
+        continue;
+      }
+      if (name.find('/') != std::string::npos) {
+        // Loaded with the path as is.
+        if (name[0] == '/') {
+          objs.push_back(name);
+        }
+        continue;
+      }
+
+      // The search order of ld.so.  DT_RPATH is ignored if there is
+      // DT_RUNPATH.
+      std::vector<std::string> dirs;
+      if (deps.runpath.empty()) {
+        dirs = deps.rpath;
+        if (i != 0) {
+          dirs.insert(dirs.end(), exe_rpath.begin(), exe_rpath.end());
+        }
+      }
+      dirs.insert(dirs.end(), ld_dirs.begin(), ld_dirs.end());
+      dirs.insert(dirs.end(), deps.runpath.begin(), deps.runpath.end());
+
+      std::string found;
+      for (auto& dir : dirs) {
+        add_dir_probes(dir);
+        auto path = join_path(dir, name);
+        add_probe(path);
+        if (is_file(path)) {
+          found = path;
+          break;
+        }
+      }
+      if (found.empty()) {
+        for (auto dir : default_dirs) {
+          auto path = join_path(dir, name);
+          if (is_file(path)) {
+            found = path;
+            break;
+          }
+        }
+      }
+      if (!found.empty()) {
+        objs.push_back(found);
+      }
+    }
+  }
+}
@@ -0,0 +1,58 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#ifndef __libmap_h_
+#define __libmap_h_
+
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * The paths that the dynamic linker probes to load the libraries of
+ * an executable.
+ *
+ * ld.so looks for every DT_NEEDED of the executable and of loaded
+ * objects in the directories of DT_RPATH, LD_LIBRARY_PATH and
+ * DT_RUNPATH in order, and in the hwcaps subdirectories of each
+ * directory before the directory itself.  Every miss is an open()
+ * failing with ENOENT, and a stat() of the subdirectory.  The map
+ * has these directories, the top hwcaps subdirectories of them, and
+ * the paths of the libraries in them up to the one found.  The
+ * Command Center publishes their stat to the metadata table, so
+ * scouts answer the misses by themselves.
+ *
+ * Libraries not found in these directories are loaded with the paths
+ * of ld.so.cache without probing.  They are looked up in the default
+ * directories only to follow their DT_NEEDED.
+ */
+class libmap {
+public:
+  /**
+   * Build the map of the executable |exe|.  |ld_library_path| is the
+   * LD_LIBRARY_PATH of the subject, or nullptr.  Relative directories
+   * in it are relative to |cwd|.
+   */
+  void build(const char* exe, const char* ld_library_path, const char* cwd);
+
+  /**
+   * Return the absolute paths probed, in the order of probing.
+   */
+  const std::vector<std::string>& get_probes() const { return probes; }
+
+private:
+  struct elf_deps {
+    std::vector<std::string> needed;
+    std::vector<std::string> rpath;
+    std::vector<std::string> runpath;
+  };
+
+  static bool read_deps(const std::string& path, elf_deps* deps);
+  void add_probe(const std::string& path);
+  void add_dir_probes(const std::string& dir);
+
+  std::vector<std::string> probes;
+  std::set<std::string> probed;
+};
+
+#endif /* __libmap_h_ */
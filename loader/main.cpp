@@ -41,12 +41,58 @@ sigchld_handler(int signum, siginfo_t* info, void* ucontext) {
   }
 }
 
+static void
+usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [--intercept=sigsys|notify|dispatch] [--patch-syscalls]"
+          " [--ring] [--local=DIR]... [--file-images] [--fd-cache]"
+          " [--exec-stub] [--shm-stats] program [args...]\n",
+          prog);
+}
+
 int
 main(int argc, char*const* argv) {
   carrier crr;
   carrier_ptr = &crr;
 
-  auto pid = crr.run(argc - 1, argv + 1);
+  bool shm_stats = false;
+  int argi = 1;
+  for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+    auto opt = argv[argi];
+    if (strcmp(opt, "--intercept=sigsys") == 0) {
+      crr.set_intercept_mode(cmdcenter::INTERCEPT_SIGSYS);
+    } else if (strcmp(opt, "--intercept=notify") == 0) {
+      crr.set_intercept_mode(cmdcenter::INTERCEPT_USER_NOTIF);
+    } else if (strcmp(opt, "--intercept=dispatch") == 0) {
+      crr.set_intercept_mode(cmdcenter::INTERCEPT_USER_DISPATCH);
+    } else if (strcmp(opt, "--patch-syscalls") == 0) {
+      crr.set_patch_syscall(true);
+    } else if (strcmp(opt, "--ring") == 0) {
+      crr.set_msg_ring(true);
+    } else if (strncmp(opt, "--local=", 8) == 0) {
+      if (!crr.add_local_path(opt + 8)) {
+        fprintf(stderr, "%s: bad local path %s\n", argv[0], opt + 8);
+        return 255;
+      }
+    } else if (strcmp(opt, "--file-images") == 0) {
+      crr.set_file_images(true);
+    } else if (strcmp(opt, "--fd-cache") == 0) {
+      crr.set_fd_cache(true);
+    } else if (strcmp(opt, "--exec-stub") == 0) {
+      crr.set_exec_stub(true);
+    } else if (strcmp(opt, "--shm-stats") == 0) {
+      shm_stats = true;
+    } else {
+      usage(argv[0]);
+      return 255;
+    }
+  }
+  if (argi >= argc) {
+    usage(argv[0]);
+    return 255;
+  }
+
+  auto pid = crr.run(argc - argi, argv + argi);
 
   // Install a SIGCHLD handler to terminate the Carrier when the
   // mission is completed.
@@ -65,11 +111,15 @@ main(int argc, char*const* argv) {
   // been emitted before the signal handler being ready.
   int status;
   r = waitpid(childpid, &status, WNOHANG);
-  if (r < 0 || WIFEXITED(status)) {
+  if (r < 0 || (r > 0 && WIFEXITED(status))) {
     return 0;
   }
 
   crr.handle_messages();
 
+  if (shm_stats) {
+    crr.print_shm_stats(stderr);
+  }
+
   return exitval;
 }
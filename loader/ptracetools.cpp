@@ -11,7 +11,9 @@
 #include <sys/ptrace.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdint.h>
 
 #include <assert.h>
@@ -56,62 +58,124 @@ mk_funcall_args(user_regs_struct& regs,
   regs.r9 = arg6;
 }
 
+/**
+ * Access the memory of a tracee through /proc/<pid>/mem.  Like
+ * PTRACE_POKETEXT, it ignores the protection of pages.
+ */
+static long
+access_proc_mem(pid_t pid, void* addr, void* ptr, unsigned int length,
+                bool write) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+  auto fd = open(path, (write ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+  if (fd < 0) {
+    perror("open");
+    return -errno;
+  }
+  auto r = write ? pwrite(fd, ptr, length, (off_t)addr) :
+    pread(fd, ptr, length, (off_t)addr);
+  auto err = r < 0 ? errno : EIO;
+  close(fd);
+  if ((unsigned int)r != length) {
+    fprintf(stderr, "%s /proc/%d/mem: %s\n",
+            write ? "pwrite" : "pread", pid, strerror(err));
+    return -err;
+  }
+  return 0;
+}
+
+/**
+ * Write |length| bytes at |ptr| to |addr| of the tracee |pid| in one
+ * syscall with process_vm_writev(), or through /proc/<pid>/mem for
+ * pages that are not writable, like text.
+ */
 long
 inject_text(pid_t pid, void* addr, void* ptr, unsigned int length) {
-  assert((length & 0x7) == 0);
-
-  auto v = (const uint64_t*)ptr;
-  auto cnt = length / 8;
-  auto vaddr = (uint64_t*)addr;
-  for (unsigned int i = 0; i < cnt; i++) {
-    auto r = ptrace(PTRACE_POKETEXT, pid, vaddr, *v);
-    if (r < 0) {
-      perror("ptrace");
-      return r;
-    }
-    v++;
-    vaddr++;
+  if (write_mem(pid, addr, ptr, length) == 0) {
+    return 0;
   }
-  return 0;
+  return access_proc_mem(pid, addr, ptr, length, true);
 }
 
 long
 inject_data(pid_t pid, void* addr, void* ptr, unsigned int length) {
-  assert((length & 0x7) == 0);
+  return inject_text(pid, addr, ptr, length);
+}
 
-  auto v = (const uint64_t*)ptr;
-  auto cnt = length / 8;
-  auto vaddr = (uint64_t*)addr;
-  for (unsigned int i = 0; i < cnt; i++) {
-    printf("idata %p %p %lx\n", vaddr, v, *v);
-    auto r = ptrace(PTRACE_POKEDATA, pid, vaddr, *v);
-    if (r < 0) {
-      perror("ptrace");
-      return r;
-    }
-    v++;
-    vaddr++;
+/**
+ * Read |length| bytes at |addr| of the tracee |pid|, the counterpart
+ * of inject_text().
+ */
+long
+read_text(pid_t pid, void* addr, void* ptr, unsigned int length) {
+  if (read_mem(pid, addr, ptr, length) == 0) {
+    return 0;
+  }
+  return access_proc_mem(pid, addr, ptr, length, false);
+}
+
+/**
+ * Read the memory of a process without stopping it.
+ *
+ * Unlike |read_text()|, the process doesn't need to be a tracee.  The
+ * caller should have the permission to ptrace the process.
+ */
+long
+read_mem(pid_t pid, void* addr, void* ptr, unsigned int length) {
+  iovec local = { ptr, length };
+  iovec remote = { addr, length };
+  auto r = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+  if (r < 0) {
+    return -errno;
+  }
+  if ((unsigned int)r != length) {
+    return -EFAULT;
   }
   return 0;
 }
 
 long
-read_text(pid_t pid, void* addr, void* ptr, unsigned int length) {
-  assert((length & 0x7) == 0);
+write_mem(pid_t pid, void* addr, const void* ptr, unsigned int length) {
+  iovec local = { const_cast<void*>(ptr), length };
+  iovec remote = { addr, length };
+  auto r = process_vm_writev(pid, &local, 1, &remote, 1, 0);
+  if (r < 0) {
+    return -errno;
+  }
+  if ((unsigned int)r != length) {
+    return -EFAULT;
+  }
+  return 0;
+}
 
-  auto v = (uint64_t*)ptr;
-  auto cnt = length / 8;
-  auto vaddr = (uint64_t*)addr;
-  for (unsigned int i = 0; i < cnt; i++) {
-    auto r = ptrace(PTRACE_PEEKTEXT, pid, vaddr, nullptr);
-    if (errno != 0) {
-      perror("ptrace");
-      return -1;
+/**
+ * Read a null-terminated string from the memory of a process.
+ *
+ * It reads page by page to avoid crossing to an unmapped page after
+ * the string.  Return the length of the string, or a negative error
+ * code.  -ENAMETOOLONG if the string doesn't fit in |size| bytes.
+ */
+long
+read_cstr(pid_t pid, void* addr, char* buf, unsigned int size) {
+  const unsigned long pgsz = 4096;
+  unsigned int pos = 0;
+  while (pos < size) {
+    auto src = (unsigned long)addr + pos;
+    auto chunk = pgsz - (src & (pgsz - 1));
+    if (chunk > size - pos) {
+      chunk = size - pos;
+    }
+    auto r = read_mem(pid, (void*)src, buf + pos, chunk);
+    if (r < 0) {
+      return r;
+    }
+    auto end = (char*)memchr(buf + pos, 0, chunk);
+    if (end) {
+      return end - buf;
     }
-    *v++ = r;
-    vaddr++;
+    pos += chunk;
   }
-  return 0;
+  return -ENAMETOOLONG;
 }
 
 long
@@ -506,6 +570,64 @@ inject_mmap(pid_t pid, void* addr, size_t length,
 
 #ifdef TEST
 
+#include <time.h>
+
+/**
+ * Write word by word with PTRACE_POKETEXT like inject_text() did, to
+ * compare with.
+ */
+static long
+poke_text(pid_t pid, void* addr, void* ptr, unsigned int length) {
+  auto v = (const uint64_t*)ptr;
+  auto vaddr = (uint64_t*)addr;
+  for (unsigned int i = 0; i < length / 8; i++) {
+    auto r = ptrace(PTRACE_POKETEXT, pid, vaddr++, *v++);
+    if (r < 0) {
+      perror("ptrace");
+      return r;
+    }
+  }
+  return 0;
+}
+
+static double
+now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Time writing |length| bytes to |addr| of the tracee with
+ * PTRACE_POKETEXT and with inject_text(), and check what
+ * read_text() reads back.
+ */
+static void
+bench_inject(pid_t pid, void* addr, unsigned int length, const char* what) {
+  std::unique_ptr<char[]> poked(new char[length]);
+  std::unique_ptr<char[]> injected(new char[length]);
+  std::unique_ptr<char[]> back(new char[length]);
+  for (unsigned int i = 0; i < length; i++) {
+    poked[i] = i * 7;
+    injected[i] = i * 13 + 1;
+  }
+
+  auto start = now_us();
+  auto r = poke_text(pid, addr, poked.get(), length);
+  auto poke_us = now_us() - start;
+  start = now_us();
+  r |= inject_text(pid, addr, injected.get(), length);
+  auto inject_us = now_us() - start;
+  start = now_us();
+  r |= read_text(pid, addr, back.get(), length);
+  auto read_us = now_us() - start;
+
+  auto ok = r == 0 && memcmp(back.get(), injected.get(), length) == 0;
+  printf("%s %u bytes: poketext %.0f us, inject_text %.0f us, "
+         "read_text %.0f us, %s\n", what, length, poke_us, inject_us,
+         read_us, ok ? "OK" : "FAILED");
+}
+
 void
 child() {
   for (int i = 0; i < 5; i++) {
@@ -540,6 +662,17 @@ parent(int pid) {
   if (r < 0) {
     printf("errno %ld\n", -r);
   }
+
+  // The size of a shellcode, to a writable and a read-only mapping.
+  const unsigned int bench_size = 65536;
+  auto rw_addr = inject_mmap(pid, nullptr, bench_size,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  auto ro_addr = inject_mmap(pid, nullptr, bench_size,
+                             PROT_READ | PROT_EXEC,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  bench_inject(pid, rw_addr, bench_size, "writable");
+  bench_inject(pid, ro_addr, bench_size, "read-only");
   printf("pid %d\n", pid);
   ptrace_cont(pid);
   if (r == -1) {
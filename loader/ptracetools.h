@@ -18,6 +18,9 @@ void mk_funcall_args(user_regs_struct& regs,
 long inject_text(pid_t, void*, void*, unsigned int);
 long inject_data(pid_t, void*, void*, unsigned int);
 long read_text(pid_t, void*, void*, unsigned int);
+long read_mem(pid_t, void*, void*, unsigned int);
+long write_mem(pid_t, void*, const void*, unsigned int);
+long read_cstr(pid_t, void*, char*, unsigned int);
 long ptrace_attach(pid_t);
 long ptrace_waitstop(pid_t);
 long ptrace_waittrap(pid_t pid);
@@ -0,0 +1,35 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * Open a directory, rename it, and look up an entry relative to the
+ * directory fd and to the cwd in it.
+ */
+int
+main() {
+  mkdir("dir_rename.a", 0755);
+  close(open("dir_rename.a/f", O_CREAT | O_WRONLY, 0644));
+  auto dfd = open("dir_rename.a", O_RDONLY | O_DIRECTORY);
+  // Remember the path of the directory.
+  struct stat st;
+  fstatat(dfd, "f", &st, 0);
+  chdir("dir_rename.a");
+  access("f", F_OK);
+
+  rename("../dir_rename.a", "../dir_rename.b");
+  auto fd = openat(dfd, "f", O_RDONLY);
+  printf("openat %s\n", fd >= 0 ? "OK" : strerror(errno));
+  auto r = fstatat(dfd, "f", &st, 0);
+  printf("fstatat %s\n", r == 0 ? "OK" : strerror(errno));
+  r = access("f", F_OK);
+  printf("cwd %s\n", r == 0 ? "OK" : strerror(errno));
+
+  chdir("..");
+  unlink("dir_rename.b/f");
+  rmdir("dir_rename.b");
+  return 0;
+}
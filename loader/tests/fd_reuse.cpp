@@ -0,0 +1,30 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+/**
+ * Close a file right after opening it, and reuse its fd with a
+ * syscall that is not trapped, before the first fstat() on the fd.
+ */
+int
+main() {
+  auto fd = open("/etc/passwd", O_RDONLY);
+  close(fd);
+  int fds[2];
+  pipe(fds);
+  struct stat st;
+  fstat(fds[0], &st);
+  printf("pipe %s\n", fds[0] == fd && S_ISFIFO(st.st_mode) ? "OK" : "FAILED");
+
+  struct stat other_st;
+  auto other = open("/etc/hostname", O_RDONLY);
+  fstat(other, &other_st);
+  fd = open("/etc/passwd", O_RDONLY);
+  close(fd);
+  auto r = fcntl(other, F_DUPFD, fd);
+  fstat(r, &st);
+  printf("dup %s\n",
+         r == fd && st.st_ino == other_st.st_ino ? "OK" : "FAILED");
+  return 0;
+}
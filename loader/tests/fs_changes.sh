@@ -0,0 +1,26 @@
+# Probe paths before and after changing them, to check that results
+# remembered by scouts don't survive changes made by the subject.
+# The output should be the same as without the carrier.
+cd tests
+rm -rf fs_changes.tmp
+test -d fs_changes.tmp; echo "mkdir before $?"
+mkdir fs_changes.tmp; test -d fs_changes.tmp; echo "mkdir after $?"
+cd fs_changes.tmp
+echo hi > f; test -e f; echo "rm before $?"
+rm f; test -e f; echo "rm after $?"
+test -e g; echo "mv before $?"
+echo hi > f; mv f g; test -e g; echo "mv after $?"
+test -e f; echo "mv source $?"
+# Files read again after being rewritten or replaced, the Command
+# Center may keep them opened or have their images.
+echo one > c; cat c; echo two > c; cat c
+echo three > c.new; mv c.new c; cat c
+# Other processes start with the results published by the Command
+# Center, and fail below parents known to be missing.
+/usr/bin/test -e p/q/r; echo "parents before $?"
+mkdir -p p/q/r; /usr/bin/test -e p/q/r; echo "parents after $?"
+# Paths of an opened directory and of the cwd, renamed after being
+# remembered.
+../dir_rename
+cd ..
+rm -rf fs_changes.tmp; test -d fs_changes.tmp; echo "rmdir after $?"
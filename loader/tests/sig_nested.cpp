@@ -0,0 +1,50 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static volatile int handled;
+
+static void
+on_alarm(int) {
+  // Trapped syscalls in the middle of the syscalls of the main loop.
+  struct stat st;
+  stat("/etc/passwd", &st);
+  close(open("/etc/hostname", O_RDONLY));
+  handled++;
+}
+
+/**
+ * Make syscalls from a signal handler interrupting other syscalls
+ * of the same thread.
+ */
+int
+main() {
+  struct sigaction act = {};
+  act.sa_handler = on_alarm;
+  act.sa_flags = SA_RESTART;
+  sigaction(SIGALRM, &act, nullptr);
+  struct itimerval itv = {{0, 200}, {0, 200}};
+  setitimer(ITIMER_REAL, &itv, nullptr);
+
+  int bad = 0;
+  for (int i = 0; i < 5000; i++) {
+    struct stat st;
+    if (stat("/etc/passwd", &st) < 0) {
+      bad++;
+    }
+    auto fd = open("/etc/passwd", O_RDONLY);
+    char c;
+    if (fd < 0 || read(fd, &c, 1) != 1) {
+      bad++;
+    }
+    close(fd);
+  }
+
+  itv = {};
+  setitimer(ITIMER_REAL, &itv, nullptr);
+  printf("%s\n", bad == 0 && handled > 0 ? "OK" : "FAILED");
+  return 0;
+}
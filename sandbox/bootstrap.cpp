@@ -25,8 +25,12 @@
 
 extern "C" {
 extern void tinymalloc_init();
+extern void tinylibc_init();
 
 unsigned long int global_flags __attribute__((visibility("default"))) = (unsigned long int)&global_flags;
+// Where the Flight Deck has mapped the memory shared by the Command
+// Center, 0 if not available.  Patched like global_flags.
+unsigned long int cc_shm_addr __attribute__((visibility("default"))) = (unsigned long int)&cc_shm_addr;
 }
 
 class bootstrap {
@@ -36,6 +40,7 @@ public:
     // Neutralize the effects caused by the relocation.
     // Check the comment in the body of prepare_shellcode().
     global_flags -= (unsigned long int)&global_flags;
+    cc_shm_addr -= (unsigned long int)&cc_shm_addr;
 
     // Use a buf since tinymalloc is not ready yet.
     sct = new((void*)sct_buf) scout();
@@ -43,6 +48,7 @@ public:
     auto syscall_r = sct->install_syscall_trampo();
     assert(syscall_r);
 
+    tinylibc_init();
     tinymalloc_init();
 
     sct->init_sandbox();
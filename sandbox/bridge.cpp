@@ -6,6 +6,7 @@
 #include "tinypack.h"
 
 #include "msghelper.h"
+#include "msgring.h"
 
 #include "log.h"
 
@@ -14,6 +15,11 @@
 #include <asm/unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <errno.h>
 
 #include <memory>
 #include <assert.h>
@@ -21,170 +27,1137 @@
 
 extern "C" {
 extern long (*td__syscall_trampo)(long, ...);
+extern void (*td__sig_trampo)();
+extern unsigned long int global_flags;
+extern unsigned long int cc_shm_addr;
 }
 
 #define SYSCALL td__syscall_trampo
 
+#ifndef SA_RESTORER
+#define SA_RESTORER 0x04000000
+#endif
+
+// Times to check the reply before sleeping on the futex.
+#define RING_SPIN 256
+// Number of channels of threads in a chunk.
+#define THREAD_CHANNELS 64
+// Max bytes of entries returned by a getdents64(), what a reply can
+// carry.
+#define DENTS_BATCH_MAX (msg_receiver::data_buf_size - 64)
+
+/**
+ * Channels of threads are kept in chunks linked together.  Chunks are
+ * never freed, slots of dead threads are reused.
+ */
+struct sandbox_bridge::channel_chunk {
+  channel chans[THREAD_CHANNELS];
+  channel_chunk* next;
+};
+
+/*
+ * The protocol between scouts and the Command Center.
+ *
+ * A message is a size prefixed record packed by tinypack, and a
+ * datagram of the socket may carry several records.  A request
+ * starts with an id and the command, followed by arguments:
+ *
+ *   [size][id][cmd][args...]
+ *
+ * and the reply of a request starts with the same id:
+ *
+ *   [size][id][result][values...]
+ *
+ * Ids are counted by channels, never 0.  Notifications, requests
+ * that need no reply, have the id 0.  They are kept in the channel
+ * and sent along with the next request in the same datagram, or
+ * pushed to the ring before it.  fds passed along with a datagram
+ * belong to the last record, the request.
+ */
+
 static int
-receive_int_msg(msg_receiver* rcvr) {
-  auto ok = rcvr->receive_one();
-  assert(ok);
-  auto ptr = rcvr->get_data();
-  assert(rcvr->get_data_bytes() == 2 * sizeof(int));
-  assert(*(int*)ptr == sizeof(int));
-  assert((int)(*(int*)ptr + sizeof(int)) == rcvr->get_data_bytes());
+parse_int_reply(const char* ptr, int bytes) {
+  assert(bytes == 3 * sizeof(int));
+  assert(*(int*)ptr == 2 * sizeof(int));
+  assert((int)(*(int*)ptr + sizeof(int)) == bytes);
 
-  ptr += sizeof(int);
+  ptr += 2 * sizeof(int);
   auto r = *(int*)ptr;
   return r;
 }
 
-template<typename T>
+/**
+ * Parse a reply of an int as the result followed by other values.
+ */
+template<typename... Values>
 static int
-receive_struct_msg(msg_receiver* rcvr, T* buf) {
-  auto ok = rcvr->receive_one();
-  assert(ok);
+parse_reply(const char* ptr, int bytes, Values&... values) {
   unsigned int payload_sz;
+  unsigned int id;
   int r;
-  auto unpacker = tinyunpacker(rcvr->get_data(), rcvr->get_data_bytes())
-    .field(payload_sz)
-    .field(r)
-    .field(*buf);
+  auto unpacker = tinyunpack_fields(tinyunpacker(ptr, bytes),
+                                    payload_sz, id, r, values...);
   assert(unpacker.check_completed());
-  assert(unpacker.get_size() == rcvr->get_data_bytes());
+  assert(unpacker.get_size() == bytes);
 
   unpacker.unpack();
-  assert((int)(payload_sz + sizeof(int)) == rcvr->get_data_bytes());
+  assert((int)(payload_sz + sizeof(int)) == bytes);
 
   return r;
 }
 
-int sandbox_bridge::send_open(const char* path, int flags, mode_t mode) {
-  LOGU(send_open);
-  auto pack = tinypacker()
-    .field(scout::cmd_open)
-    .field(path)
-    .field(flags)
-    .field(mode);
-  auto buf = pack.pack_size_prefix();
-  send_msg(sock, buf, pack.get_size_prefix());
-  free(buf);
-  return 0;
+/**
+ * Fill the basic stats of a statx from a stat.
+ */
+static void
+stat_to_statx(const struct stat* st, struct statx* stx) {
+  bzero(stx, sizeof(*stx));
+  stx->stx_mask = STATX_BASIC_STATS;
+  stx->stx_blksize = st->st_blksize;
+  stx->stx_nlink = st->st_nlink;
+  stx->stx_uid = st->st_uid;
+  stx->stx_gid = st->st_gid;
+  stx->stx_mode = st->st_mode;
+  stx->stx_ino = st->st_ino;
+  stx->stx_size = st->st_size;
+  stx->stx_blocks = st->st_blocks;
+  stx->stx_atime.tv_sec = st->st_atim.tv_sec;
+  stx->stx_atime.tv_nsec = st->st_atim.tv_nsec;
+  stx->stx_mtime.tv_sec = st->st_mtim.tv_sec;
+  stx->stx_mtime.tv_nsec = st->st_mtim.tv_nsec;
+  stx->stx_ctime.tv_sec = st->st_ctim.tv_sec;
+  stx->stx_ctime.tv_nsec = st->st_ctim.tv_nsec;
+  // The encoding of dev_t by glibc.
+  stx->stx_rdev_major = ((st->st_rdev >> 8) & 0xfff) |
+    ((st->st_rdev >> 32) & ~0xfffU);
+  stx->stx_rdev_minor = (st->st_rdev & 0xff) | ((st->st_rdev >> 12) & ~0xffU);
+  stx->stx_dev_major = ((st->st_dev >> 8) & 0xfff) |
+    ((st->st_dev >> 32) & ~0xfffU);
+  stx->stx_dev_minor = (st->st_dev & 0xff) | ((st->st_dev >> 12) & ~0xffU);
 }
 
-int sandbox_bridge::send_openat(int dirfd, const char* path, int flags, mode_t mode) {
-  LOGU(send_openat);
-  auto pack = tinypacker()
-    .field(scout::cmd_openat)
-    .field(dirfd)
-    .field(path)
-    .field(flags)
-    .field(mode);
-  auto buf = pack.pack_size_prefix();
-  send_msg(sock, buf, pack.get_size_prefix(), dirfd);
+static unsigned int
+reply_id(const char* ptr, int bytes) {
+  assert(bytes >= (int)(2 * sizeof(int)));
+  return *(unsigned int*)(ptr + sizeof(int));
+}
+
+template<typename P>
+static void
+write_record(P& pack, char* buf) {
+  unsigned int sz = pack.get_size();
+  memcpy(buf, &sz, sizeof(sz));
+  pack.writebuf(buf + sizeof(sz));
+}
+
+unsigned int sandbox_bridge::new_request_id(channel* chan) {
+  if (++chan->last_id == 0) {
+    chan->last_id = 1;
+  }
+  return chan->last_id;
+}
+
+/**
+ * Return the depth of the request |id| in flight, or -1.
+ */
+int sandbox_bridge::find_in_flight(channel* chan, unsigned int id) {
+  for (int i = chan->depth - 1; i >= 0; i--) {
+    if (chan->in_flight[i].id == id) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Free the replies kept aside for the requests in flight at the
+ * depths from |from| to |to|, excluded.
+ */
+void sandbox_bridge::free_early(channel* chan, unsigned int from,
+                                unsigned int to) {
+  for (auto i = from; i < to; i++) {
+    if (chan->in_flight[i].early != nullptr) {
+      free(chan->in_flight[i].early);
+    }
+  }
+}
+
+/**
+ * Start a request on |chan|, nested in the requests in flight if any,
+ * and return its id.
+ */
+unsigned int sandbox_bridge::begin_request(channel* chan) {
+  if (chan->depth == 0 && ring_enabled && !chan->ring_tried) {
+    init_ring(chan);
+  }
+  if (chan->depth == channel::nest_max) {
+    // The outermost request has been left by a siglongjmp() out of
+    // the signal handler.  Its receiver is taken by the new one.
+    free_early(chan, 0, 1);
+    auto rcvr = chan->rcvrs[0];
+    for (unsigned int i = 1; i < channel::nest_max; i++) {
+      chan->in_flight[i - 1] = chan->in_flight[i];
+      chan->rcvrs[i - 1] = chan->rcvrs[i];
+    }
+    chan->rcvrs[channel::nest_max - 1] = rcvr;
+    chan->depth--;
+  }
+  auto level = chan->depth++;
+  if (chan->rcvrs[level] == nullptr) {
+    auto buf = malloc(sizeof(msg_receiver));
+    chan->rcvrs[level] = new(buf) msg_receiver(chan->sock);
+  }
+  auto id = new_request_id(chan);
+  chan->in_flight[level].id = id;
+  chan->in_flight[level].early = nullptr;
+  chan->in_flight[level].wake_sent = false;
+  return id;
+}
+
+/**
+ * End the request |id| after parsing its reply.  Requests nested in
+ * it have been left by siglongjmp() if they are still in flight.
+ *
+ * Outer requests whose replies have been kept aside are woken up.
+ */
+void sandbox_bridge::end_request(channel* chan, unsigned int id) {
+  auto level = find_in_flight(chan, id);
+  if (level < 0) {
+    // Dropped by |begin_request()|.
+    return;
+  }
+  free_early(chan, level, chan->depth);
+  chan->depth = level;
+
+  for (int i = 0; i < level; i++) {
+    auto& outer = chan->in_flight[i];
+    if (outer.early != nullptr && !outer.wake_sent) {
+      auto pack = tinypacker()
+        .field(outer.id)
+        .field(scout::cmd_wake);
+      send_request(chan, pack);
+      outer.wake_sent = true;
+    }
+  }
+}
+
+/**
+ * Wait for the reply of the request |id|.  Replies of outer requests
+ * are kept aside for them, and replies of requests not in flight
+ * anymore are dropped.
+ */
+bool sandbox_bridge::wait_reply(channel* chan, unsigned int id, reply* rep) {
+  auto level = find_in_flight(chan, id);
+  assert(level >= 0);
+  auto rcvr = chan->rcvrs[level];
+  for (;;) {
+    auto early = chan->in_flight[level].early;
+    if (early != nullptr) {
+      *rep = *early;
+      return true;
+    }
+
+    if (!rcvr->receive_one()) {
+      return false;
+    }
+    auto data = rcvr->get_data();
+    auto bytes = rcvr->get_data_bytes();
+    auto fd_num = rcvr->get_fd_rcvd_num();
+    auto fds = rcvr->get_fd_rcvd();
+    auto owner = find_in_flight(chan, reply_id(data, bytes));
+    if (owner < 0 || chan->in_flight[owner].early != nullptr) {
+      if (owner >= 0) {
+        // A wake-up, see |end_request()|.  Send another one if it is
+        // not for this request.
+        chan->in_flight[owner].wake_sent = false;
+      }
+      for (int i = 0; i < fd_num; i++) {
+        SYSCALL(__NR_close, fds[i]);
+      }
+      continue;
+    }
+    if (owner == level) {
+      rep->data = data;
+      rep->bytes = bytes;
+      rep->fd_num = fd_num;
+      memcpy(rep->fds, fds, fd_num * sizeof(int));
+      return true;
+    }
+    auto kept = (reply*)malloc(sizeof(reply) + bytes);
+    memcpy(kept + 1, data, bytes);
+    kept->data = (char*)(kept + 1);
+    kept->bytes = bytes;
+    kept->fd_num = fd_num;
+    memcpy(kept->fds, fds, fd_num * sizeof(int));
+    chan->in_flight[owner].early = kept;
+  }
+}
+
+/**
+ * A request in flight on a channel, from getting its id to leaving
+ * the scope, after its reply has been parsed.
+ */
+class sandbox_bridge::request_scope {
+public:
+  request_scope(sandbox_bridge* bridge, channel* chan)
+    : bridge(bridge)
+    , chan(chan)
+    , id(bridge->begin_request(chan)) {
+  }
+  ~request_scope() {
+    end();
+  }
+
+  unsigned int get_id() { return id; }
+  // End the request early, before retrying it with another one.
+  void end() {
+    if (id != 0) {
+      bridge->end_request(chan, id);
+      id = 0;
+    }
+  }
+
+private:
+  sandbox_bridge* bridge;
+  channel* chan;
+  unsigned int id;
+};
+
+unsigned int sandbox_bridge::find_handle(channel* chan, int fd) {
+  if (fd < 0) {
+    return 0;
+  }
+  auto& slot = chan->handles[fd % channel::handle_slots];
+  return slot.fd == fd ? slot.handle : 0;
+}
+
+void sandbox_bridge::set_handle(channel* chan, int fd, unsigned int handle) {
+  if (fd < 0) {
+    return;
+  }
+  auto& slot = chan->handles[fd % channel::handle_slots];
+  if (handle != 0) {
+    slot.fd = fd;
+    slot.handle = handle;
+  } else if (slot.fd == fd) {
+    slot.fd = -1;
+  }
+}
+
+/**
+ * Join |path| to the directory |dir| in |buf| of CC_SHM_PATH_MAX
+ * bytes.  Return false if it doesn't fit.
+ */
+static bool
+join_path(const char* dir, const char* path, char* buf) {
+  auto dir_len = strlen(dir);
+  auto len = strlen(path);
+  if (dir_len == 1) {
+    // The root
+    dir_len = 0;
+  }
+  if (dir_len + 1 + len >= CC_SHM_PATH_MAX) {
+    return false;
+  }
+  memcpy(buf, dir, dir_len);
+  buf[dir_len] = '/';
+  memcpy(buf + dir_len + 1, path, len + 1);
+  return true;
+}
+
+/**
+ * Make the canonical absolute path of |path| in |buf| of
+ * CC_SHM_PATH_MAX bytes.  A relative |path| is relative to |base|, the
+ * cwd.  Duplicated slashes and "." are dropped.
+ *
+ * ".." is collapsed only against |base| and the root, they have no
+ * symlinks since |base| comes from getcwd().  A component of |path|
+ * may be a symlink, and "link/.." is not always the directory of
+ * "link", so ".." following one is kept.  So is the trailing slash
+ * that makes the call fail for non-directories.
+ *
+ * Return false if it doesn't fit.
+ */
+static bool
+canonicalize_path(const char* base, const char* path, char* buf) {
+  size_t len = 0;
+  if (path[0] != '/') {
+    len = strlen(base);
+    if (len >= CC_SHM_PATH_MAX) {
+      return false;
+    }
+    memcpy(buf, base, len);
+    if (len == 1) {
+      // The root
+      len = 0;
+    }
+  }
+  // Nothing but |base| and ".." collapsed against it in |buf|.
+  auto real = true;
+  auto p = path;
+  for (;;) {
+    while (*p == '/') {
+      p++;
+    }
+    if (*p == 0) {
+      break;
+    }
+    auto comp = p;
+    while (*p != 0 && *p != '/') {
+      p++;
+    }
+    auto comp_len = (size_t)(p - comp);
+    if (comp_len == 1 && comp[0] == '.') {
+      continue;
+    }
+    if (comp_len == 2 && comp[0] == '.' && comp[1] == '.' && real) {
+      while (len > 0 && buf[len - 1] != '/') {
+        len--;
+      }
+      if (len > 0) {
+        len--;
+      }
+      continue;
+    }
+    real = false;
+    if (len + 1 + comp_len >= CC_SHM_PATH_MAX) {
+      return false;
+    }
+    buf[len++] = '/';
+    memcpy(buf + len, comp, comp_len);
+    len += comp_len;
+  }
+
+  auto path_len = (size_t)(p - path);
+  auto must_dir = path[path_len - 1] == '/' ||
+    (path[path_len - 1] == '.' && (path_len == 1 || path[path_len - 2] == '/'));
+  if (len == 0 || (must_dir && !real)) {
+    if (len + 1 >= CC_SHM_PATH_MAX) {
+      return false;
+    }
+    buf[len++] = '/';
+  }
+  buf[len] = 0;
+  return true;
+}
+
+/**
+ * Remember the absolute |path| of the directory |fd|.  |st| is the
+ * stat of the directory if known, or nullptr.
+ */
+void sandbox_bridge::set_dir_path(channel* chan, int fd, const char* path,
+                                  const struct stat* st) {
+  auto& slot = chan->dirs[fd % channel::dir_slots];
+  slot.fd = -1;
+  auto len = strlen(path);
+  if (path[0] != '/' || len >= CC_SHM_PATH_MAX) {
+    return;
+  }
+  struct stat buf;
+  if (st == nullptr) {
+    if (SYSCALL(__NR_fstat, fd, (long)&buf) < 0) {
+      return;
+    }
+    st = &buf;
+  }
+  slot.dev = st->st_dev;
+  slot.ino = st->st_ino;
+  slot.gen = memo.generation();
+  memcpy(slot.path, path, len + 1);
+  slot.fd = fd;
+}
+
+void sandbox_bridge::forget_dir(channel* chan, int fd) {
+  auto& slot = chan->dirs[fd % channel::dir_slots];
+  if (slot.fd == fd) {
+    slot.fd = -1;
+  }
+}
+
+/**
+ * Return the absolute path of |path| relative to |dirfd| in |buf| of
+ * CC_SHM_PATH_MAX bytes if the path of |dirfd| is known, or
+ * nullptr.
+ *
+ * The subject may close the directory and reuse the fd number, or
+ * duplicate it, with calls that are not intercepted, fcntl(F_DUPFD)
+ * for example.  So, directories are matched by the device and inode
+ * from a fstat() made directly, which costs much less than a
+ * request.  A duplicate takes the slot of its fd.
+ *
+ * The directory or one of its parents may have been renamed since
+ * the path was remembered.  Every rename() bumps the generation of
+ * the memo cache, then the path is checked to still lead to the
+ * directory.
+ */
+const char* sandbox_bridge::dir_entry_path(channel* chan, int dirfd,
+                                           const char* path, char* buf) {
+  if (dirfd < 0 || path[0] == '/' || path[0] == 0) {
+    return nullptr;
+  }
+  struct stat st;
+  if (SYSCALL(__NR_fstat, dirfd, (long)&st) < 0 || !S_ISDIR(st.st_mode)) {
+    return nullptr;
+  }
+  auto& slot = chan->dirs[dirfd % channel::dir_slots];
+  if (slot.fd != dirfd || st.st_dev != slot.dev || st.st_ino != slot.ino) {
+    unsigned int i = 0;
+    for (; i < channel::dir_slots; i++) {
+      auto& dir = chan->dirs[i];
+      if (dir.fd >= 0 && st.st_dev == dir.dev && st.st_ino == dir.ino) {
+        break;
+      }
+    }
+    if (i == channel::dir_slots) {
+      return nullptr;
+    }
+    if (&slot != &chan->dirs[i]) {
+      slot = chan->dirs[i];
+    }
+    slot.fd = dirfd;
+  }
+  auto gen = memo.generation();
+  if (gen == 0 || slot.gen != gen) {
+    struct stat path_st;
+    if (SYSCALL(__NR_stat, (long)slot.path, (long)&path_st) < 0 ||
+        path_st.st_dev != slot.dev || path_st.st_ino != slot.ino) {
+      slot.fd = -1;
+      return nullptr;
+    }
+    slot.gen = gen;
+  }
+  if (!join_path(slot.path, path, buf)) {
+    return nullptr;
+  }
+  return buf;
+}
+
+/**
+ * Return the cwd of the process, or nullptr if it is not known.
+ *
+ * Every thread keeps a copy in its channel, read from the kernel at
+ * the first use and again after a chdir() of any thread of the
+ * process.  A forked child reads its own, it has another pid.  It is
+ * read again after the generation of the memo cache is bumped as
+ * well, since the cwd or one of its parents may have been renamed.
+ */
+const char* sandbox_bridge::get_cwd(channel* chan) {
+  auto pid = (pid_t)SYSCALL(__NR_getpid);
+  auto changes = __atomic_load_n(&cwd_changes, __ATOMIC_ACQUIRE);
+  auto gen = memo.generation();
+  if (chan->cwd_pid != pid || chan->cwd_changes != changes ||
+      gen == 0 || chan->cwd_gen != gen) {
+    auto r = SYSCALL(__NR_getcwd, (long)chan->cwd, sizeof(chan->cwd));
+    if (r < 0 || chan->cwd[0] != '/') {
+      // Too long, or not reachable from the root.
+      chan->cwd[0] = 0;
+    }
+    chan->cwd_pid = pid;
+    chan->cwd_changes = changes;
+    chan->cwd_gen = gen;
+  }
+  return chan->cwd[0] != 0 ? chan->cwd : nullptr;
+}
+
+/**
+ * Return the canonical absolute path of |path| relative to |dirfd|
+ * in |buf| of CC_SHM_PATH_MAX bytes, or nullptr if it is not known.
+ *
+ * Caches on both sides are keyed by absolute paths, "./foo.h" and
+ * "/src/foo.h" share entries this way.  The Command Center doesn't
+ * need to find the cwd of the subject either.
+ */
+const char* sandbox_bridge::resolve_path(int dirfd, const char* path,
+                                         char* buf) {
+  if (path == nullptr || path[0] == 0) {
+    return nullptr;
+  }
+  const char* base = nullptr;
+  char entry_buf[CC_SHM_PATH_MAX];
+  if (path[0] != '/') {
+    auto chan = get_channel();
+    if (dirfd == AT_FDCWD) {
+      base = get_cwd(chan);
+      if (base == nullptr) {
+        return nullptr;
+      }
+    } else {
+      path = dir_entry_path(chan, dirfd, path, entry_buf);
+      if (path == nullptr) {
+        return nullptr;
+      }
+    }
+  }
+  return canonicalize_path(base, path, buf) ? buf : nullptr;
+}
+
+/**
+ * Send a request along with pending notifications in a datagram.
+ */
+template<typename P>
+int sandbox_bridge::send_request(channel* chan, P& pack, int fd1, int fd2) {
+  auto bytes = chan->pending_bytes + pack.get_size_prefix();
+  auto buf = (char*)malloc(bytes);
+  memcpy(buf, chan->pending, chan->pending_bytes);
+  write_record(pack, buf + chan->pending_bytes);
+  auto r = send_msg(chan->sock, buf, bytes, fd1, fd2);
   free(buf);
+  chan->pending_bytes = 0;
+  return r;
+}
 
-  rcvr->receive_one();
-  assert(rcvr->get_data_bytes() == 2 * sizeof(int));
-  auto ptr = rcvr->get_data();
-  auto ptr_end = ptr + rcvr->get_data_bytes();
-  assert((int)(*(int*)ptr + sizeof(int)) == rcvr->get_data_bytes());
-  ptr += sizeof(int);
+/**
+ * Keep a notification packed by |pack| in the channel until the next
+ * request.  It is sent at once if there is no room left.
+ */
+template<typename P>
+void sandbox_bridge::post(channel* chan, P& pack) {
+  unsigned int bytes = pack.get_size_prefix();
+  if (chan->pending_bytes + bytes > channel::pending_size) {
+    send_request(chan, pack);
+    return;
+  }
+  write_record(pack, chan->pending + chan->pending_bytes);
+  chan->pending_bytes += bytes;
+}
 
-  int r;
-  auto unpacker = tinyunpacker(ptr, ptr_end - ptr)
-    .field(r);
-  assert(unpacker.check_completed());
-  unpacker.unpack();
+/**
+ * Push pending notifications to the ring.  Return false if some of
+ * them are still pending.
+ */
+bool sandbox_bridge::flush_to_ring(channel* chan) {
+  unsigned int off = 0;
+  while (off < chan->pending_bytes) {
+    auto rec = chan->pending + off;
+    auto rec_bytes = *(unsigned int*)rec + sizeof(unsigned int);
+    if (!chan->ring->push_raw(rec, rec_bytes)) {
+      break;
+    }
+    off += rec_bytes;
+  }
+  memmove(chan->pending, chan->pending + off, chan->pending_bytes - off);
+  chan->pending_bytes -= off;
+  return chan->pending_bytes == 0;
+}
+
+/**
+ * Send a request |id| packed by |pack|, and return the reply.  The
+ * size of the reply is returned in |*bytes|.
+ *
+ * The request goes through the ring of the channel if there is one,
+ * or the socket.  Nested requests always go through the socket, the
+ * ring has room for only one reply.
+ */
+template<typename P>
+const char* sandbox_bridge::transact(channel* chan, P& pack, unsigned int id,
+                                     int* bytes) {
+  auto ring = chan->ring;
+  if (ring != nullptr && chan->depth == 1 && flush_to_ring(chan)) {
+    auto seq = ring->get_reply_seq();
+    if (ring->push(pack)) {
+      unsigned long one = 1;
+      SYSCALL(__NR_write, chan->ring_efd, (long)&one, sizeof(one));
+
+      // The Command Center is probably on another CPU.
+      for (int i = 0; i < RING_SPIN && ring->get_reply_seq() == seq; i++) {
+        __builtin_ia32_pause();
+      }
+      while (ring->get_reply_seq() == seq) {
+        SYSCALL(__NR_futex, (long)ring->get_reply_futex(), FUTEX_WAIT,
+                seq, 0, 0, 0);
+      }
+      *bytes = ring->get_reply_bytes();
+      assert(reply_id(ring->get_reply(), *bytes) == id);
+      return ring->get_reply();
+    }
+  }
+
+  send_request(chan, pack);
+
+  reply rep;
+  auto ok = wait_reply(chan, id, &rep);
+  assert(ok);
+  *bytes = rep.bytes;
+  return rep.data;
+}
+
+/**
+ * Send a command with arguments, and receive an int as the result.
+ */
+template<typename... Args>
+int sandbox_bridge::send_cmd(int cmd, Args... args) {
+  auto chan = get_channel();
+  request_scope req(this, chan);
+  auto id = req.get_id();
+  auto pack = tinypack_fields(tinypacker().field(id).field(cmd), args...);
+  int bytes;
+  auto reply = transact(chan, pack, id, &bytes);
+  return parse_int_reply(reply, bytes);
+}
+
+/**
+ * Send a command with arguments, and receive an int as the result
+ * along with a struct.
+ */
+template<typename T, typename... Args>
+int sandbox_bridge::send_cmd_struct(int cmd, T* reply, Args... args) {
+  auto chan = get_channel();
+  request_scope req(this, chan);
+  auto id = req.get_id();
+  auto pack = tinypack_fields(tinypacker().field(id).field(cmd), args...);
+  int bytes;
+  auto data = transact(chan, pack, id, &bytes);
+  return parse_reply(data, bytes, *reply);
+}
+
+/**
+ * Send a command on |fd| with arguments, and return the result
+ * parsed by |parse| from the reply.
+ *
+ * |fd| is referred by its handle if the Command Center keeps it, so
+ * the request may go through the ring.  Otherwise, it is passed along
+ * with the request.
+ */
+template<typename Parse, typename... Args>
+int sandbox_bridge::send_fd_cmd(int cmd, int fd, Parse parse, Args... args) {
+  auto chan = get_channel();
+  auto handle = find_handle(chan, fd);
+  request_scope req(this, chan);
+  auto id = req.get_id();
+  auto pack = tinypack_fields(tinypacker()
+                              .field(id)
+                              .field(cmd)
+                              .field(fd)
+                              .field(handle),
+                              args...);
+  if (handle != 0 || fd < 0) {
+    int bytes;
+    auto data = transact(chan, pack, id, &bytes);
+    auto r = parse(data, bytes);
+    if (r != -ESTALE || handle == 0) {
+      return r;
+    }
+    // |fd| has been closed or replaced behind us.
+    set_handle(chan, fd, 0);
+    req.end();
+    return send_fd_cmd(cmd, fd, parse, args...);
+  }
+
+  send_request(chan, pack, fd);
+  reply rep;
+  auto ok = wait_reply(chan, id, &rep);
+  assert(ok);
+  return parse(rep.data, rep.bytes);
+}
+
+/**
+ * Send a command opening a file relative to |dirfd|, and return the
+ * fd passed back.  The arguments following the path depend on the
+ * command.
+ */
+template<typename... Args>
+int sandbox_bridge::send_open_cmd(int cmd, int dirfd, const char* path,
+                                  Args... args) {
+  auto chan = get_channel();
+  // Pass |dirfd| only if the Command Center doesn't keep it.
+  auto dir_handle = find_handle(chan, dirfd);
+  request_scope req(this, chan);
+  auto id = req.get_id();
+  auto pack = tinypack_fields(tinypacker()
+                              .field(id)
+                              .field(cmd)
+                              .field(dirfd)
+                              .field(dir_handle)
+                              .field(path),
+                              args...);
+  send_request(chan, pack, dir_handle == 0 ? dirfd : -1);
+
+  reply rep;
+  auto ok = wait_reply(chan, id, &rep);
+  assert(ok);
+  unsigned int handle;
+  int stat_r;
+  auto r = parse_reply(rep.data, rep.bytes, handle, stat_r, chan->stat_hint,
+                       chan->stat_dev, chan->stat_ino);
+  if (r == -ESTALE && dir_handle != 0) {
+    // |dirfd| has been closed or replaced behind us.
+    set_handle(chan, dirfd, 0);
+    req.end();
+    return send_open_cmd(cmd, dirfd, path, args...);
+  }
+  chan->stat_fd = -1;
   if (r >= 0) {
-    assert(rcvr->get_fd_rcvd_num() == 1);
-    r = rcvr->get_fd_rcvd()[0];
+    assert(rep.fd_num == 1);
+    r = rep.fds[0];
+    set_handle(chan, r, handle);
+    forget_dir(chan, r);
+    if (stat_r == 0) {
+      chan->stat_fd = r;
+      if (S_ISDIR(chan->stat_hint.st_mode)) {
+        // Walkers open subdirectories relative to their parents.
+        char buf[CC_SHM_PATH_MAX];
+        auto dir_path = path[0] == '/' ? path :
+          dir_entry_path(chan, dirfd, path, buf);
+        if (dir_path != nullptr) {
+          set_dir_path(chan, r, dir_path, &chan->stat_hint);
+        }
+      }
+    }
   }
 
   return r;
 }
 
+/**
+ * Return the error of opening |path| if the metadata cache knows that
+ * it doesn't exist, or 0.  The dynamic linker probes a lot of paths
+ * that don't exist to find libraries, the Command Center publishes
+ * them at exec.
+ *
+ * O_CREAT may create the file, and O_NOFOLLOW fails differently for
+ * dangling symlinks, they are always sent.
+ */
+int sandbox_bridge::lookup_missing(int dirfd, const char* path, int flags) {
+  if (flags & (O_CREAT | O_NOFOLLOW)) {
+    return 0;
+  }
+  char buf[CC_SHM_PATH_MAX];
+  auto abs_path = path[0] == '/' ? path :
+    dir_entry_path(get_channel(), dirfd, path, buf);
+  if (abs_path == nullptr) {
+    return 0;
+  }
+  int r;
+  struct stat statbuf;
+  if (memo.lookup(META_STAT, abs_path, 0, &r, &statbuf, sizeof(statbuf)) &&
+      (r == -ENOENT || r == -ENOTDIR)) {
+    return r;
+  }
+  return 0;
+}
+
+/**
+ * |fd| has been opened by the scout itself for a local path.  The fd
+ * number may have been used by a file of the Command Center that has
+ * been closed without being noticed.
+ */
+int sandbox_bridge::opened_locally(int fd) {
+  if (fd >= 0) {
+    auto chan = get_channel();
+    set_handle(chan, fd, 0);
+    forget_dir(chan, fd);
+    if (chan->stat_fd == fd) {
+      chan->stat_fd = -1;
+    }
+  }
+  return fd;
+}
+
+int sandbox_bridge::send_openat(int dirfd, const char* path, int flags, mode_t mode) {
+  LOGU(send_openat);
+  char buf[CC_SHM_PATH_MAX];
+  auto abs_path = resolve_path(dirfd, path, buf);
+  if (abs_path != nullptr) {
+    path = abs_path;
+    dirfd = AT_FDCWD;
+  }
+  if (memo.is_local(path)) {
+    return opened_locally(SYSCALL(__NR_openat, dirfd, (long)path, flags,
+                                  mode));
+  }
+  auto r = lookup_missing(dirfd, path, flags);
+  if (r < 0) {
+    return r;
+  }
+  return send_open_cmd(scout::cmd_openat, dirfd, path, flags, mode);
+}
+
+int sandbox_bridge::send_openat2(int dirfd, const char* path,
+                                 const struct open_how* how, size_t size) {
+  LOGU(send_openat2);
+  // Check the size like the kernel, the Command Center always
+  // receives the struct of its version.
+  if (size < sizeof(struct open_how)) {
+    return -EINVAL;
+  }
+  if (size > 4096) {
+    return -E2BIG;
+  }
+  for (auto p = (const char*)how + sizeof(struct open_how);
+       p < (const char*)how + size;
+       p++) {
+    if (*p != 0) {
+      return -E2BIG;
+    }
+  }
+  // RESOLVE_BENEATH and alike depend on |dirfd|.
+  char buf[CC_SHM_PATH_MAX];
+  auto abs_path = how->resolve == 0 ? resolve_path(dirfd, path, buf) :
+    nullptr;
+  if (abs_path != nullptr) {
+    path = abs_path;
+    dirfd = AT_FDCWD;
+  }
+  if (memo.is_local(path)) {
+    return opened_locally(SYSCALL(__NR_openat2, dirfd, (long)path,
+                                  (long)how, size));
+  }
+  if (how->resolve == 0) {
+    auto r = lookup_missing(dirfd, path, (int)how->flags);
+    if (r < 0) {
+      return r;
+    }
+  }
+  return send_open_cmd(scout::cmd_openat2, dirfd, path, *how);
+}
+
 int sandbox_bridge::send_dup(int oldfd) {
   LOGU(send_dup);
   auto r = SYSCALL(__NR_dup, oldfd);
+  if (r >= 0) {
+    auto chan = get_channel();
+    set_handle(chan, r, find_handle(chan, oldfd));
+  }
   return r;
 }
 
 int sandbox_bridge::send_dup2(int oldfd, int newfd) {
   LOGU(send_dup2);
   auto r = SYSCALL(__NR_dup2, oldfd, newfd);
+  auto chan = get_channel();
+  if (r >= 0 && chan->stat_fd == newfd) {
+    chan->stat_fd = -1;
+  }
+  if (r >= 0 && oldfd != newfd) {
+    // Both refer to the same file now.
+    set_handle(chan, newfd, find_handle(chan, oldfd));
+    forget_dir(chan, newfd);
+  }
   return r;
 }
 
 int sandbox_bridge::send_access(const char* path, int mode) {
   LOGU(send_access);
-  auto pack = tinypacker()
-    .field(scout::cmd_access)
-    .field(path)
-    .field(mode);
-  auto buf = pack.pack_size_prefix();
-  send_msg(sock, buf, pack.get_size_prefix());
-  free(buf);
-
-  // Receive reply
-  auto ok = rcvr->receive_one();
-  if (!ok) {
-    return -1;
+  char path_buf[CC_SHM_PATH_MAX];
+  auto abs_path = resolve_path(AT_FDCWD, path, path_buf);
+  if (abs_path != nullptr) {
+    path = abs_path;
+  }
+  if (memo.is_local(path)) {
+    return SYSCALL(__NR_access, (long)path, mode);
   }
-  assert(rcvr->get_data_bytes() == sizeof(int) * 2);
-  auto ptr = rcvr->get_data();
-  assert(*(int*)ptr == sizeof(int));
-  ptr += sizeof(int);
-
   int r;
-  auto unpacker = tinyunpacker(ptr, sizeof(int))
-    .field(r);
-
-  assert(unpacker.check_completed());
-  unpacker.unpack();
-
+  if (memo.lookup(META_ACCESS, path, mode, &r, nullptr, 0)) {
+    return r;
+  }
+  auto gen = memo.generation();
+  r = send_cmd(scout::cmd_access, path, mode);
+  memo.insert(gen, META_ACCESS, path, mode, r, nullptr, 0);
   return r;
 }
 
 int sandbox_bridge::send_fstat(int fd, struct stat* statbuf) {
   LOGU(send_fstat);
-  auto pack = tinypacker()
-    .field(scout::cmd_fstat)
-    .field(fd);
-  auto buf = pack.pack_size_prefix();
-  send_msg(sock, buf, pack.get_size_prefix(), fd);
-  free(buf);
+  auto chan = get_channel();
+  if (fd >= 0 && fd == chan->stat_fd) {
+    // Opened just now.  The fd may have been closed and reused by a
+    // syscall not trapped, like pipe() or fcntl(F_DUPFD).  A native
+    // fstat() tells if it is still the file, far cheaper than asking
+    // the Command Center.
+    chan->stat_fd = -1;
+    struct stat fd_st;
+    if (SYSCALL(__NR_fstat, fd, (long)&fd_st) == 0 &&
+        fd_st.st_dev == chan->stat_dev && fd_st.st_ino == chan->stat_ino) {
+      memcpy(statbuf, &chan->stat_hint, sizeof(*statbuf));
+      return 0;
+    }
+  }
+  return send_fd_cmd(scout::cmd_fstat, fd,
+                     [statbuf](const char* data, int bytes) {
+                       return parse_reply(data, bytes, *statbuf);
+                     });
+}
+
+int sandbox_bridge::send_fstatat(int dirfd, const char* path,
+                                 struct stat* statbuf, int flags) {
+  LOGU(send_fstatat);
+  // It doesn't change anything for stat().
+  flags &= ~AT_NO_AUTOMOUNT;
+  if (path == nullptr) {
+    if (!(flags & AT_EMPTY_PATH)) {
+      return -EFAULT;
+    }
+    path = "";
+  }
+  if (path[0] == 0 && (flags & AT_EMPTY_PATH) && dirfd != AT_FDCWD) {
+    // glibc implements fstat() this way.
+    return send_fstat(dirfd, statbuf);
+  }
+  char buf[CC_SHM_PATH_MAX];
+  auto entry_path = resolve_path(dirfd, path, buf);
+  if (entry_path != nullptr) {
+    path = entry_path;
+    dirfd = AT_FDCWD;
+  }
+  if (memo.is_local(path)) {
+    return SYSCALL(__NR_newfstatat, dirfd, (long)path, (long)statbuf, flags);
+  }
+  if (path[0] == '/' || dirfd == AT_FDCWD) {
+    // Go through the cache.
+    if (flags == 0) {
+      return send_stat(path, statbuf);
+    }
+    if (flags == AT_SYMLINK_NOFOLLOW) {
+      return send_lstat(path, statbuf);
+    }
+  }
+  return send_fd_cmd(scout::cmd_newfstatat, dirfd,
+                     [statbuf](const char* data, int bytes) {
+                       return parse_reply(data, bytes, *statbuf);
+                     },
+                     path, flags);
+}
+
+int sandbox_bridge::send_statx(int dirfd, const char* path, int flags,
+                               unsigned int mask, struct statx* statxbuf) {
+  LOGU(send_statx);
+  if (path == nullptr) {
+    if (!(flags & AT_EMPTY_PATH)) {
+      return -EFAULT;
+    }
+    path = "";
+  }
+  char buf[CC_SHM_PATH_MAX];
+  auto entry_path = resolve_path(dirfd, path, buf);
+  if (entry_path != nullptr) {
+    path = entry_path;
+    dirfd = AT_FDCWD;
+  }
+  if (memo.is_local(path)) {
+    return SYSCALL(__NR_statx, dirfd, (long)path, flags, mask,
+                   (long)statxbuf);
+  }
+  // Serve basic stats from the cache, published mostly by listing
+  // directories.
+  auto cache_flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT |
+    AT_STATX_SYNC_AS_STAT;
+  if (path[0] == '/' && !(mask & ~STATX_BASIC_STATS) &&
+      !(flags & ~cache_flags)) {
+    struct stat st;
+    int r;
+    auto kind = (flags & AT_SYMLINK_NOFOLLOW) ? META_LSTAT : META_STAT;
+    if (memo.lookup(kind, path, 0, &r, &st, sizeof(st))) {
+      if (r == 0) {
+        stat_to_statx(&st, statxbuf);
+      }
+      return r;
+    }
+  }
+  return send_fd_cmd(scout::cmd_statx, dirfd,
+                     [statxbuf](const char* data, int bytes) {
+                       return parse_reply(data, bytes, *statxbuf);
+                     },
+                     path, flags, mask);
+}
+
+int sandbox_bridge::send_faccessat(int dirfd, const char* path, int mode,
+                                   int flags) {
+  LOGU(send_faccessat);
+  char buf[CC_SHM_PATH_MAX];
+  auto entry_path = resolve_path(dirfd, path, buf);
+  if (entry_path != nullptr) {
+    path = entry_path;
+    dirfd = AT_FDCWD;
+  }
+  if ((path[0] == '/' || dirfd == AT_FDCWD) && flags == 0) {
+    return send_access(path, mode);
+  }
+  if (memo.is_local(path)) {
+    return SYSCALL(__NR_faccessat2, dirfd, (long)path, mode, flags);
+  }
+  return send_fd_cmd(scout::cmd_faccessat2, dirfd,
+                     [](const char* data, int bytes) {
+                       return parse_reply(data, bytes);
+                     },
+                     path, mode, flags);
+}
 
-  auto r = receive_struct_msg(rcvr, statbuf);
+/**
+ * Read entries of a directory.  The Command Center reads as many as
+ * the buffer can hold, up to what a reply can carry, in one round
+ * trip.
+ */
+long sandbox_bridge::send_getdents64(int fd, void* dirp, size_t count) {
+  LOGU(send_getdents64);
+  if (count > DENTS_BATCH_MAX) {
+    count = DENTS_BATCH_MAX;
+  }
+  char* dirpath = nullptr;
+  auto r = send_fd_cmd(scout::cmd_getdents64, fd,
+                       [dirp, count, &dirpath](const char* data, int bytes) {
+                         varbuf buf((char*)dirp, count);
+                         if (dirpath != nullptr) {
+                           // Retried for a stale handle.
+                           free(dirpath);
+                         }
+                         return parse_reply(data, bytes, dirpath, buf);
+                       },
+                       (unsigned int)count);
 
+  // Entries are published with the real path of the directory.  The
+  // Command Center doesn't publish anything at the end of the
+  // directory.
+  auto chan = get_channel();
+  if (r > 0) {
+    set_dir_path(chan, fd, dirpath, nullptr);
+  } else if (r < 0) {
+    forget_dir(chan, fd);
+  }
+  free(dirpath);
   return r;
 }
 
 int sandbox_bridge::send_stat(const char* path, struct stat* statbuf) {
   LOGU(send_stat);
-  auto pack = tinypacker()
-    .field(scout::cmd_stat)
-    .field(path);
-  auto buf = pack.pack_size_prefix();
-  send_msg(sock, buf, pack.get_size_prefix());
-  free(buf);
-
-  auto r = receive_struct_msg(rcvr, statbuf);
-
+  char path_buf[CC_SHM_PATH_MAX];
+  auto abs_path = resolve_path(AT_FDCWD, path, path_buf);
+  if (abs_path != nullptr) {
+    path = abs_path;
+  }
+  if (memo.is_local(path)) {
+    return SYSCALL(__NR_stat, (long)path, (long)statbuf);
+  }
+  int r;
+  if (memo.lookup(META_STAT, path, 0, &r,
+                  statbuf, sizeof(*statbuf))) {
+    return r;
+  }
+  auto gen = memo.generation();
+  r = send_cmd_struct(scout::cmd_stat, statbuf, path);
+  memo.insert(gen, META_STAT, path, 0, r,
+              statbuf, sizeof(*statbuf));
   return r;
 }
 
 int sandbox_bridge::send_lstat(const char* path, struct stat* statbuf) {
   LOGU(send_lstat);
-  auto pack = tinypacker()
-    .field(scout::cmd_lstat)
-    .field(path);
-  auto buf = pack.pack_size_prefix();
-  send_msg(sock, buf, pack.get_size_prefix());
-  free(buf);
-
-  auto r = receive_struct_msg(rcvr, statbuf);
-
+  char path_buf[CC_SHM_PATH_MAX];
+  auto abs_path = resolve_path(AT_FDCWD, path, path_buf);
+  if (abs_path != nullptr) {
+    path = abs_path;
+  }
+  if (memo.is_local(path)) {
+    return SYSCALL(__NR_lstat, (long)path, (long)statbuf);
+  }
+  int r;
+  if (memo.lookup(META_LSTAT, path, 0, &r,
+                  statbuf, sizeof(*statbuf))) {
+    return r;
+  }
+  auto gen = memo.generation();
+  r = send_cmd_struct(scout::cmd_lstat, statbuf, path);
+  memo.insert(gen, META_LSTAT, path, 0, r,
+              statbuf, sizeof(*statbuf));
   return r;
 }
 
@@ -203,13 +1176,17 @@ int sandbox_bridge::send_execve(const char* filename, char*const* argv, char*con
   if (pid < 0) {
     return pid;
   }
+  auto chan = get_channel();
+  request_scope req(this, chan);
+  auto id = req.get_id();
   auto pack = tinypacker()
+    .field(id)
     .field(scout::cmd_execve)
     .field((int)pid)
     .field(filename);
-  auto buf = pack.pack_size_prefix();
-  send_msg(sock, buf, pack.get_size_prefix());
-  auto ok = rcvr->receive_one();
+  send_request(chan, pack);
+  reply rep;
+  auto ok = wait_reply(chan, id, &rep);
   if (!ok) {
     LOGU(!ok);
     return -1;
@@ -224,59 +1201,109 @@ extern void printptr(void* p);
 
 size_t sandbox_bridge::send_readlink(const char* path, char* buf, size_t bufsize) {
   LOGU(send_readlink);
+  char path_buf[CC_SHM_PATH_MAX];
+  auto abs_path = resolve_path(AT_FDCWD, path, path_buf);
+  if (abs_path != nullptr) {
+    path = abs_path;
+  }
+  static const char self_exe[] = "/proc/self/exe";
+  if (exe_path[0] && memcmp(path, self_exe, sizeof(self_exe)) == 0) {
+    // The kernel would tell the exec stub.
+    auto len = strlen(exe_path);
+    len = len < bufsize ? len : bufsize;
+    memcpy(buf, exe_path, len);
+    return len;
+  }
+  if (memo.is_local(path)) {
+    return SYSCALL(__NR_readlink, (long)path, (long)buf, bufsize);
+  }
+  int r;
+  if (memo.lookup(META_READLINK, path, 0, &r, buf, bufsize)) {
+    return r;
+  }
+  auto gen = memo.generation();
+  auto chan = get_channel();
+  request_scope req(this, chan);
+  auto id = req.get_id();
   auto pack = tinypacker()
+    .field(id)
     .field(scout::cmd_readlink)
     .field(path)
     .field(bufsize);
-  auto _buf = pack.pack_size_prefix();
-  send_msg(sock, _buf, pack.get_size_prefix());
-  free(_buf);
-
-  auto ok = rcvr->receive_one();
-  if (!ok) {
-    LOGU(!ok);
-    return -1;
-  }
+  int bytes;
+  auto reply = transact(chan, pack, id, &bytes);
 
-  auto ptr = rcvr->get_data();
-  unsigned int payload_sz;
-  int retv;
   fixedbuf fbuf(buf, bufsize);
-  auto unpacker = tinyunpacker(ptr, rcvr->get_data_bytes())
-    .field(payload_sz)
-    .field(retv)
-    .field(fbuf);
-  assert(unpacker.check_completed());
-
-  unpacker.unpack();
-  assert((unsigned int)unpacker.get_size() == (unsigned int)rcvr->get_data_bytes());
-  assert(payload_sz + sizeof(unsigned int) == (unsigned int)rcvr->get_data_bytes());
+  int retv = parse_reply(reply, bytes, fbuf);
 
+  // A truncated link can not serve bigger buffers.
+  if (retv < 0 || (size_t)retv < bufsize) {
+    memo.insert(gen, META_READLINK, path, 0, retv,
+                buf, retv < 0 ? 0 : retv);
+  }
   return retv;
 }
 
+/**
+ * Let the kernel change the cwd, and tell every thread to read it
+ * again.
+ */
+int sandbox_bridge::send_chdir(const char* path) {
+  LOGU(send_chdir);
+  auto r = SYSCALL(__NR_chdir, (long)path);
+  if (r == 0) {
+    __atomic_add_fetch(&cwd_changes, 1, __ATOMIC_RELEASE);
+  }
+  return r;
+}
+
+int sandbox_bridge::send_fchdir(int fd) {
+  LOGU(send_fchdir);
+  auto r = SYSCALL(__NR_fchdir, fd);
+  if (r == 0) {
+    __atomic_add_fetch(&cwd_changes, 1, __ATOMIC_RELEASE);
+  }
+  return r;
+}
+
 int sandbox_bridge::send_unlink(const char* path) {
   LOGU(send_unlink);
-  auto pack = tinypacker()
-    .field(scout::cmd_unlink)
-    .field(path);
-  auto buf = pack.pack_size_prefix();
-  send_msg(sock, buf, pack.get_size_prefix());
-  free(buf);
+  char path_buf[CC_SHM_PATH_MAX];
+  auto abs_path = resolve_path(AT_FDCWD, path, path_buf);
+  if (abs_path != nullptr) {
+    path = abs_path;
+  }
+  if (memo.is_local(path)) {
+    return SYSCALL(__NR_unlink, (long)path);
+  }
+  return send_cmd(scout::cmd_unlink, path);
+}
 
-  auto r = receive_int_msg(rcvr);
-  return r;
+/**
+ * Tell the Command Center that the subject has changed the file
+ * system by itself, and wait for the generation to be bumped.
+ */
+void sandbox_bridge::send_fs_changed() {
+  LOGU(send_fs_changed);
+  if (memo.generation() == 0) {
+    // Nothing is remembered.
+    return;
+  }
+  send_cmd(scout::cmd_fs_changed);
 }
 
+/**
+ * Tell the Command Center that the process is going to vfork().  It
+ * is a notification sent along with the next request.
+ */
 pid_t sandbox_bridge::send_vfork() {
   LOGU(send_vfork);
   auto pid = (pid_t)SYSCALL(__NR_getpid);
   auto pack = tinypacker()
+    .field(0U)
     .field(scout::cmd_vfork)
     .field(pid);
-  auto buf = pack.pack_size_prefix();
-  send_msg(sock, buf, pack.get_size_prefix());
-  free(buf);
+  post(get_channel(), pack);
   return 0;
 }
 
@@ -291,6 +1318,29 @@ sandbox_bridge::send_rt_sigaction(int signum,
     // We need a better implementation to call user's handler.
     return 0;
   }
+  if (global_flags & scout::FLAG_USER_DISPATCH && act != nullptr) {
+    if (signum == SIGTRAP) {
+      // Taken by the scout to run syscalls natively.
+      return 0;
+    }
+    // The restorer of the application is trapped by Syscall User
+    // Dispatch, use the one in the trampoline page instead.
+    struct {
+      void* handler;
+      unsigned long flags;
+      void (*restorer)();
+      unsigned long mask;
+    } kact;
+    memcpy(&kact, act, sizeof(kact));
+    if (kact.flags & SA_RESTORER) {
+      kact.restorer = td__sig_trampo;
+    }
+    return SYSCALL(__NR_rt_sigaction,
+                   (long)signum,
+                   (long)&kact,
+                   (long)oldact,
+                   (long)sigsetsz);
+  }
   return SYSCALL(__NR_rt_sigaction,
                  (long)signum,
                  (long)act,
@@ -298,9 +1348,286 @@ sandbox_bridge::send_rt_sigaction(int signum,
                  (long)sigsetsz);
 }
 
+/**
+ * Pass the listener fd of seccomp user notifications to the Command
+ * Center.  No reply is expected.
+ */
+int sandbox_bridge::send_notify_fd(int listener) {
+  LOGU(send_notify_fd);
+  auto pack = tinypacker()
+    .field(0U)
+    .field(scout::cmd_notify_fd);
+  return send_request(get_channel(), pack, listener);
+}
+
+/**
+ * Tell the Command Center the program run by the exec stub, the file
+ * at scout::EXEC_FD, for it to publish the libraries that the
+ * program is going to look for, like after exec with ptrace.
+ */
+int sandbox_bridge::send_stub_exec() {
+  LOGU(send_stub_exec);
+  auto r = SYSCALL(__NR_readlink, (long)scout::EXEC_FD_PATH, (long)exe_path,
+                   sizeof(exe_path) - 1);
+  if (r < 0) {
+    exe_path[0] = 0;
+    return r;
+  }
+  exe_path[r] = 0;
+  auto pid = (int)SYSCALL(__NR_getpid);
+  return send_cmd(scout::cmd_stub_exec, pid, (const char*)exe_path);
+}
+
+static unsigned long
+channel_owner(pid_t pid, pid_t tid) {
+  return ((unsigned long)pid << 32) | (unsigned int)tid;
+}
+
 void sandbox_bridge::set_sock(int fd) {
-  sock = fd;
-  // This instance is never deleted.
+  main_pid = SYSCALL(__NR_getpid);
+  open_channel(&main_chan, fd);
+  main_chan.owner = channel_owner(main_pid, main_pid);
+  chans_pid = main_pid;
+
+  auto mem = SYSCALL(__NR_mmap, 0, 4096, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem < 0) {
+    return;
+  }
+  if (SYSCALL(__NR_madvise, mem, 4096, MADV_WIPEONFORK) < 0) {
+    SYSCALL(__NR_munmap, mem, 4096);
+    return;
+  }
+  fork_probe = (int*)mem;
+  *fork_probe = 1;
+}
+
+void sandbox_bridge::init_memo_cache() {
+  memo.init(cc_shm_addr);
+}
+
+void sandbox_bridge::enable_ring() {
+  ring_enabled = true;
+}
+
+void sandbox_bridge::open_channel(channel* chan, int fd) {
+  chan->sock = fd;
+  // Never deleted, but reused by |close_channel()|.
   auto buf = malloc(sizeof(msg_receiver));
-  rcvr = new(buf) msg_receiver(fd);
+  chan->rcvrs[0] = new(buf) msg_receiver(fd);
+  for (unsigned int i = 1; i < channel::nest_max; i++) {
+    chan->rcvrs[i] = nullptr;
+  }
+  chan->ring = nullptr;
+  chan->ring_efd = -1;
+  chan->ring_tried = false;
+  chan->last_id = 0;
+  chan->depth = 0;
+  chan->pending_bytes = 0;
+  chan->stat_fd = -1;
+  for (unsigned int i = 0; i < channel::dir_slots; i++) {
+    chan->dirs[i].fd = -1;
+  }
+  chan->cwd_pid = 0;
+  for (unsigned int i = 0; i < channel::handle_slots; i++) {
+    chan->handles[i].fd = -1;
+  }
+}
+
+/**
+ * Release a channel to reuse the slot.  The fds of a channel are
+ * closed only if |own_fds| is true.  A channel created by a child of
+ * vfork() lives in the memory of the parent, but the fds don't.
+ */
+void sandbox_bridge::close_channel(channel* chan, bool own_fds) {
+  if (own_fds) {
+    SYSCALL(__NR_close, chan->sock);
+    if (chan->ring_efd >= 0) {
+      SYSCALL(__NR_close, chan->ring_efd);
+    }
+  }
+  if (chan->ring != nullptr) {
+    SYSCALL(__NR_munmap, (long)chan->ring, sizeof(msgring));
+  }
+  for (unsigned int i = 0; i < channel::nest_max; i++) {
+    if (chan->rcvrs[i] != nullptr) {
+      chan->rcvrs[i]->~msg_receiver();
+      free(chan->rcvrs[i]);
+      chan->rcvrs[i] = nullptr;
+    }
+  }
+  free_early(chan, 0, chan->depth);
+}
+
+/**
+ * Return the channel of the calling thread.
+ */
+sandbox_bridge::channel*
+sandbox_bridge::get_channel() {
+  pid_t pid = SYSCALL(__NR_getpid);
+  pid_t tid = SYSCALL(__NR_gettid);
+  if (tid == pid && pid == main_pid) {
+    return &main_chan;
+  }
+
+  if (fork_probe != nullptr &&
+      __atomic_load_n(fork_probe, __ATOMIC_ACQUIRE) == 0) {
+    forget_parent_channels(pid);
+  }
+
+  auto owner = channel_owner(pid, tid);
+  for (auto chunk = __atomic_load_n(&thread_chans, __ATOMIC_ACQUIRE);
+       chunk != nullptr;
+       chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE)) {
+    for (auto& chan : chunk->chans) {
+      if (__atomic_load_n(&chan.owner, __ATOMIC_ACQUIRE) == owner) {
+        return &chan;
+      }
+    }
+  }
+
+  auto chan = new_thread_channel(pid, tid);
+  if (chan == nullptr) {
+    // Can not reach the Command Center, share the main channel.
+    return &main_chan;
+  }
+  return chan;
+}
+
+/**
+ * Release the channels copied from the parent, at the first request
+ * of a forked child.
+ *
+ * The child has a copy of the slots and of the fds of the parent.
+ * The fds of channels of the parent are closed, the others have been
+ * opened by children sharing the memory of the parent, like children
+ * of vfork().  Children sharing the memory don't see |fork_probe|
+ * zeroed, so they never release the slots of the parent.
+ */
+void
+sandbox_bridge::forget_parent_channels(pid_t pid) {
+  LOGU(forget_parent_channels);
+  for (auto chunk = thread_chans; chunk != nullptr; chunk = chunk->next) {
+    for (auto& chan : chunk->chans) {
+      if (chan.owner == 0) {
+        continue;
+      }
+      close_channel(&chan, (pid_t)(chan.owner >> 32) == chans_pid);
+      __atomic_store_n(&chan.owner, 0, __ATOMIC_RELEASE);
+    }
+  }
+  chans_pid = pid;
+  __atomic_store_n(fork_probe, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Establish a channel for a thread, and put it in a free slot or a
+ * slot of a dead thread.
+ */
+sandbox_bridge::channel*
+sandbox_bridge::new_thread_channel(pid_t pid, pid_t tid) {
+  LOGU(new_thread_channel);
+  auto fd = scout::connect_cc();
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  auto link = &thread_chans;
+  for (;;) {
+    auto chunk = __atomic_load_n(link, __ATOMIC_ACQUIRE);
+    if (chunk == nullptr) {
+      auto mem = SYSCALL(__NR_mmap, 0, sizeof(channel_chunk),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem < 0) {
+        SYSCALL(__NR_close, fd);
+        return nullptr;
+      }
+      if (__atomic_compare_exchange_n(link, &chunk, (channel_chunk*)mem,
+                                      false, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE)) {
+        chunk = (channel_chunk*)mem;
+      } else {
+        // Added by another thread.
+        SYSCALL(__NR_munmap, mem, sizeof(channel_chunk));
+      }
+    }
+
+    for (auto& chan : chunk->chans) {
+      auto owner = __atomic_load_n(&chan.owner, __ATOMIC_ACQUIRE);
+      if (owner != 0) {
+        pid_t owner_pid = owner >> 32;
+        pid_t owner_tid = (pid_t)owner;
+        if (owner_pid == pid &&
+            SYSCALL(__NR_tgkill, pid, owner_tid, 0) != -ESRCH) {
+          // Alive
+          continue;
+        }
+      }
+      if (!__atomic_compare_exchange_n(&chan.owner, &owner,
+                                       channel_owner(pid, tid),
+                                       false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE)) {
+        continue;
+      }
+      if (owner != 0) {
+        close_channel(&chan, (pid_t)(owner >> 32) == pid);
+      }
+      open_channel(&chan, fd);
+      return &chan;
+    }
+    link = &chunk->next;
+  }
+}
+
+/**
+ * Create a ring in shared memory, and pass it to the Command Center
+ * along with an eventfd to wake it up.
+ */
+bool sandbox_bridge::init_ring(channel* chan) {
+  LOGU(init_ring);
+  // Don't try again even if failed.
+  chan->ring_tried = true;
+
+  int memfd = SYSCALL(__NR_memfd_create, (long)"mosingar-ring", MFD_CLOEXEC);
+  if (memfd < 0) {
+    return false;
+  }
+  auto mem = SYSCALL(__NR_ftruncate, memfd, sizeof(msgring));
+  if (mem >= 0) {
+    mem = SYSCALL(__NR_mmap, 0, sizeof(msgring), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, memfd, 0);
+  }
+  if (mem < 0) {
+    SYSCALL(__NR_close, memfd);
+    return false;
+  }
+  int efd = SYSCALL(__NR_eventfd2, 0, EFD_CLOEXEC);
+  if (efd < 0) {
+    SYSCALL(__NR_munmap, mem, sizeof(msgring));
+    SYSCALL(__NR_close, memfd);
+    return false;
+  }
+
+  request_scope req(this, chan);
+  auto id = req.get_id();
+  auto pack = tinypacker()
+    .field(id)
+    .field(scout::cmd_ring);
+  send_request(chan, pack, memfd, efd);
+  SYSCALL(__NR_close, memfd);
+
+  reply rep;
+  auto ok = wait_reply(chan, id, &rep);
+  assert(ok);
+  auto r = parse_int_reply(rep.data, rep.bytes);
+  if (r < 0) {
+    SYSCALL(__NR_munmap, mem, sizeof(msgring));
+    SYSCALL(__NR_close, efd);
+    return false;
+  }
+
+  chan->ring = (msgring*)mem;
+  chan->ring_efd = efd;
+  return true;
 }
@@ -7,32 +7,206 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+
+#include "memocache.h"
 
 class msg_receiver;
+class msgring;
 
 class sandbox_bridge {
 public:
-  int send_open(const char* path, int flags, mode_t mode);
   int send_openat(int dirfd, const char* path, int flags, mode_t mode);
+  int send_openat2(int dirfd, const char* path, const struct open_how* how,
+                   size_t size);
   int send_dup(int oldfd);
   int send_dup2(int oldfd, int newfd);
   int send_access(const char* path, int mode);
   int send_fstat(int fd, struct stat* statbuf);
   int send_stat(const char* path, struct stat* statbuf);
   int send_lstat(const char* path, struct stat* statbuf);
+  int send_fstatat(int dirfd, const char* path, struct stat* statbuf,
+                   int flags);
+  int send_statx(int dirfd, const char* path, int flags, unsigned int mask,
+                 struct statx* statxbuf);
+  int send_faccessat(int dirfd, const char* path, int mode, int flags);
+  long send_getdents64(int fd, void* dirp, size_t count);
   int send_execve(const char* filename, char*const* argv, char*const* envp);
   size_t send_readlink(const char* path, char* buf, size_t bufsize);
   int send_unlink(const char* path);
+  int send_chdir(const char* path);
+  int send_fchdir(int fd);
+  void send_fs_changed();
   pid_t send_vfork();
   int send_rt_sigaction(int signum, const struct sigaction* act,
                         struct sigaction* oldact,
                         size_t sigsetsz);
+  int send_notify_fd(int listener);
+  int send_stub_exec();
 
+  // Use |fd| as the channel of the main thread of this process.
   void set_sock(int fd);
+  void init_memo_cache();
+  /**
+   * Send requests through rings in shared memory.  A ring is created
+   * and passed to the Command Center along with the first request of
+   * a channel, since the Command Center may not be serving yet when
+   * the scout is initialized at takeoff.
+   */
+  void enable_ring();
 
 private:
-  int sock;
-  msg_receiver* rcvr;
+  /**
+   * The reply of a request, in the receiver of the request or kept
+   * aside by the request that has received it.
+   */
+  struct reply {
+    const char* data;
+    int bytes;
+    int fd_num;
+    int fds[2];
+  };
+
+  /**
+   * A channel to the Command Center.
+   *
+   * The main thread of a process uses the channel established at
+   * takeoff.  Other threads have their own channels, created at their
+   * first requests, so that requests and replies of threads never
+   * interleave on the same socket.  So do children sharing the memory
+   * of their parents, like children of vfork(), and forked children
+   * that have not established their own channels.
+   */
+  struct channel {
+    constexpr static unsigned int pending_size = 256;
+    constexpr static unsigned int handle_slots = 64;
+    constexpr static unsigned int dir_slots = 8;
+    constexpr static unsigned int nest_max = 4;
+
+    // The pid and the tid of the owner, 0 for free slots.
+    unsigned long owner;
+    int sock;
+    // The receivers of requests by the depth of nesting, created on
+    // demand except the first one.  A request keeps its reply in the
+    // receiver until parsed, while nested requests receive theirs.
+    msg_receiver* rcvrs[nest_max];
+    // The ring to send requests through, if any.  See msgring.h.
+    msgring* ring;
+    int ring_efd;
+    bool ring_tried;
+    // The id of the last request.
+    unsigned int last_id;
+    // Requests in flight, the outermost first.  A signal handler of
+    // the subject may make syscalls in the middle of a request, the
+    // requests of the handler nest in it.  Replies may come in any
+    // order, a reply received by another request is kept in |early|
+    // for its request.  The request may be blocked in recvmsg(),
+    // restarted after the handler, it is woken up by a scout::cmd_wake
+    // reply if |wake_sent|.
+    unsigned int depth;
+    struct {
+      unsigned int id;
+      reply* early;
+      bool wake_sent;
+    } in_flight[nest_max];
+    // Notifications waiting for the next request, see |post()|.
+    unsigned int pending_bytes;
+    char pending[pending_size];
+    // The stat of the file last opened by the thread, replied along
+    // with the fd, -1 if none.  It serves the next fstat() on the fd
+    // if the fd is still the file of |stat_dev| and |stat_ino|.
+    int stat_fd;
+    struct stat stat_hint;
+    dev_t stat_dev;
+    ino_t stat_ino;
+    // Handles of fds kept by the Command Center for the channel, at
+    // the slot of fd % handle_slots.  See cmdcenter.h.
+    struct {
+      int fd;
+      unsigned int handle;
+    } handles[handle_slots];
+    // Absolute paths of directories opened or listed by the thread,
+    // at the slot of fd % dir_slots.  The Command Center publishes
+    // the stat of entries of listed directories, calls relative to
+    // these fds are looked up in the cache with absolute paths.
+    // A path is checked again once the generation of the memo cache
+    // is not |gen|, since the directory may have been renamed.
+    struct {
+      int fd;
+      dev_t dev;
+      ino_t ino;
+      unsigned long gen;
+      char path[CC_SHM_PATH_MAX];
+    } dirs[dir_slots];
+    // The cwd of the process as of |cwd_changes| and the generation
+    // |cwd_gen|, empty if it is too long or unreachable.  It is valid
+    // only for |cwd_pid|.
+    pid_t cwd_pid;
+    unsigned long cwd_changes;
+    unsigned long cwd_gen;
+    char cwd[CC_SHM_PATH_MAX];
+  };
+  struct channel_chunk;
+  class request_scope;
+
+  channel* get_channel();
+  channel* new_thread_channel(pid_t pid, pid_t tid);
+  void forget_parent_channels(pid_t pid);
+  void open_channel(channel* chan, int fd);
+  void close_channel(channel* chan, bool own_fds);
+  bool init_ring(channel* chan);
+  unsigned int new_request_id(channel* chan);
+  unsigned int begin_request(channel* chan);
+  int find_in_flight(channel* chan, unsigned int id);
+  void free_early(channel* chan, unsigned int from, unsigned int to);
+  void end_request(channel* chan, unsigned int id);
+  bool wait_reply(channel* chan, unsigned int id, reply* rep);
+  // Return the handle of |fd|, or 0 if none.
+  unsigned int find_handle(channel* chan, int fd);
+  void set_handle(channel* chan, int fd, unsigned int handle);
+  void set_dir_path(channel* chan, int fd, const char* path,
+                    const struct stat* st);
+  void forget_dir(channel* chan, int fd);
+  const char* dir_entry_path(channel* chan, int dirfd, const char* path,
+                             char* buf);
+  int opened_locally(int fd);
+  const char* get_cwd(channel* chan);
+  const char* resolve_path(int dirfd, const char* path, char* buf);
+  int lookup_missing(int dirfd, const char* path, int flags);
+  template<typename P>
+  int send_request(channel* chan, P& pack, int fd1 = -1, int fd2 = -1);
+  template<typename P>
+  void post(channel* chan, P& pack);
+  bool flush_to_ring(channel* chan);
+  template<typename P>
+  const char* transact(channel* chan, P& pack, unsigned int id, int* bytes);
+  template<typename... Args>
+  int send_cmd(int cmd, Args... args);
+  template<typename T, typename... Args>
+  int send_cmd_struct(int cmd, T* reply, Args... args);
+  template<typename Parse, typename... Args>
+  int send_fd_cmd(int cmd, int fd, Parse parse, Args... args);
+  template<typename... Args>
+  int send_open_cmd(int cmd, int dirfd, const char* path, Args... args);
+
+  channel main_chan;
+  // The process of the main channel.
+  pid_t main_pid;
+  // Channels of threads other than the main one.
+  channel_chunk* thread_chans;
+  // The process that the fds of |thread_chans| are opened in.
+  pid_t chans_pid;
+  // A page zeroed in forked children with MADV_WIPEONFORK, null if
+  // not supported.  See |forget_parent_channels()|.
+  int* fork_probe;
+  memo_cache memo;
+  bool ring_enabled;
+  // Bumped by every chdir() and fchdir() of the process.
+  unsigned long cwd_changes;
+  // The program run by the exec stub, empty if the process has not
+  // been executed through the stub.
+  char exe_path[CC_SHM_EXEC_PATH_MAX];
 };
 
 /**
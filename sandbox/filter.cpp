@@ -3,6 +3,7 @@
  */
 #include "seccomp.h"
 #include "bridge.h"
+#include "scout.h"
 
 #include <stdio.h>
 #include <stdint.h>
@@ -14,39 +15,178 @@
 #include <linux/bpf.h>
 
 
-static struct sock_filter filter[] = {
+/**
+ * The filters are generated from SCOUT_SYSCALLS and
+ * SCOUT_FS_CHANGE_SYSCALLS at compile time.
+ *
+ * A filter starts with checking the instruction pointer to always
+ * allow requests made by the trampoline.  Then, it looks up the
+ * syscall number with a balanced binary search over the sorted
+ * table, instead of comparing with every entry.  Small ranges at
+ * leaves are compared one by one.
+ *
+ *   prologue: 5 instructions
+ *   tree:     JGE for inner nodes, and JEQ for entries at leaves.
+ *   returns:  ALLOW, TRAP, USER_NOTIF
+ */
+
+struct syscall_rule {
+  int nr;
+  syscall_route route;
+};
+
+#define SYSCALL_RULE(name, route) { __NR_##name, route },
+#define FS_CHANGE_RULE(name) { __NR_##name, SYSCALL_TRAP },
+static constexpr syscall_rule rules[] = {
+  SCOUT_SYSCALLS(SYSCALL_RULE)
+  SCOUT_FS_CHANGE_SYSCALLS(FS_CHANGE_RULE)
+};
+#undef FS_CHANGE_RULE
+#undef SYSCALL_RULE
+
+constexpr int RULE_NUM = ARRAY_SIZE(rules);
+constexpr int PROLOGUE_SIZE = 5;
+// Max number of entries compared one by one.
+constexpr int LEAF_SIZE = 3;
+
+struct sorted_rules {
+  syscall_rule rules[RULE_NUM];
+};
+
+static constexpr sorted_rules
+sort_rules() {
+  sorted_rules sorted = {};
+  for (int i = 0; i < RULE_NUM; i++) {
+    int j = i;
+    for (; j > 0 && sorted.rules[j - 1].nr > rules[i].nr; j--) {
+      sorted.rules[j] = sorted.rules[j - 1];
+    }
+    sorted.rules[j] = rules[i];
+  }
+  return sorted;
+}
+
+static constexpr int
+tree_size(int lo, int hi) {
+  if (hi - lo <= LEAF_SIZE) {
+    return hi - lo;
+  }
+  auto mid = (lo + hi) / 2;
+  return 1 + tree_size(lo, mid) + tree_size(mid, hi);
+}
+
+constexpr int RET_ALLOW = PROLOGUE_SIZE + tree_size(0, RULE_NUM);
+constexpr int RET_TRAP = RET_ALLOW + 1;
+constexpr int RET_USER_NOTIF = RET_ALLOW + 2;
+constexpr int FILTER_SIZE = RET_ALLOW + 3;
+
+// Offsets of jumps are 8 bits.
+static_assert(FILTER_SIZE <= 256, "too many syscalls for the filter");
+
+static constexpr sock_filter
+bpf_stmt(uint16_t code, uint32_t k) {
+  return sock_filter{ code, 0, 0, k };
+}
+
+static constexpr sock_filter
+bpf_jump(uint16_t code, uint32_t k, int jt, int jf) {
+  return sock_filter{ code, (uint8_t)jt, (uint8_t)jf, k };
+}
+
+static constexpr int
+emit_tree(sock_filter* insns, int pc, int lo, int hi,
+          const syscall_rule* sorted, bool notif, int trapped_nr) {
+  if (hi - lo <= LEAF_SIZE) {
+    for (int i = lo; i < hi; i++, pc++) {
+      auto ret = notif && sorted[i].route == SYSCALL_NOTIF &&
+        sorted[i].nr != trapped_nr ? RET_USER_NOTIF : RET_TRAP;
+      // Allow the syscall if none of entries matches.
+      auto jf = i == hi - 1 ? RET_ALLOW - (pc + 1) : 0;
+      insns[pc] = bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, sorted[i].nr,
+                           ret - (pc + 1), jf);
+    }
+    return pc;
+  }
+
+  auto mid = (lo + hi) / 2;
+  insns[pc] = bpf_jump(BPF_JMP | BPF_JGE | BPF_K, sorted[mid].nr,
+                       tree_size(lo, mid), 0);
+  pc = emit_tree(insns, pc + 1, lo, mid, sorted, notif, trapped_nr);
+  return emit_tree(insns, pc, mid, hi, sorted, notif, trapped_nr);
+}
+
+struct filter_prog {
+  sock_filter insns[FILTER_SIZE];
+};
+
+/**
+ * Make a filter.  |trapped_nr| is trapped even if it is routed to
+ * the Command Center in the user notification mode.
+ */
+static constexpr filter_prog
+make_filter(bool notif, int trapped_nr = -1) {
+  filter_prog prog = {};
+  auto insns = prog.insns;
+  auto sorted = sort_rules();
+
   // trampoline
   // Always allow requests made by the trampoline.
-  BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
-           (offsetof(struct seccomp_data, instruction_pointer))),
-  BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 4096, 2, 0),
-  BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
-           (offsetof(struct seccomp_data, instruction_pointer) + 4)),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)(TRAMPOLINE_ADDR >> 32), 14, 0),
+  insns[0] = bpf_stmt(BPF_LD | BPF_W | BPF_ABS,
+                      __builtin_offsetof(struct seccomp_data,
+                                         instruction_pointer));
+  insns[1] = bpf_jump(BPF_JMP | BPF_JGE | BPF_K, 4096, 2, 0);
+  insns[2] = bpf_stmt(BPF_LD | BPF_W | BPF_ABS,
+                      __builtin_offsetof(struct seccomp_data,
+                                         instruction_pointer) + 4);
+  insns[3] = bpf_jump(BPF_JMP | BPF_JEQ | BPF_K,
+                      (uint32_t)(TRAMPOLINE_ADDR >> 32),
+                      RET_ALLOW - 4, 0);
 
   // Load syscall number
-  BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
-           (offsetof(struct seccomp_data, nr))),
-
-  // dup
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_rt_sigaction, 13, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_dup, 12, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_dup2, 11, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_open, 10, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_openat, 9, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_access, 8, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_fstat, 7, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_lstat, 6, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_execve, 5, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_readlink, 4, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_stat, 3, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_unlink, 2, 0),
-  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_vfork, 1, 0),
-  BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
-  BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRAP),
-};
+  insns[4] = bpf_stmt(BPF_LD | BPF_W | BPF_ABS,
+                      __builtin_offsetof(struct seccomp_data, nr));
+
+  emit_tree(insns, PROLOGUE_SIZE, 0, RULE_NUM, sorted.rules, notif,
+            trapped_nr);
+
+  insns[RET_ALLOW] = bpf_stmt(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+  insns[RET_TRAP] = bpf_stmt(BPF_RET | BPF_K, SECCOMP_RET_TRAP);
+  insns[RET_USER_NOTIF] = bpf_stmt(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF);
+  return prog;
+}
+
+static filter_prog filter = make_filter(false);
 
 struct sock_fprog sandbox_filter_prog = {
-  .len = ARRAY_SIZE(filter),
-  .filter = filter,
+  .len = FILTER_SIZE,
+  .filter = filter.insns,
+};
+
+/**
+ * The filter of the user notification mode.
+ *
+ * Syscalls that the Command Center can serve alone, without the
+ * cooperation of the scout, return SECCOMP_RET_USER_NOTIF.  They will
+ * be blocked until the Command Center replies through the listener
+ * fd, so no signal and no marshalling happen in the process.  Others
+ * are still trapped with SIGSYS.
+ */
+static filter_prog notif_filter = make_filter(true);
+
+struct sock_fprog sandbox_notif_filter_prog = {
+  .len = FILTER_SIZE,
+  .filter = notif_filter.insns,
+};
+
+/**
+ * The filter of the user notification mode with the exec stub.
+ *
+ * /proc/self/exe of a program run by the exec stub is the stub, so
+ * readlink() is trapped for the scout to tell the program instead.
+ */
+static filter_prog notif_stub_filter = make_filter(true, __NR_readlink);
+
+struct sock_fprog sandbox_notif_stub_filter_prog = {
+  .len = FILTER_SIZE,
+  .filter = notif_stub_filter.insns,
 };
@@ -0,0 +1,293 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#include "memocache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// Entries are direct-mapped, a new entry replaces the old one in the
+// same slot.
+#define MEMO_SLOTS 256
+#define MEMO_DATA_MAX sizeof(struct stat)
+
+/**
+ * An entry of the cache.  Threads of a subject share the cache, an
+ * entry is protected by a seqlock like cc_shm_entry.  A thread skips
+ * inserting if another one is updating the entry.
+ */
+struct memo_entry {
+  unsigned long seq;
+  // The generation that the entry was made at, 0 for free slots.
+  unsigned long gen;
+  unsigned int hash;
+  int kind;
+  int arg;
+  int result;
+  unsigned int data_size;
+  char path[CC_SHM_PATH_MAX];
+  char data[MEMO_DATA_MAX];
+};
+
+/**
+ * Copy the result of an entry to the caller.
+ */
+static int
+copy_result(int kind, int result, const char* entry_data,
+            unsigned int data_size, void* data, size_t size) {
+  if (result < 0) {
+    return result;
+  }
+  auto n = data_size < size ? data_size : size;
+  memcpy(data, entry_data, n);
+  return kind == META_READLINK ? (int)n : result;
+}
+
+void
+memo_cache::init(unsigned long shm_addr) {
+  shm = nullptr;
+  stats = nullptr;
+  entries = nullptr;
+
+  auto mem = (cc_shm*)shm_addr;
+  if (mem == nullptr || mem->magic != CC_SHM_MAGIC) {
+    return;
+  }
+  shm = mem;
+  stats = &mem->stats;
+}
+
+unsigned long
+memo_cache::generation() {
+  if (shm == nullptr) {
+    return 0;
+  }
+  return __atomic_load_n(&shm->generation, __ATOMIC_ACQUIRE);
+}
+
+bool
+memo_cache::lookup_local(memo_entry* entry, unsigned long gen,
+                         unsigned int hash, meta_kind kind,
+                         const char* path, size_t len, int arg,
+                         int* result, void* data, size_t size) {
+  auto seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1) {
+    return false;
+  }
+  if (entry->gen != gen || entry->hash != hash || entry->kind != kind ||
+      entry->arg != arg || memcmp(entry->path, path, len + 1) != 0) {
+    return false;
+  }
+  auto r = entry->result;
+  auto data_size = entry->data_size;
+  char buf[MEMO_DATA_MAX];
+  if (r >= 0) {
+    if (data_size > sizeof(buf)) {
+      return false;
+    }
+    memcpy(buf, entry->data, data_size);
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq) {
+    return false;
+  }
+
+  *result = copy_result(kind, r, buf, data_size, data, size);
+  return true;
+}
+
+/**
+ * Look up the table published by the Command Center.
+ */
+bool
+memo_cache::lookup_shared(unsigned long gen, unsigned int hash,
+                          meta_kind kind, const char* path, size_t len,
+                          int arg, int* result, void* data, size_t size) {
+  auto entry = shm->entries + hash % CC_SHM_SLOTS;
+  auto seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1) {
+    // Being updated.
+    return false;
+  }
+  if (entry->gen != gen || entry->hash != hash || entry->kind != kind ||
+      entry->arg != arg || memcmp(entry->path, path, len + 1) != 0) {
+    return false;
+  }
+  auto r = entry->result;
+  auto data_size = entry->data_size;
+  char buf[sizeof(entry->data)];
+  if (r >= 0) {
+    if (data_size > sizeof(buf)) {
+      return false;
+    }
+    memcpy(buf, entry->data, data_size);
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq) {
+    return false;
+  }
+
+  *result = copy_result(kind, r, buf, data_size, data, size);
+  return true;
+}
+
+/**
+ * Find the entry of a call, in the local cache first.  |*shared| is
+ * set if it is from the table of the Command Center.
+ */
+bool
+memo_cache::find(unsigned long gen, meta_kind kind, const char* path,
+                 int arg, int* result, void* data, size_t size,
+                 bool* shared) {
+  size_t len;
+  auto hash = meta_hash(kind, path, arg, &len);
+  if (len >= CC_SHM_PATH_MAX) {
+    return false;
+  }
+
+  auto local = __atomic_load_n(&entries, __ATOMIC_ACQUIRE);
+  *shared = false;
+  if (local != nullptr &&
+      lookup_local(local + hash % MEMO_SLOTS, gen, hash, kind, path, len,
+                   arg, result, data, size)) {
+    return true;
+  }
+  *shared = true;
+  return lookup_shared(gen, hash, kind, path, len, arg, result, data, size);
+}
+
+/**
+ * Find a parent directory of |path| that is known to be missing, or
+ * not a directory.  Nothing below it can be found, whatever the kind
+ * of the call.  ld.so probes a lot of paths in hwcaps subdirectories
+ * that don't exist, the Command Center publishes the stat of the
+ * top ones.
+ *
+ * The walk stops at the first parent known to be a directory.
+ */
+bool
+memo_cache::lookup_parents(unsigned long gen, const char* path,
+                           int* result, bool* shared) {
+  char buf[CC_SHM_PATH_MAX];
+  auto len = strlen(path);
+  if (len >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, path, len + 1);
+  // Drop trailing slashes
+  while (len > 1 && buf[len - 1] == '/') {
+    len--;
+  }
+  for (;;) {
+    while (len > 0 && buf[len - 1] != '/') {
+      len--;
+    }
+    while (len > 0 && buf[len - 1] == '/') {
+      len--;
+    }
+    if (len == 0) {
+      // The root
+      return false;
+    }
+    buf[len] = 0;
+
+    int r;
+    struct stat statbuf;
+    if (!find(gen, META_STAT, buf, 0, &r, &statbuf, sizeof(statbuf),
+              shared)) {
+      continue;
+    }
+    if (r == -ENOENT || r == -ENOTDIR) {
+      *result = r;
+      return true;
+    }
+    if (r >= 0 && !S_ISDIR(statbuf.st_mode)) {
+      *result = -ENOTDIR;
+      return true;
+    }
+    return false;
+  }
+}
+
+bool
+memo_cache::lookup(meta_kind kind, const char* path, int arg,
+                   int* result, void* data, size_t size) {
+  if (shm == nullptr || path[0] != '/') {
+    return false;
+  }
+  auto gen = generation();
+  bool shared;
+  if (find(gen, kind, path, arg, result, data, size, &shared) ||
+      lookup_parents(gen, path, result, &shared)) {
+    if (shared) {
+      __atomic_add_fetch(&stats->hits, 1, __ATOMIC_RELAXED);
+    }
+    return true;
+  }
+  __atomic_add_fetch(&stats->misses, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+bool
+memo_cache::is_local(const char* path) {
+  if (shm == nullptr || !cc_shm_is_local(&shm->local, path)) {
+    return false;
+  }
+  __atomic_add_fetch(&stats->local, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+void
+memo_cache::insert(unsigned long gen, meta_kind kind, const char* path,
+                   int arg, int result, const void* data, size_t size) {
+  if (gen == 0 || path[0] != '/' || !meta_is_cacheable(result) ||
+      size > MEMO_DATA_MAX) {
+    return;
+  }
+  // The result may be out of date already.
+  if (generation() != gen) {
+    return;
+  }
+  size_t len;
+  auto hash = meta_hash(kind, path, arg, &len);
+  if (len >= CC_SHM_PATH_MAX) {
+    return;
+  }
+
+  auto local = __atomic_load_n(&entries, __ATOMIC_ACQUIRE);
+  if (local == nullptr) {
+    auto mem = (memo_entry*)malloc(sizeof(memo_entry) * MEMO_SLOTS);
+    if (mem == nullptr) {
+      return;
+    }
+    bzero(mem, sizeof(memo_entry) * MEMO_SLOTS);
+    if (__atomic_compare_exchange_n(&entries, &local, mem, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      local = mem;
+    } else {
+      // Created by another thread.
+      free(mem);
+    }
+  }
+
+  auto entry = local + hash % MEMO_SLOTS;
+  auto seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  entry->gen = gen;
+  entry->hash = hash;
+  entry->kind = kind;
+  entry->arg = arg;
+  entry->result = result;
+  entry->data_size = result >= 0 ? size : 0;
+  memcpy(entry->path, path, len + 1);
+  if (result >= 0) {
+    memcpy(entry->data, data, size);
+  }
+  __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#ifndef __memocache_h_
+#define __memocache_h_
+
+#include "ccshm.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct memo_entry;
+
+/**
+ * Remember the results of metadata syscalls, stat(), lstat(),
+ * access() and readlink(), made by a subject to save round trips to
+ * the Command Center.
+ *
+ * Entries are keyed by the kind of the call, the path and an
+ * argument (the mode of access()).  Failures of ENOENT and alike are
+ * remembered as well, since compilers and build tools probe a lot of
+ * paths that don't exist.  Only absolute paths are remembered, the
+ * bridge makes relative ones absolute with the cwd before.
+ *
+ * An entry is valid only if the generation counter published by the
+ * Command Center (see ccshm.h) is still the one read before the
+ * request was sent.  The Command Center bumps it for every change to
+ * the file system that it sees, or that scouts tell it about (see
+ * SCOUT_FS_CHANGE_SYSCALLS), so no entry survives a change.
+ *
+ * Calls missing in the cache are looked up in the metadata table
+ * published by the Command Center in the shared memory before
+ * sending a request.  So, new processes start warm with what others
+ * have asked.  A call on a path under a parent directory known to be
+ * missing fails without a request as well.
+ *
+ * The cache is disabled if the shared memory is not available.  It is
+ * shared by all threads of a subject.
+ */
+class memo_cache {
+public:
+  /**
+   * Use the memory shared by the Command Center, that has been
+   * mapped at |shm_addr| by the Flight Deck.  It should be called
+   * again after execve().
+   */
+  void init(unsigned long shm_addr);
+
+  /**
+   * Return the current generation, or 0 if the cache is disabled.
+   *
+   * The returned value should be read before sending a request, and
+   * be passed to |insert()| along with the result.
+   */
+  unsigned long generation();
+
+  /**
+   * Find the result of a call.
+   *
+   * Return true if found, and set |*result|.  If the call succeeded,
+   * the data (struct stat or the link) are copied to |data|, at most
+   * |size| bytes.  For readlink(), |*result| is the size copied.
+   */
+  bool lookup(meta_kind kind, const char* path, int arg,
+              int* result, void* data, size_t size);
+  /**
+   * Remember the result of a call made at generation |gen|.
+   *
+   * |data| is the struct stat or the link returned by a successful
+   * call, |size| bytes.
+   */
+  void insert(unsigned long gen, meta_kind kind, const char* path, int arg,
+              int result, const void* data, size_t size);
+
+  /**
+   * Return true if |path| is local to the subject (see
+   * cc_shm_local_trie), and count it.  The caller should make the call
+   * by itself, and not remember the result.
+   */
+  bool is_local(const char* path);
+
+private:
+  bool find(unsigned long gen, meta_kind kind, const char* path, int arg,
+            int* result, void* data, size_t size, bool* shared);
+  bool lookup_parents(unsigned long gen, const char* path, int* result,
+                      bool* shared);
+  bool lookup_local(memo_entry* entry, unsigned long gen, unsigned int hash,
+                    meta_kind kind, const char* path, size_t len, int arg,
+                    int* result, void* data, size_t size);
+  bool lookup_shared(unsigned long gen, unsigned int hash, meta_kind kind,
+                     const char* path, size_t len, int arg,
+                     int* result, void* data, size_t size);
+
+  const cc_shm* shm;
+  cc_shm_stats* stats;
+  memo_entry* entries;
+};
+
+#endif /* __memocache_h_ */
@@ -18,15 +18,24 @@
 
 #define assert(x) do { if (!(x)) { abort(); } } while(0)
 
+// Space reserved for the restorer at the end of the trampoline page.
+#define SIG_TRAMPO_SIZE 16
+
 
 #if !defined(DUMMY)
 extern "C" {
 extern long syscall_trampoline(long, ...);
 extern long vfork_trampoline();
+extern void sig_trampoline();
+extern char sig_trampoline_end[];
 // The syscall trampoline, it will point to a copy at a fixed address
 // later that the seccomp filter will always allow it.
 long (*td__syscall_trampo)(long, ...) = syscall_trampoline;
 long (*td__vfork_trampo)() = vfork_trampoline;
+// The restorer of signal handlers.  It is copied to the trampoline
+// page too since Syscall User Dispatch lets rt_sigreturn pass only
+// from there.
+void (*td__sig_trampo)() = sig_trampoline;
 
 extern unsigned long int global_flags;
 }
@@ -46,13 +55,13 @@ scout::~scout() {
 
 #if !defined(DUMMY) || defined(TEST_CC_CHANNEL)
 
-bool
-scout::establish_cc_channel() {
+int
+scout::connect_cc() {
   int socks[2];
   auto r = socketpair(AF_UNIX, SOCK_DGRAM, 0, socks);
   if (r < 0) {
     perror("socketpair");
-    return false;
+    return -1;
   }
 
   int cmd = cmdcenter::SCOUT_CONNECT_CMD;
@@ -76,15 +85,26 @@ scout::establish_cc_channel() {
     perror("sendmsg");
     close(socks[0]);
     close(socks[1]);
-    return false;
+    return -1;
   }
 
   close(socks[1]);
+  fcntl(socks[0], F_SETFD, FD_CLOEXEC);
+  return socks[0];
+}
+
+bool
+scout::establish_cc_channel() {
+  auto fd = connect_cc();
+  if (fd < 0) {
+    return false;
+  }
+
   if (sock != -1) {
-    dup2(socks[0], sock);
-    close(socks[0]);
+    dup2(fd, sock);
+    close(fd);
   } else {
-    sock = socks[0];
+    sock = fd;
   }
   fcntl(sock, F_SETFD, FD_CLOEXEC);
 
@@ -95,19 +115,41 @@ scout::establish_cc_channel() {
 
 #if !defined(DUMMY)
 
+extern void announce_stub_exec();
+
 bool
 scout::init_sandbox() {
-  if (!(global_flags & FLAG_CC_COMM_READY)) {
+  if (global_flags & FLAG_CC_COMM_READY) {
+    // Loaded by the exec stub, the process before exec has created
+    // the channel.  Move it off, the subject may use the fd, and
+    // the next exec through the stub needs it free.
+    sock = fcntl(CMD_CENTER_SOCK, F_DUPFD_CLOEXEC, 0);
+    if (sock >= 0) {
+      close(CMD_CENTER_SOCK);
+    } else {
+      sock = CMD_CENTER_SOCK;
+      fcntl(sock, F_SETFD, FD_CLOEXEC);
+    }
+  } else {
     establish_cc_channel();
   }
 
   auto sigsys_r = install_sigsys();
   assert(sigsys_r);
 
+  if (global_flags & FLAG_CC_COMM_READY) {
+    announce_stub_exec();
+  }
+
   if (!(global_flags & FLAG_FILTER_INSTALLED)) {
     auto filter_r = install_seccomp_filter();
     assert(filter_r);
   }
+
+  if (global_flags & FLAG_USER_DISPATCH) {
+    auto dispatch_r = install_user_dispatch();
+    assert(dispatch_r);
+  }
   return true;
 }
 
@@ -128,11 +170,20 @@ scout::install_syscall_trampo() {
   td__vfork_trampo =
     (long(*)())((char*)ptr +
                 ((char*)vfork_trampoline - (char*)syscall_trampoline));
+
+  // Put the restorer at the end of the page.
+  auto sig_size = sig_trampoline_end - (char*)sig_trampoline;
+  auto sig_copy = (char*)ptr + 4096 - SIG_TRAMPO_SIZE;
+  assert(sig_size <= SIG_TRAMPO_SIZE);
+  assert((char*)vfork_trampoline < (char*)syscall_trampoline + 4096 - SIG_TRAMPO_SIZE);
+  memcpy(sig_copy, (void*)sig_trampoline, sig_size);
+  td__sig_trampo = (void(*)())sig_copy;
   return true;
 }
 
 extern void install_seccomp_sigsys(int ccsock);
 extern void install_seccomp_filter();
+extern void install_seccomp_dispatch();
 
 bool
 scout::install_sigsys() {
@@ -146,6 +197,12 @@ scout::install_seccomp_filter() {
   return true;
 }
 
+bool
+scout::install_user_dispatch() {
+  install_seccomp_dispatch();
+  return true;
+}
+
 scout*
 scout::getInstance() {
   return sScoutSingleton;
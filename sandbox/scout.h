@@ -4,6 +4,87 @@
 #ifndef __scout_h_
 #define __scout_h_
 
+/**
+ * How an intercepted syscall is routed.
+ */
+enum syscall_route {
+  // Trapped with SIGSYS, and handled by the scout.
+  SYSCALL_TRAP,
+  // Served by the Command Center from the seccomp notification fd
+  // in the user notification mode, trapped otherwise.
+  SYSCALL_NOTIF,
+};
+
+/**
+ * The table of syscalls intercepted by scouts.
+ *
+ * Every entry is X(name, route).  __NR_<name> is the number of the
+ * syscall, and scout::cmd_<name> is the command sent to the Command
+ * Center for it.  The seccomp filters (filter.cpp), the dispatcher of
+ * the SIGSYS handler (seccomp.cpp) and the commands are generated
+ * from this table.  A handler named sys_<name> should be defined in
+ * seccomp.cpp for every entry.
+ */
+#define SCOUT_SYSCALLS(X)                       \
+  X(open, SYSCALL_NOTIF)                        \
+  X(openat, SYSCALL_NOTIF)                      \
+  X(access, SYSCALL_NOTIF)                      \
+  X(fstat, SYSCALL_TRAP)                        \
+  X(stat, SYSCALL_NOTIF)                        \
+  X(lstat, SYSCALL_TRAP)                        \
+  X(execve, SYSCALL_TRAP)                       \
+  X(readlink, SYSCALL_NOTIF)                    \
+  X(unlink, SYSCALL_NOTIF)                      \
+  X(vfork, SYSCALL_TRAP)                        \
+  X(dup, SYSCALL_TRAP)                          \
+  X(dup2, SYSCALL_TRAP)                         \
+  X(rt_sigaction, SYSCALL_TRAP)                 \
+  X(newfstatat, SYSCALL_TRAP)                   \
+  X(statx, SYSCALL_TRAP)                        \
+  X(faccessat, SYSCALL_TRAP)                    \
+  X(faccessat2, SYSCALL_TRAP)                   \
+  X(openat2, SYSCALL_TRAP)                      \
+  X(getdents64, SYSCALL_TRAP)                   \
+  X(chdir, SYSCALL_TRAP)                        \
+  X(fchdir, SYSCALL_TRAP)
+
+/**
+ * The table of syscalls changing the file system that scouts make by
+ * themselves.
+ *
+ * Every entry is X(name).  They are trapped, and handled by
+ * sys_fs_change() in seccomp.cpp, that tells the Command Center
+ * about every change succeeded with scout::cmd_fs_changed.  The
+ * Command Center bumps the generation of the memo caches (see
+ * memocache.h) for it.
+ */
+#define SCOUT_FS_CHANGE_SYSCALLS(X)             \
+  X(mkdir)                                      \
+  X(mkdirat)                                    \
+  X(rmdir)                                      \
+  X(rename)                                     \
+  X(renameat)                                   \
+  X(renameat2)                                  \
+  X(unlinkat)                                   \
+  X(link)                                       \
+  X(linkat)                                     \
+  X(symlink)                                    \
+  X(symlinkat)                                  \
+  X(mknod)                                      \
+  X(mknodat)                                    \
+  X(chmod)                                      \
+  X(fchmod)                                     \
+  X(fchmodat)                                   \
+  X(chown)                                      \
+  X(fchown)                                     \
+  X(lchown)                                     \
+  X(fchownat)                                   \
+  X(truncate)                                   \
+  X(utime)                                      \
+  X(utimes)                                     \
+  X(futimesat)                                  \
+  X(utimensat)
+
 /**
  * A scout is responsible for monitoring and deceiving a subject, a
  * process of an application.  It keep passing information of the
@@ -13,21 +94,40 @@ class scout {
 public:
   constexpr static unsigned long FLAG_FILTER_INSTALLED = 0x1;
   constexpr static unsigned long FLAG_CC_COMM_READY = 0x2;
+  // Let the Command Center serve some syscalls from the seccomp
+  // notification fd instead of trapping them with SIGSYS.
+  constexpr static unsigned long FLAG_USER_NOTIF = 0x4;
+  // Trap syscalls with Syscall User Dispatch, the seccomp filter
+  // stays as a safety net.
+  constexpr static unsigned long FLAG_USER_DISPATCH = 0x8;
+  // Rewrite the sites of trapped syscalls to call the scout
+  // directly.  See sitepatch.h.
+  constexpr static unsigned long FLAG_PATCH_SYSCALL = 0x10;
+  // Send metadata requests through a ring in shared memory instead
+  // of the socket.  See msgring.h.
+  constexpr static unsigned long FLAG_MSG_RING = 0x20;
+  // Exec programs through the exec stub of the Command Center
+  // instead of being attached with ptrace.  See
+  // loader/execstub.cpp.
+  constexpr static unsigned long FLAG_EXEC_STUB = 0x40;
 
+  // The channel passed across exec to a scout loaded by the exec
+  // stub, with FLAG_CC_COMM_READY.
   constexpr static int CMD_CENTER_SOCK = 75;
+  // The program passed to the exec stub.
+  constexpr static int EXEC_FD = 76;
+  constexpr static const char* EXEC_FD_PATH = "/proc/self/fd/76";
 
   enum scout_cmd {
     cmd_hello = 0x1,
-    cmd_open,
-    cmd_openat,
-    cmd_access,
-    cmd_fstat,
-    cmd_stat,
-    cmd_lstat,
-    cmd_execve,
-    cmd_readlink,
-    cmd_unlink,
-    cmd_vfork
+#define SCOUT_CMD(name, route) cmd_##name,
+    SCOUT_SYSCALLS(SCOUT_CMD)
+#undef SCOUT_CMD
+    cmd_notify_fd,
+    cmd_ring,
+    cmd_stub_exec,
+    cmd_fs_changed,
+    cmd_wake,
   };
 
   scout();
@@ -40,10 +140,15 @@ public:
   bool install_syscall_trampo();
   // Create a socket pair as the channel to the Command Center.
   bool establish_cc_channel();
+  // Create a new channel to the Command Center, and return the
+  // socket, or -1 for failures.
+  static int connect_cc();
   // Instll a signal handler for SIGSYS.
   bool install_sigsys();
   // Install a seccomp filter to monitor this subject.
   bool install_seccomp_filter();
+  // Arm Syscall User Dispatch to trap syscalls of this subject.
+  bool install_user_dispatch();
 
   bool prepare_exec();
 
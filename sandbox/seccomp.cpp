@@ -4,6 +4,7 @@
 #include "seccomp.h"
 #include "bridge.h"
 #include "scout.h"
+#include "sitepatch.h"
 
 #include "log.h"
 
@@ -13,15 +14,18 @@
 #include <signal.h>
 #include <asm/unistd.h>
 #include <string.h>
+#include <errno.h>
 
 #include <sys/prctl.h>
 
 #include <linux/seccomp.h>
 #include <linux/filter.h>
 #include <linux/audit.h>
+#include <linux/sched.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <elf.h>
 
 #define assert(x)                  \
   do {                             \
@@ -41,28 +45,70 @@ extern long (*td__syscall_trampo)(long, ...);
 extern long (*td__vfork_trampo)();
 extern int fakeframe_trampoline();
 extern void printptr(void* p);
+extern unsigned long int global_flags;
+extern unsigned long int cc_shm_addr;
 }
 
 #define SYSCALL td__syscall_trampo
 #define VFORK() td__vfork_trampo()
 
-static int
-install_filter() {
-  extern struct sock_fprog sandbox_filter_prog;
+#ifndef SYS_USER_DISPATCH
+#define SYS_USER_DISPATCH 2
+#endif
 
+#define X86_EFLAGS_TF 0x100
+#define SIGBIT(sig) (1UL << ((sig) - 1))
+
+/**
+ * Install the filter.
+ *
+ * Return the listener fd of user notifications if |flags| has
+ * SECCOMP_FILTER_FLAG_NEW_LISTENER, or 0.
+ */
+static int
+install_filter(struct sock_fprog* prog, unsigned int flags) {
   if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0) {
     perror("prctl");
     abort();
   }
-  if (seccomp(SECCOMP_SET_MODE_FILTER, 0, &sandbox_filter_prog)) {
+  auto r = seccomp(SECCOMP_SET_MODE_FILTER, flags, prog);
+  if (r < 0) {
     perror("seccomp");
     abort();
   }
-  return 0;
+  return r;
 }
 
 static sandbox_bridge bridge;
 
+/**
+ * The selector of Syscall User Dispatch.
+ *
+ * Syscalls made out of the trampoline page are trapped only if it is
+ * SYSCALL_DISPATCH_FILTER_BLOCK.  The scout turns it to
+ * SYSCALL_DISPATCH_FILTER_ALLOW around its own bookkeeping.  It is
+ * shared by all threads of the process.
+ */
+static volatile char dispatch_selector = SYSCALL_DISPATCH_FILTER_ALLOW;
+
+/**
+ * Arm Syscall User Dispatch for the calling thread.
+ *
+ * It is neither inherited by children nor kept across exec, so every
+ * new process should arm it again.
+ */
+static void
+arm_user_dispatch() {
+  auto r = SYSCALL(__NR_prctl,
+                   PR_SET_SYSCALL_USER_DISPATCH,
+                   PR_SYS_DISPATCH_ON,
+                   TRAMPOLINE_ADDR,
+                   4096,
+                   (long)&dispatch_selector);
+  assert(r == 0);
+  dispatch_selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+}
+
 static long
 execve_handler(const char *path, char*const* argv, char*const* envp) {
   LOGU(execve_handler);
@@ -75,6 +121,220 @@ execve_handler(const char *path, char*const* argv, char*const* envp) {
   return r;
 }
 
+/**
+ * Run the exec stub prepared by prepare_stub_exec().
+ */
+static long
+stub_execve_handler(const char *path, char*const* argv, char*const* envp) {
+  LOGU(stub_execve_handler);
+  auto r = SYSCALL(__NR_execve, (long)path, (long)argv, (long)envp);
+  // Only failures return.
+  SYSCALL(__NR_close, scout::EXEC_FD);
+  SYSCALL(__NR_close, scout::CMD_CENTER_SOCK);
+  return r;
+}
+
+// The first bytes of a program read by the kernel, BINPRM_BUF_SIZE.
+#define EXEC_HEADER_SIZE 256
+// The same as the exec stub.
+#define STUB_MAX_PHNUM 64
+// Max number of arguments of a script run through the exec stub.
+#define STUB_SCRIPT_ARGS 1024
+
+/**
+ * Open the program at |path| and check it like the kernel does, and
+ * read the first bytes to |header|.
+ *
+ * Return the fd, -errno for the error that execve() would fail
+ * with, or -ENOSYS if the stub can not run it.
+ */
+static int
+open_stub_program(const char* path, char* header) {
+  int fd = SYSCALL(__NR_openat, AT_FDCWD, (long)path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    // A program that can be executed but not read is left to the
+    // kernel.
+    return fd == -EACCES ? -ENOSYS : fd;
+  }
+  struct stat st;
+  int r = SYSCALL(__NR_fstat, fd, (long)&st);
+  if (r == 0 && !S_ISREG(st.st_mode)) {
+    r = -EACCES;
+  } else if (r == 0 && (st.st_mode & (S_ISUID | S_ISGID))) {
+    r = -ENOSYS;
+  }
+  if (r == 0) {
+    r = SYSCALL(__NR_faccessat2, AT_FDCWD, (long)path, X_OK, AT_EACCESS);
+  }
+  if (r == 0) {
+    bzero(header, EXEC_HEADER_SIZE + 1);
+    r = SYSCALL(__NR_pread64, fd, (long)header, EXEC_HEADER_SIZE, 0);
+    r = r < 0 ? -ENOSYS : 0;
+  }
+  if (r < 0) {
+    SYSCALL(__NR_close, fd);
+    return r;
+  }
+  return fd;
+}
+
+/**
+ * Return true if the stub can run the ELF file |fd|, a 64-bit x86_64
+ * program without an executable stack.
+ */
+static bool
+is_stub_elf(int fd, const char* header) {
+  auto eh = (const Elf64_Ehdr*)header;
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_machine != EM_X86_64 ||
+      (eh->e_type != ET_EXEC && eh->e_type != ET_DYN) ||
+      eh->e_phentsize != sizeof(Elf64_Phdr) ||
+      eh->e_phnum > STUB_MAX_PHNUM) {
+    return false;
+  }
+  Elf64_Phdr phdrs[STUB_MAX_PHNUM];
+  auto bytes = (long)sizeof(Elf64_Phdr) * eh->e_phnum;
+  if (SYSCALL(__NR_pread64, fd, (long)phdrs, bytes, eh->e_phoff) != bytes) {
+    return false;
+  }
+  for (int i = 0; i < eh->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_GNU_STACK && (phdrs[i].p_flags & PF_X)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Split the "#!" line of a script in |line| to the interpreter and
+ * the optional argument like the kernel does.  Return false if
+ * there is no complete line.
+ */
+static bool
+parse_shebang(char* line, char** interp, char** arg) {
+  char* end = nullptr;
+  for (int i = 2; i < EXEC_HEADER_SIZE; i++) {
+    if (line[i] == '\n') {
+      end = line + i;
+      break;
+    }
+  }
+  if (end == nullptr) {
+    return false;
+  }
+  *end = 0;
+  while (end > line + 2 && (end[-1] == ' ' || end[-1] == '\t')) {
+    *--end = 0;
+  }
+  auto p = line + 2;
+  while (*p == ' ' || *p == '\t') {
+    p++;
+  }
+  if (*p == 0) {
+    return false;
+  }
+  *interp = p;
+  while (*p && *p != ' ' && *p != '\t') {
+    p++;
+  }
+  *arg = nullptr;
+  if (*p) {
+    *p++ = 0;
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (*p) {
+      *arg = p;
+    }
+  }
+  return true;
+}
+
+/**
+ * Prepare to exec |*path| with |*argv| through the exec stub, see
+ * loader/execstub.cpp.
+ *
+ * The program, or the interpreter of a script, is opened at
+ * scout::EXEC_FD, and a new channel to the Command Center is created
+ * at scout::CMD_CENTER_SOCK.  |*path| and |*argv| are replaced with
+ * the stub and the argv of the program.
+ *
+ * Return 0, -errno for the error that execve() should fail with, or
+ * -ENOSYS to exec with ptrace for what the stub doesn't run, like
+ * setuid programs, 32-bit programs and nested scripts.  The subject
+ * may keep fds of its own at scout::EXEC_FD or
+ * scout::CMD_CENTER_SOCK across exec, it is exec'ed with ptrace as
+ * well then.
+ */
+static int
+prepare_stub_exec(const char** path, char*const** argv) {
+  auto shm = (const cc_shm*)cc_shm_addr;
+  if (shm == nullptr || shm->exec.flags == 0) {
+    return -ENOSYS;
+  }
+  if (SYSCALL(__NR_fcntl, scout::EXEC_FD, F_GETFD) != -EBADF ||
+      SYSCALL(__NR_fcntl, scout::CMD_CENTER_SOCK, F_GETFD) != -EBADF) {
+    return -ENOSYS;
+  }
+
+  char header[EXEC_HEADER_SIZE + 1];
+  auto fd = open_stub_program(*path, header);
+  if (fd < 0) {
+    return fd;
+  }
+  auto prog_argv = *argv;
+  if (header[0] == '#' && header[1] == '!') {
+    // Shared by threads like the altstack of sys_execve().
+    static char line[EXEC_HEADER_SIZE + 1];
+    static char* script_argv[STUB_SCRIPT_ARGS];
+    SYSCALL(__NR_close, fd);
+    memcpy(line, header, sizeof(line));
+    int argc = 0;
+    while (*argv && (*argv)[argc]) {
+      argc++;
+    }
+    char* interp;
+    char* arg;
+    if (!parse_shebang(line, &interp, &arg) || argc + 3 > STUB_SCRIPT_ARGS) {
+      return -ENOSYS;
+    }
+    fd = open_stub_program(interp, header);
+    if (fd < 0) {
+      return fd;
+    }
+    int i = 0;
+    script_argv[i++] = interp;
+    if (arg) {
+      script_argv[i++] = arg;
+    }
+    script_argv[i++] = (char*)*path;
+    for (int j = 1; j < argc; j++) {
+      script_argv[i++] = (*argv)[j];
+    }
+    script_argv[i] = nullptr;
+    prog_argv = script_argv;
+  }
+  if (!is_stub_elf(fd, header)) {
+    SYSCALL(__NR_close, fd);
+    return -ENOSYS;
+  }
+
+  auto sock = scout::connect_cc();
+  if (sock < 0) {
+    SYSCALL(__NR_close, fd);
+    return -ENOSYS;
+  }
+  // Both are kept across exec.
+  SYSCALL(__NR_dup2, fd, scout::EXEC_FD);
+  SYSCALL(__NR_dup2, sock, scout::CMD_CENTER_SOCK);
+  SYSCALL(__NR_close, fd);
+  SYSCALL(__NR_close, sock);
+
+  *path = shm->exec.stub_path;
+  *argv = prog_argv;
+  return 0;
+}
+
 static long
 vfork_handler(char *rsp, char *old_rsp) {
   static char buf[256];
@@ -84,6 +344,9 @@ vfork_handler(char *rsp, char *old_rsp) {
   auto pid = VFORK();
   if (pid == 0) {
     scout::getInstance()->establish_cc_channel();
+    if (global_flags & scout::FLAG_USER_DISPATCH) {
+      arm_user_dispatch();
+    }
     int keep_size = old_rsp - rsp;
     assert(keep_size <= (int)(256 - sizeof(void*) * 2));
     auto src = (void**)rsp;
@@ -142,176 +405,501 @@ install_fakeframe(ucontext_t* ctx, void* user_handler, void* saved_rsp = nullptr
 }
 
 static void
-handle_syscall(siginfo_t* info, ucontext_t* context) {
-  LOGU(seccomp handle_syscall);
-  auto ctx = context;
-  auto syscall = SECCOMP_SYSCALL(ctx);
+sys_open(ucontext_t* ctx) {
+  auto path = (const char*)SECCOMP_PARM1(ctx);
+  auto flags = (int)SECCOMP_PARM2(ctx);
+  auto mode = (mode_t)SECCOMP_PARM3(ctx);
+  auto r = bridge.send_openat(AT_FDCWD, path, flags, mode);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-  switch (syscall) {
-  case __NR_open:
-    {
-      auto path = (const char*)SECCOMP_PARM1(ctx);
-      auto flags = (int)SECCOMP_PARM2(ctx);
-      auto mode = (mode_t)SECCOMP_PARM3(ctx);
-      auto r = bridge.send_open(path, flags, mode);
-      SECCOMP_RESULT(ctx) = r;
-    }
-    break;
+static void
+sys_openat(ucontext_t* ctx) {
+  auto dirfd = (int)SECCOMP_PARM1(ctx);
+  auto path = (const char*)SECCOMP_PARM2(ctx);
+  auto flags = (int)SECCOMP_PARM3(ctx);
+  auto mode = (mode_t)SECCOMP_PARM4(ctx);
+  auto r = bridge.send_openat(dirfd, path, flags, mode);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-  case __NR_openat:
-    {
-      auto dirfd = (int)SECCOMP_PARM1(ctx);
-      auto path = (const char*)SECCOMP_PARM2(ctx);
-      auto flags = (int)SECCOMP_PARM3(ctx);
-      auto mode = (mode_t)SECCOMP_PARM4(ctx);
-      auto r = bridge.send_openat(dirfd, path, flags, mode);
-      SECCOMP_RESULT(ctx) = r;
-    }
-    break;
+static void
+sys_openat2(ucontext_t* ctx) {
+  auto dirfd = (int)SECCOMP_PARM1(ctx);
+  auto path = (const char*)SECCOMP_PARM2(ctx);
+  auto how = (const struct open_how*)SECCOMP_PARM3(ctx);
+  auto size = (size_t)SECCOMP_PARM4(ctx);
+  auto r = bridge.send_openat2(dirfd, path, how, size);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-  case __NR_dup:
-    {
-      auto fd = (int)SECCOMP_PARM1(ctx);
-      auto r = bridge.send_dup(fd);
-      SECCOMP_RESULT(ctx) = r;
-    }
-    break;
+static void
+sys_dup(ucontext_t* ctx) {
+  auto fd = (int)SECCOMP_PARM1(ctx);
+  auto r = bridge.send_dup(fd);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-  case __NR_dup2:
-    {
-      auto oldfd = (int)SECCOMP_PARM1(ctx);
-      auto newfd = (int)SECCOMP_PARM2(ctx);
-      auto r = bridge.send_dup2(oldfd, newfd);
-      SECCOMP_RESULT(ctx) = r;
-    }
-    break;
+static void
+sys_dup2(ucontext_t* ctx) {
+  auto oldfd = (int)SECCOMP_PARM1(ctx);
+  auto newfd = (int)SECCOMP_PARM2(ctx);
+  auto r = bridge.send_dup2(oldfd, newfd);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-  case __NR_access:
-    {
-      auto path = (const char*)SECCOMP_PARM1(ctx);
-      auto mode = (int)SECCOMP_PARM2(ctx);
-      auto r = bridge.send_access(path, mode);
-      SECCOMP_RESULT(ctx) = r;
-    }
-    break;
+static void
+sys_access(ucontext_t* ctx) {
+  auto path = (const char*)SECCOMP_PARM1(ctx);
+  auto mode = (int)SECCOMP_PARM2(ctx);
+  auto r = bridge.send_access(path, mode);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-  case __NR_fstat:
-    {
-      auto fd = (int)SECCOMP_PARM1(ctx);
-      auto statbuf = (struct stat*)SECCOMP_PARM2(ctx);
-      auto r = bridge.send_fstat(fd, statbuf);
-      SECCOMP_RESULT(ctx) = r;
-    }
-    break;
+static void
+sys_fstat(ucontext_t* ctx) {
+  auto fd = (int)SECCOMP_PARM1(ctx);
+  auto statbuf = (struct stat*)SECCOMP_PARM2(ctx);
+  auto r = bridge.send_fstat(fd, statbuf);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-  case __NR_stat:
-    {
-      auto path = (const char*)SECCOMP_PARM1(ctx);
-      auto statbuf = (struct stat*)SECCOMP_PARM2(ctx);
-      auto r = bridge.send_stat(path, statbuf);
-      SECCOMP_RESULT(ctx) = r;
-    }
-    break;
+static void
+sys_stat(ucontext_t* ctx) {
+  auto path = (const char*)SECCOMP_PARM1(ctx);
+  auto statbuf = (struct stat*)SECCOMP_PARM2(ctx);
+  auto r = bridge.send_stat(path, statbuf);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-  case __NR_lstat:
-    {
-      auto path = (const char*)SECCOMP_PARM1(ctx);
-      auto statbuf = (struct stat*)SECCOMP_PARM2(ctx);
-      auto r = bridge.send_lstat(path, statbuf);
-      SECCOMP_RESULT(ctx) = r;
-    }
-    break;
+static void
+sys_lstat(ucontext_t* ctx) {
+  auto path = (const char*)SECCOMP_PARM1(ctx);
+  auto statbuf = (struct stat*)SECCOMP_PARM2(ctx);
+  auto r = bridge.send_lstat(path, statbuf);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-  case __NR_execve:
-    {
-      LOGU(__NR_execve);
-      auto filename = (const char*)SECCOMP_PARM1(ctx);
-      auto argv = (char *const*)SECCOMP_PARM2(ctx);
-      auto envp = (char *const*)SECCOMP_PARM3(ctx);
-      auto r = bridge.send_execve(filename, argv, envp);
-      SECCOMP_RESULT(ctx) = r;
-      // Call execve() at the handler after leaving the handler and
-      // returning to the user space code.
-      if (r == 0) {
-        static char altstack[1024];
-        auto saved_rsp = SECCOMP_REG(ctx, REG_RSP);
-        SECCOMP_REG(ctx, REG_RSP) = (long long unsigned int)(altstack + 1024 - sizeof(void*));
+static void
+sys_newfstatat(ucontext_t* ctx) {
+  auto dirfd = (int)SECCOMP_PARM1(ctx);
+  auto path = (const char*)SECCOMP_PARM2(ctx);
+  auto statbuf = (struct stat*)SECCOMP_PARM3(ctx);
+  auto flags = (int)SECCOMP_PARM4(ctx);
+  auto r = bridge.send_fstatat(dirfd, path, statbuf, flags);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-        install_fakeframe(ctx, (void*)execve_handler, (void*)saved_rsp);
+static void
+sys_statx(ucontext_t* ctx) {
+  auto dirfd = (int)SECCOMP_PARM1(ctx);
+  auto path = (const char*)SECCOMP_PARM2(ctx);
+  auto flags = (int)SECCOMP_PARM3(ctx);
+  auto mask = (unsigned int)SECCOMP_PARM4(ctx);
+  auto statxbuf = (struct statx*)SECCOMP_PARM5(ctx);
+  auto r = bridge.send_statx(dirfd, path, flags, mask, statxbuf);
+  SECCOMP_RESULT(ctx) = r;
+}
 
-        // set arguments for the handler
-        SECCOMP_REG(ctx, REG_RDI) = (long long unsigned int)filename;
-        SECCOMP_REG(ctx, REG_RSI) = (long long unsigned int)argv;
-        SECCOMP_REG(ctx, REG_RDX) = (long long unsigned int)envp;
-      }
+static void
+sys_faccessat(ucontext_t* ctx) {
+  auto dirfd = (int)SECCOMP_PARM1(ctx);
+  auto path = (const char*)SECCOMP_PARM2(ctx);
+  auto mode = (int)SECCOMP_PARM3(ctx);
+  auto r = bridge.send_faccessat(dirfd, path, mode, 0);
+  SECCOMP_RESULT(ctx) = r;
+}
+
+static void
+sys_faccessat2(ucontext_t* ctx) {
+  auto dirfd = (int)SECCOMP_PARM1(ctx);
+  auto path = (const char*)SECCOMP_PARM2(ctx);
+  auto mode = (int)SECCOMP_PARM3(ctx);
+  auto flags = (int)SECCOMP_PARM4(ctx);
+  auto r = bridge.send_faccessat(dirfd, path, mode, flags);
+  SECCOMP_RESULT(ctx) = r;
+}
+
+static void
+sys_getdents64(ucontext_t* ctx) {
+  auto fd = (int)SECCOMP_PARM1(ctx);
+  auto dirp = (void*)SECCOMP_PARM2(ctx);
+  auto count = (size_t)SECCOMP_PARM3(ctx);
+  auto r = bridge.send_getdents64(fd, dirp, count);
+  SECCOMP_RESULT(ctx) = r;
+}
+
+static void
+sys_execve(ucontext_t* ctx) {
+  LOGU(__NR_execve);
+  auto filename = (const char*)SECCOMP_PARM1(ctx);
+  auto argv = (char *const*)SECCOMP_PARM2(ctx);
+  auto envp = (char *const*)SECCOMP_PARM3(ctx);
+  auto handler = (void*)stub_execve_handler;
+  long r = -ENOSYS;
+  if (global_flags & scout::FLAG_EXEC_STUB) {
+    r = prepare_stub_exec(&filename, &argv);
+  }
+  if (r == -ENOSYS) {
+    r = bridge.send_execve(filename, argv, envp);
+    handler = (void*)execve_handler;
+  }
+  SECCOMP_RESULT(ctx) = r;
+  // Call execve() at the handler after leaving the handler and
+  // returning to the user space code.
+  if (r == 0) {
+    static char altstack[1024];
+    auto saved_rsp = SECCOMP_REG(ctx, REG_RSP);
+    SECCOMP_REG(ctx, REG_RSP) = (long long unsigned int)(altstack + 1024 - sizeof(void*));
+
+    install_fakeframe(ctx, handler, (void*)saved_rsp);
+
+    // set arguments for the handler
+    SECCOMP_REG(ctx, REG_RDI) = (long long unsigned int)filename;
+    SECCOMP_REG(ctx, REG_RSI) = (long long unsigned int)argv;
+    SECCOMP_REG(ctx, REG_RDX) = (long long unsigned int)envp;
+  }
+}
+
+static void
+sys_readlink(ucontext_t* ctx) {
+  auto path = (const char*)SECCOMP_PARM1(ctx);
+  auto buf = (char*)SECCOMP_PARM2(ctx);
+  auto bufsize = (size_t)SECCOMP_PARM3(ctx);
+  auto r = bridge.send_readlink(path, buf, bufsize);
+  SECCOMP_RESULT(ctx) = r;
+}
+
+static void
+sys_unlink(ucontext_t* ctx) {
+  auto path = (const char*)SECCOMP_PARM1(ctx);
+  auto r = bridge.send_unlink(path);
+  SECCOMP_RESULT(ctx) = r;
+}
+
+static void
+sys_chdir(ucontext_t* ctx) {
+  auto path = (const char*)SECCOMP_PARM1(ctx);
+  auto r = bridge.send_chdir(path);
+  SECCOMP_RESULT(ctx) = r;
+}
+
+static void
+sys_fchdir(ucontext_t* ctx) {
+  auto fd = (int)SECCOMP_PARM1(ctx);
+  auto r = bridge.send_fchdir(fd);
+  SECCOMP_RESULT(ctx) = r;
+}
+
+/**
+ * Make a syscall of SCOUT_FS_CHANGE_SYSCALLS, and tell the Command
+ * Center if it changed the file system.
+ *
+ * The Command Center is told before returning to the subject, so
+ * the next lookup of the memo cache doesn't see the old generation.
+ */
+static void
+sys_fs_change(ucontext_t* ctx) {
+  auto r = SYSCALL(SECCOMP_SYSCALL(ctx),
+                   SECCOMP_PARM1(ctx), SECCOMP_PARM2(ctx),
+                   SECCOMP_PARM3(ctx), SECCOMP_PARM4(ctx),
+                   SECCOMP_PARM5(ctx), SECCOMP_PARM6(ctx));
+  if (r == 0) {
+    bridge.send_fs_changed();
+  }
+  SECCOMP_RESULT(ctx) = r;
+}
+
+static void
+sys_vfork(ucontext_t* ctx) {
+  LOGU(__NR_vfork);
+  bridge.send_vfork();
+  auto r = 0L;
+  SECCOMP_RESULT(ctx) = r;
+  // Call vfork() after leaving the handler, and return to the
+  // user space code.
+  static char altstack[1024];
+  auto saved_rsp = SECCOMP_REG(ctx, REG_RSP);
+  SECCOMP_REG(ctx, REG_RSP) = (long long unsigned int)(altstack + 1024 - sizeof(void*));
+
+  install_fakeframe(ctx, (void*)vfork_handler, (void*)saved_rsp);
+  SECCOMP_PARM1(ctx) = SECCOMP_REG(ctx, REG_RSP);
+  SECCOMP_PARM2(ctx) = (long long unsigned int)(altstack + 1024 - sizeof(void*));
+}
+
+static void
+sys_rt_sigaction(ucontext_t* ctx) {
+  auto signum = (int)SECCOMP_PARM1(ctx);
+  auto act = (const struct sigaction*)SECCOMP_PARM2(ctx);
+  auto oldact = (struct sigaction*)SECCOMP_PARM3(ctx);
+  auto sigsetsz = (size_t)SECCOMP_PARM4(ctx);
+  auto r = bridge.send_rt_sigaction(signum, act, oldact, sigsetsz);
+  SECCOMP_RESULT(ctx) = r;
+}
+
+typedef void (*syscall_handler)(ucontext_t* ctx);
+
+struct syscall_handler_entry {
+  int nr;
+  syscall_handler handler;
+};
+
+#define SYSCALL_HANDLER(name, route) { __NR_##name, sys_##name },
+#define FS_CHANGE_HANDLER(name) { __NR_##name, sys_fs_change },
+static constexpr syscall_handler_entry handler_entries[] = {
+  SCOUT_SYSCALLS(SYSCALL_HANDLER)
+  SCOUT_FS_CHANGE_SYSCALLS(FS_CHANGE_HANDLER)
+};
+#undef FS_CHANGE_HANDLER
+#undef SYSCALL_HANDLER
+
+// Larger than the number of any syscall of x86_64.
+constexpr int MAX_SYSCALL_NR = 512;
+
+struct syscall_handler_map {
+  syscall_handler handlers[MAX_SYSCALL_NR];
+};
+
+static constexpr syscall_handler_map
+make_handler_map() {
+  syscall_handler_map map = {};
+  for (auto& entry : handler_entries) {
+    map.handlers[entry.nr] = entry.handler;
+  }
+  return map;
+}
+
+// Generated from SCOUT_SYSCALLS and SCOUT_FS_CHANGE_SYSCALLS, indexed
+// by syscall numbers.
+static const syscall_handler_map handler_map = make_handler_map();
+
+/**
+ * Handle the syscalls intercepted by the scout.
+ *
+ * Return false if the syscall is not one of them.
+ */
+static bool
+handle_syscall(siginfo_t* info, ucontext_t* ctx) {
+  LOGU(seccomp handle_syscall);
+  auto syscall = (unsigned long)SECCOMP_SYSCALL(ctx);
+  if (syscall >= MAX_SYSCALL_NR || handler_map.handlers[syscall] == nullptr) {
+    return false;
+  }
+  handler_map.handlers[syscall](ctx);
+  return true;
+}
+
+/**
+ * Change the signal mask to be restored when leaving the handler.
+ *
+ * Calling rt_sigprocmask() in the handler is useless since the mask
+ * is restored from the context by rt_sigreturn.  SIGSYS and SIGTRAP
+ * are always left unblocked, or the next trapped syscall kills the
+ * process.
+ */
+static long
+dispatch_sigprocmask(ucontext_t* ctx) {
+  auto how = (int)SECCOMP_PARM1(ctx);
+  auto set = (const unsigned long*)SECCOMP_PARM2(ctx);
+  auto oldset = (unsigned long*)SECCOMP_PARM3(ctx);
+  auto sigsetsz = (size_t)SECCOMP_PARM4(ctx);
+  if (sigsetsz != sizeof(unsigned long)) {
+    return -EINVAL;
+  }
+
+  auto mask = (unsigned long*)&ctx->uc_sigmask;
+  auto old = *mask;
+  if (set != nullptr) {
+    switch (how) {
+    case SIG_BLOCK:
+      *mask |= *set;
+      break;
+    case SIG_UNBLOCK:
+      *mask &= ~*set;
+      break;
+    case SIG_SETMASK:
+      *mask = *set;
+      break;
+    default:
+      return -EINVAL;
     }
+    *mask &= ~(SIGBIT(SIGSYS) | SIGBIT(SIGTRAP) |
+               SIGBIT(SIGKILL) | SIGBIT(SIGSTOP));
+  }
+  if (oldset != nullptr) {
+    *oldset = old;
+  }
+  return 0;
+}
+
+/**
+ * Run a syscall natively after leaving the handler.
+ *
+ * It is for the syscalls creating a thread on a new stack, they can
+ * not be called from the handler.  The syscall instruction is run
+ * again with the selector allowing it, and the trap flag brings the
+ * control back to |sigtrap()| to block the selector once it is done.
+ */
+static void
+dispatch_natively(ucontext_t* ctx, long syscall) {
+  SECCOMP_RESULT(ctx) = syscall;
+  SECCOMP_IP(ctx) -= 2;         // size of the syscall instruction
+  SECCOMP_REG(ctx, REG_EFL) |= X86_EFLAGS_TF;
+}
+
+/**
+ * Handle a syscall trapped by Syscall User Dispatch.
+ *
+ * All syscalls of an armed thread are trapped.  The intercepted ones
+ * are handled as they are trapped by the seccomp filter, and others
+ * are passed through the trampoline.
+ */
+static void
+dispatch_syscall(siginfo_t* info, ucontext_t* ctx) {
+  dispatch_selector = SYSCALL_DISPATCH_FILTER_ALLOW;
+
+  auto syscall = (long)SECCOMP_SYSCALL(ctx);
+  if (handle_syscall(info, ctx)) {
+    dispatch_selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+    return;
+  }
+
+  switch (syscall) {
+  case __NR_rt_sigprocmask:
+    SECCOMP_RESULT(ctx) = dispatch_sigprocmask(ctx);
     break;
 
-  case __NR_readlink:
+  case __NR_clone:
+    if (SECCOMP_PARM2(ctx) != 0 || (SECCOMP_PARM1(ctx) & CLONE_VM)) {
+      // With a new stack or sharing the stack with the parent.
+      dispatch_natively(ctx, syscall);
+      // Blocked by sigtrap().
+      return;
+    }
+    // fall through
+  case __NR_fork:
     {
-      auto path = (const char*)SECCOMP_PARM1(ctx);
-      auto buf = (char*)SECCOMP_PARM2(ctx);
-      auto bufsize = (size_t)SECCOMP_PARM3(ctx);
-      auto r = bridge.send_readlink(path, buf, bufsize);
+      auto r = SYSCALL(syscall,
+                       SECCOMP_PARM1(ctx), SECCOMP_PARM2(ctx),
+                       SECCOMP_PARM3(ctx), SECCOMP_PARM4(ctx),
+                       SECCOMP_PARM5(ctx), SECCOMP_PARM6(ctx));
+      if (r == 0) {
+        // The child establishes its own channel to the Command
+        // Center at the first request.
+        arm_user_dispatch();
+      }
       SECCOMP_RESULT(ctx) = r;
     }
     break;
 
-  case __NR_unlink:
-    {
-      auto path = (const char*)SECCOMP_PARM1(ctx);
-      auto r = bridge.send_unlink(path);
-      SECCOMP_RESULT(ctx) = r;
-    }
+  case __NR_clone3:
+    dispatch_natively(ctx, syscall);
+    return;
+
+  default:
+    SECCOMP_RESULT(ctx) = SYSCALL(syscall,
+                                  SECCOMP_PARM1(ctx), SECCOMP_PARM2(ctx),
+                                  SECCOMP_PARM3(ctx), SECCOMP_PARM4(ctx),
+                                  SECCOMP_PARM5(ctx), SECCOMP_PARM6(ctx));
     break;
+  }
+
+  dispatch_selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+}
 
+/**
+ * Check if the site of a syscall can be rewritten to call
+ * |patched_syscall()|.
+ *
+ * The syscalls handled with a fake frame, creating a new context, or
+ * changing the signal mask, should always trap.
+ */
+static bool
+is_patchable(long syscall) {
+  switch (syscall) {
+  case __NR_execve:
+  case __NR_execveat:
   case __NR_vfork:
-    {
-      LOGU(__NR_vfork);
-#if 0
-      auto r = bridge.send_vfork();
-#endif
-      auto r = 0L;
-      SECCOMP_RESULT(ctx) = r;
-      // Call vfork() after leaving the handler, and return to the
-      // user space code.
-      static char altstack[1024];
-      auto saved_rsp = SECCOMP_REG(ctx, REG_RSP);
-      SECCOMP_REG(ctx, REG_RSP) = (long long unsigned int)(altstack + 1024 - sizeof(void*));
-
-      install_fakeframe(ctx, (void*)vfork_handler, (void*)saved_rsp);
-      SECCOMP_PARM1(ctx) = SECCOMP_REG(ctx, REG_RSP);
-      SECCOMP_PARM2(ctx) = (long long unsigned int)(altstack + 1024 - sizeof(void*));
-    }
-    break;
+  case __NR_fork:
+  case __NR_clone:
+  case __NR_clone3:
+  case __NR_rt_sigreturn:
+  case __NR_rt_sigprocmask:
+    return false;
+  }
+  return true;
+}
 
-  case __NR_rt_sigaction:
-    {
-      auto signum = (int)SECCOMP_PARM1(ctx);
-      auto act = (const struct sigaction*)SECCOMP_PARM2(ctx);
-      auto oldact = (struct sigaction*)SECCOMP_PARM3(ctx);
-      auto sigsetsz = (size_t)SECCOMP_PARM4(ctx);
-      auto r = bridge.send_rt_sigaction(signum, act, oldact, sigsetsz);
-      SECCOMP_RESULT(ctx) = r;
-    }
-    break;
+/**
+ * Called by patched syscall sites, see sitepatch.h.
+ */
+extern "C" long
+patched_syscall(long syscall, long arg1, long arg2, long arg3,
+                long arg4, long arg5, long arg6) {
+  ucontext_t context;
+  auto ctx = &context;
+  SECCOMP_SYSCALL(ctx) = syscall;
+  SECCOMP_PARM1(ctx) = arg1;
+  SECCOMP_PARM2(ctx) = arg2;
+  SECCOMP_PARM3(ctx) = arg3;
+  SECCOMP_PARM4(ctx) = arg4;
+  SECCOMP_PARM5(ctx) = arg5;
+  SECCOMP_PARM6(ctx) = arg6;
+  if (!handle_syscall(nullptr, ctx)) {
+    // Trapped by Syscall User Dispatch, but not intercepted.
+    return SYSCALL(syscall, arg1, arg2, arg3, arg4, arg5, arg6);
   }
+  return SECCOMP_RESULT(ctx);
 }
 
 static void
 sigsys(int nr, siginfo_t *info, void* void_context) {
   ucontext_t *ctx = (ucontext_t*)void_context;
-  handle_syscall(info, ctx);
+  auto syscall = (long)SECCOMP_SYSCALL(ctx);
+  auto ip = (char*)SECCOMP_IP(ctx);
+  if (info->si_code == SYS_USER_DISPATCH) {
+    dispatch_syscall(info, ctx);
+  } else {
+    handle_syscall(info, ctx);
+  }
+
+  if (global_flags & scout::FLAG_PATCH_SYSCALL && is_patchable(syscall)) {
+    // Next calls from the same site will not trap.
+    patch_syscall_site(ip - 2, syscall);
+  }
+}
+
+/**
+ * Single stepped from a syscall run by |dispatch_natively()|.
+ *
+ * The new thread, if any, arrives here too since it inherits the
+ * trap flag.
+ */
+static void
+sigtrap(int nr, siginfo_t *info, void* void_context) {
+  ucontext_t *ctx = (ucontext_t*)void_context;
+  if (!(SECCOMP_REG(ctx, REG_EFL) & X86_EFLAGS_TF)) {
+    return;
+  }
+  SECCOMP_REG(ctx, REG_EFL) &= ~X86_EFLAGS_TF;
+  dispatch_selector = SYSCALL_DISPATCH_FILTER_BLOCK;
 }
 
 void
 install_seccomp_sigsys(int ccsock) {
   bridge.set_sock(ccsock);
+  bridge.init_memo_cache();
+  if (global_flags & scout::FLAG_MSG_RING) {
+    bridge.enable_ring();
+  }
 
   struct sigaction act;
   bzero(&act, sizeof(act));
   act.sa_sigaction = &sigsys;
-  act.sa_flags = SA_SIGINFO;
+  // Signal handlers of the application may be called in the middle
+  // of the handler, and trap again.  A trapped syscall with SIGSYS
+  // blocked would kill the process.
+  act.sa_flags = SA_SIGINFO | SA_NODEFER;
   int r = sigaction(SIGSYS, &act, nullptr);
   if (r < 0) {
     perror("sigaction");
@@ -319,6 +907,37 @@ install_seccomp_sigsys(int ccsock) {
   }
 }
 
+/**
+ * Tell the Command Center the program that the exec stub has loaded
+ * the scout for.
+ */
+void
+announce_stub_exec() {
+  auto r = bridge.send_stub_exec();
+  assert(r >= 0);
+}
+
+/**
+ * Syscall User Dispatch traps every syscall made out of the
+ * trampoline page with SIGSYS, without running a BPF program for
+ * each of them.  The seccomp filter is still there to catch the
+ * threads and the processes that have not armed it yet.
+ */
+void
+install_seccomp_dispatch() {
+  struct sigaction act;
+  bzero(&act, sizeof(act));
+  act.sa_sigaction = &sigtrap;
+  act.sa_flags = SA_SIGINFO;
+  int r = sigaction(SIGTRAP, &act, nullptr);
+  if (r < 0) {
+    perror("sigaction");
+    abort();
+  }
+
+  arm_user_dispatch();
+}
+
 /**
  * The BPF filter will check all syscalls, some of calls are allowed
  * by return SECCOMP_RET_ALLOW. Other calls are trapped by return
@@ -328,8 +947,29 @@ install_seccomp_sigsys(int ccsock) {
  * at the thread calling the syscall.  In the signal handler of
  * SIGSYS, it handle the syscall by changing registers or memory with
  * the information coming along with siginfo_t and ucontext.
+ *
+ * With FLAG_USER_NOTIF, some calls return SECCOMP_RET_USER_NOTIF
+ * instead.  They are served by the Command Center directly from the
+ * listener fd without waking up the process.
  */
 void
 install_seccomp_filter() {
-  install_filter();
+  extern struct sock_fprog sandbox_filter_prog;
+  extern struct sock_fprog sandbox_notif_filter_prog;
+  extern struct sock_fprog sandbox_notif_stub_filter_prog;
+
+  if (!(global_flags & scout::FLAG_USER_NOTIF)) {
+    install_filter(&sandbox_filter_prog, 0);
+    return;
+  }
+
+  // Hand the listener over to the Command Center.  It is inherited
+  // by all descendants along with the filter, so the Command Center
+  // serves the whole process tree from this fd.
+  auto prog = global_flags & scout::FLAG_EXEC_STUB ?
+    &sandbox_notif_stub_filter_prog : &sandbox_notif_filter_prog;
+  auto listener = install_filter(prog, SECCOMP_FILTER_FLAG_NEW_LISTENER);
+  auto r = bridge.send_notify_fd(listener);
+  assert(r >= 0);
+  close(listener);
 }
@@ -0,0 +1,313 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#include "sitepatch.h"
+
+#include "log.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <asm/unistd.h>
+
+
+extern "C" {
+extern long (*td__syscall_trampo)(long, ...);
+extern void patched_syscall_trampoline();
+}
+
+#define SYSCALL td__syscall_trampo
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// Size of a stub, see |make_stub()|.
+#define STUB_SIZE 40
+#define POOL_SIZE 4096
+#define MAX_POOLS 16
+// Reach of a jmp with a 32-bit displacement.
+#define JMP_RANGE 0x7fff0000L
+// "mov $imm32, %eax; syscall"
+#define SITE_SIZE 7
+
+#define FAILED_SITES 256
+
+struct stub_pool {
+  char* base;
+  int used;
+};
+
+static stub_pool pools[MAX_POOLS];
+static int pool_num = 0;
+
+// Held by a thread allocating a stub and patching a site.  Pools are
+// shared, and so are text pages; a thread restoring the protection
+// of a page should not get in the way of another thread writing it.
+static int patch_lock;
+
+static void
+lock_patch() {
+  while (__atomic_exchange_n(&patch_lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&patch_lock, __ATOMIC_RELAXED)) {
+      __builtin_ia32_pause();
+    }
+  }
+}
+
+static void
+unlock_patch() {
+  __atomic_store_n(&patch_lock, 0, __ATOMIC_RELEASE);
+}
+
+// Sites that can not be patched.
+static char* failed_sites[FAILED_SITES];
+
+static bool
+is_failed(char* site) {
+  return failed_sites[((unsigned long)site >> 2) % FAILED_SITES] == site;
+}
+
+static void
+set_failed(char* site) {
+  failed_sites[((unsigned long)site >> 2) % FAILED_SITES] = site;
+}
+
+static bool
+in_jmp_range(char* from, char* to) {
+  auto d = to - from;
+  return d < JMP_RANGE && d > -JMP_RANGE;
+}
+
+static const char*
+parse_hex(const char* p, unsigned long* v) {
+  *v = 0;
+  for (;; p++) {
+    if (*p >= '0' && *p <= '9') {
+      *v = (*v << 4) | (*p - '0');
+    } else if (*p >= 'a' && *p <= 'f') {
+      *v = (*v << 4) | (*p - 'a' + 10);
+    } else {
+      return p;
+    }
+  }
+}
+
+/**
+ * Check if the whole site is in a read-only executable mapping of
+ * a file by looking up /proc/self/maps.
+ */
+static bool
+is_in_file_text(char* site) {
+  int fd = SYSCALL(__NR_open, (long)"/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  char buf[1024];
+  char line[256];
+  int llen = 0;
+  bool found = false;
+  bool ok = false;
+  while (!found) {
+    auto n = SYSCALL(__NR_read, fd, (long)buf, sizeof(buf));
+    if (n <= 0) {
+      break;
+    }
+    for (int i = 0; i < n && !found; i++) {
+      if (buf[i] != '\n') {
+        if (llen < (int)sizeof(line) - 1) {
+          line[llen++] = buf[i];
+        }
+        continue;
+      }
+      line[llen] = 0;
+      llen = 0;
+
+      // "start-end perms offset dev inode path"
+      unsigned long start, end;
+      auto p = parse_hex(line, &start);
+      if (*p++ != '-') {
+        continue;
+      }
+      p = parse_hex(p, &end);
+      if ((unsigned long)site < start || (unsigned long)site >= end) {
+        continue;
+      }
+      found = true;
+      static const char perms[] = " r-xp ";
+      if ((unsigned long)site + SITE_SIZE > end ||
+          memcmp(p, perms, sizeof(perms) - 1) != 0) {
+        break;
+      }
+      for (; *p; p++) {
+        if (*p == '/') {
+          ok = true;
+          break;
+        }
+      }
+    }
+  }
+
+  SYSCALL(__NR_close, fd);
+  return ok;
+}
+
+/**
+ * Find a free stub in the reach of the site, or map a new pool near
+ * the site.  Called with |patch_lock| held.
+ */
+static char*
+alloc_stub(char* site) {
+  for (int i = 0; i < pool_num; i++) {
+    auto pool = pools + i;
+    if (pool->used + STUB_SIZE <= POOL_SIZE &&
+        in_jmp_range(site, pool->base) &&
+        in_jmp_range(site, pool->base + POOL_SIZE)) {
+      auto stub = pool->base + pool->used;
+      pool->used += STUB_SIZE;
+      return stub;
+    }
+  }
+
+  if (pool_num >= MAX_POOLS) {
+    return nullptr;
+  }
+
+  // Look for a hole below the site, where the libraries are loaded
+  // from the top down.
+  for (long dist = 1L << 24; dist < JMP_RANGE - POOL_SIZE; dist += 1L << 24) {
+    auto hint = (char*)(((unsigned long)site - dist) & ~4095UL);
+    auto r = SYSCALL(__NR_mmap, (long)hint, POOL_SIZE,
+                     PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE,
+                     -1, 0);
+    if (r < 0) {
+      continue;
+    }
+    if ((char*)r != hint) {
+      // MAP_FIXED_NOREPLACE is not supported, it was a hint.
+      SYSCALL(__NR_munmap, r, POOL_SIZE);
+      continue;
+    }
+    auto pool = pools + pool_num++;
+    pool->base = hint;
+    pool->used = STUB_SIZE;
+    return pool->base;
+  }
+  return nullptr;
+}
+
+/**
+ * Fill a stub to call |patched_syscall_trampoline()| for the site.
+ *
+ *   lea -128(%rsp), %rsp   // skip the red zone
+ *   mov $syscall, %eax     // replaced by the jmp at the site
+ *   movabs $patched_syscall_trampoline, %r11
+ *   call *%r11
+ *   lea 128(%rsp), %rsp
+ *   jmp site + SITE_SIZE
+ *
+ * %r11 is free to use since the syscall instruction clobbers it.
+ */
+static void
+make_stub(char* stub, char* site, long syscall) {
+  auto p = (unsigned char*)stub;
+  static const unsigned char lea_down[] = { 0x48, 0x8d, 0x64, 0x24, 0x80 };
+  static const unsigned char lea_up[] = {
+    0x48, 0x8d, 0xa4, 0x24, 0x80, 0x00, 0x00, 0x00
+  };
+
+  memcpy(p, lea_down, sizeof(lea_down));
+  p += sizeof(lea_down);
+
+  *p++ = 0xb8;
+  int nr = syscall;
+  memcpy(p, &nr, sizeof(nr));
+  p += sizeof(nr);
+
+  *p++ = 0x49;
+  *p++ = 0xbb;
+  auto entry = (void*)patched_syscall_trampoline;
+  memcpy(p, &entry, sizeof(entry));
+  p += sizeof(entry);
+
+  *p++ = 0x41;
+  *p++ = 0xff;
+  *p++ = 0xd3;
+
+  memcpy(p, lea_up, sizeof(lea_up));
+  p += sizeof(lea_up);
+
+  *p++ = 0xe9;
+  int rel = (site + SITE_SIZE) - (char*)(p + sizeof(rel));
+  memcpy(p, &rel, sizeof(rel));
+}
+
+bool
+patch_syscall_site(void* ip, long syscall) {
+  auto site = (char*)ip - 5;
+  if (is_failed(site)) {
+    return false;
+  }
+  LOGU(patch_syscall_site);
+
+  // The jmp should be written with one store for other threads.
+  auto qword = (unsigned long*)((unsigned long)site & ~7UL);
+  auto offset = site - (char*)qword;
+  if (offset + 5 > 8) {
+    set_failed(site);
+    return false;
+  }
+
+  // Other threads may be trapped at the same site, or be patching
+  // the same page, which is writable meanwhile.
+  lock_patch();
+  auto code = (unsigned char*)site;
+  if (code[0] == 0xe9) {
+    unlock_patch();
+    return true;
+  }
+  if (!is_in_file_text(site)) {
+    set_failed(site);
+    unlock_patch();
+    return false;
+  }
+  int imm;
+  memcpy(&imm, code + 1, sizeof(imm));
+  if (code[0] != 0xb8 || imm != syscall ||
+      code[5] != 0x0f || code[6] != 0x05) {
+    set_failed(site);
+    unlock_patch();
+    return false;
+  }
+
+  auto stub = alloc_stub(site);
+  if (stub == nullptr) {
+    set_failed(site);
+    unlock_patch();
+    return false;
+  }
+  make_stub(stub, site, syscall);
+
+  unsigned long value = *qword;
+  auto bytes = (unsigned char*)&value + offset;
+  bytes[0] = 0xe9;
+  int rel = stub - (site + 5);
+  memcpy(bytes + 1, &rel, sizeof(rel));
+
+  auto page = (unsigned long)qword & ~4095UL;
+  auto r = SYSCALL(__NR_mprotect, page, 4096,
+                   PROT_READ | PROT_WRITE | PROT_EXEC);
+  if (r < 0) {
+    // The stub is left unused.
+    set_failed(site);
+    unlock_patch();
+    return false;
+  }
+  __atomic_store_n(qword, value, __ATOMIC_SEQ_CST);
+  SYSCALL(__NR_mprotect, page, 4096, PROT_READ | PROT_EXEC);
+  unlock_patch();
+  return true;
+}
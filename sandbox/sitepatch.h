@@ -0,0 +1,22 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#ifndef __sitepatch_h_
+#define __sitepatch_h_
+
+/**
+ * Rewrite the site of a trapped syscall to call the scout directly.
+ *
+ * |ip| is the address of the syscall instruction.  Only sites of
+ * "mov $syscall, %eax; syscall" in read-only executable mappings of
+ * files, libc mostly, are rewritten.  The mov instruction is
+ * replaced by a jmp to a stub calling |patched_syscall()| and
+ * jumping back after the syscall instruction.  The syscall
+ * instruction is left as it is for threads on the way.
+ *
+ * Return false if the site can not be patched.  Such sites keep
+ * trapping, and are not checked again.
+ */
+bool patch_syscall_site(void* ip, long syscall);
+
+#endif /* __sitepatch_h_ */
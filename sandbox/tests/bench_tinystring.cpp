@@ -0,0 +1,128 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+/*
+ * Check the vectorized functions of tinylibc and compare them with
+ * the byte loops that tinylibc used before.
+ *
+ * This file is built without optimization like libmosingar.so, and
+ * tinystring.cpp is built with -O2 like it is for libmosingar.so.
+ */
+#include "tinystring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static void*
+loop_memcpy(void* dest, const void* src, size_t n) {
+  auto d = (char*)dest;
+  auto s = (const char*)src;
+  for (size_t i = 0; i < n; i++) {
+    *d++ = *s++;
+  }
+  return dest;
+}
+
+static size_t
+loop_strlen(const char* s) {
+  int count = 0;
+  while (*s++) count++;
+  return count;
+}
+
+static void
+loop_bzero(void* s, size_t n) {
+  auto p = (char*)s;
+  for (size_t i = 0; i < n; i++) {
+    *p++ = 0;
+  }
+}
+
+struct impl {
+  const char* name;
+  void* (*memcpy)(void*, const void*, size_t);
+  size_t (*strlen)(const char*);
+  void (*bzero)(void*, size_t);
+};
+
+static const impl impls[] = {
+  { "loop", loop_memcpy, loop_strlen, loop_bzero },
+  { "sse2", tl_memcpy_sse2, tl_strlen_sse2, tl_bzero_sse2 },
+  { "avx2", tl_memcpy_avx2, tl_strlen_avx2, tl_bzero_avx2 },
+};
+
+static double
+now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char src[16384];
+static char dst[16384];
+static char ref[16384];
+
+/**
+ * Compare the results with the loops for all sizes up to 300 at
+ * every alignment, with guard bytes around.
+ */
+static int
+check(const impl& im) {
+  int bad = 0;
+  for (size_t i = 0; i < sizeof(src); i++) {
+    src[i] = 1 + i % 251;
+  }
+  for (size_t off = 0; off < 32; off++) {
+    for (size_t n = 0; n < 300; n++) {
+      memset(dst, 0x55, 400);
+      memset(ref, 0x55, 400);
+      im.memcpy(dst + off, src + 7, n);
+      loop_memcpy(ref + off, src + 7, n);
+      bad += memcmp(dst, ref, 400) != 0;
+
+      im.bzero(dst + off, n);
+      loop_bzero(ref + off, n);
+      bad += memcmp(dst, ref, 400) != 0;
+
+      src[off + n] = 0;
+      bad += im.strlen(src + off) != n;
+      src[off + n] = 1;
+    }
+  }
+  return bad;
+}
+
+template<typename F>
+static double
+time_ns(F f) {
+  const int rounds = 200000;
+  auto start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    f();
+  }
+  return (now_ns() - start) / rounds;
+}
+
+int
+main(int argc, const char* argv[]) {
+  auto path = "/usr/lib/gcc/x86_64-linux-gnu/12/include/stddef.h";
+  // Sizes of a path, a struct stat and a buffer of msg_receiver.
+  static const size_t sizes[] = { strlen(path) + 1, 144, 8192 };
+
+  for (auto& im : impls) {
+    if (&im == &impls[2] && !tl_has_avx2()) {
+      printf("avx2: not supported\n");
+      continue;
+    }
+    printf("%s: check %s\n", im.name, check(im) ? "FAILED" : "OK");
+    printf("  strlen %zu: %.1f ns\n", sizes[0],
+           time_ns([&]() { im.strlen(path); }));
+    for (auto n : sizes) {
+      printf("  memcpy %zu: %.1f ns, bzero %zu: %.1f ns\n",
+             n, time_ns([&]() { im.memcpy(dst, src, n); }),
+             n, time_ns([&]() { im.bzero(dst, n); }));
+    }
+  }
+  return 0;
+}
@@ -3,10 +3,17 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <errno.h>
-#include <asm/signal.h>
+#include <signal.h>
+#include <cpuid.h>
+
+#include "tinystring.h"
 
 #define NO_ERRNO
 
+#ifndef SA_RESTORER
+#define SA_RESTORER 0x04000000
+#endif
+
 extern "C" {
 
 #ifndef NO_ERRNO
@@ -15,7 +22,7 @@ static int tl_errno = 0;
 #endif
 
 extern long (*td__syscall_trampo)(long, ...);
-extern void sig_trampoline();
+extern void (*td__sig_trampo)();
 
 #define SYSCALL td__syscall_trampo
 
@@ -33,14 +40,86 @@ void printptr(void* p) {
   SYSCALL(__NR_write, 1, (long)buf, 19);
 }
 
+// xsave components of registers that the scout may change: x87,
+// SSE, AVX and AVX-512.  VEX instructions clear the upper halves of
+// zmm registers as well.
+#define XSAVE_SCOUT_MASK 0xe7
+// The legacy area and the header of xsave.
+#define XSAVE_LEGACY_SIZE 576
+
+/**
+ * The size of the area and the components saved with xsave by the
+ * sitepatch trampoline, or 0 to save SSE registers with fxsave.  See
+ * sitepatch-trampoline-x86_64.S.
+ */
+unsigned long td__xsave_size = 0;
+unsigned long td__xsave_mask = 0;
+
+static void* (*memcpy_impl)(void*, const void*, size_t) = tl_memcpy_sse2;
+static size_t (*strlen_impl)(const char*) = tl_strlen_sse2;
+static void (*bzero_impl)(void*, size_t) = tl_bzero_sse2;
+
+/**
+ * Pick the implementations of memory and string functions for the
+ * CPU.  It should be called before the scout patches any syscall
+ * site.
+ */
+void
+tinylibc_init() {
+  if (!tl_has_avx2()) {
+    return;
+  }
+  unsigned xcr0, xcr0_hi;
+  asm volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+  auto mask = xcr0 & XSAVE_SCOUT_MASK;
+  unsigned long size = XSAVE_LEGACY_SIZE;
+  for (unsigned i = 2; i < 8; i++) {
+    unsigned comp_size, comp_off, ecx, edx;
+    if ((mask & (1 << i)) &&
+        __get_cpuid_count(0xd, i, &comp_size, &comp_off, &ecx, &edx) &&
+        comp_off + comp_size > size) {
+      size = comp_off + comp_size;
+    }
+  }
+  td__xsave_mask = mask;
+  td__xsave_size = (size + 63) & ~63UL;
+
+  memcpy_impl = tl_memcpy_avx2;
+  strlen_impl = tl_strlen_avx2;
+  bzero_impl = tl_bzero_avx2;
+}
+
 void*
 memcpy(void* dest, const void* src, size_t n) {
+  return memcpy_impl(dest, src, n);
+}
+
+void*
+memmove(void* dest, const void* src, size_t n) {
   auto d = (char*)dest;
   auto s = (const char*)src;
+  if (d <= s) {
+    for (size_t i = 0; i < n; i++) {
+      d[i] = s[i];
+    }
+  } else {
+    for (size_t i = n; i > 0; i--) {
+      d[i - 1] = s[i - 1];
+    }
+  }
+  return dest;
+}
+
+int
+memcmp(const void* s1, const void* s2, size_t n) {
+  auto p1 = (const unsigned char*)s1;
+  auto p2 = (const unsigned char*)s2;
   for (size_t i = 0; i < n; i++) {
-    *d++ = *s++;
+    if (p1[i] != p2[i]) {
+      return p1[i] - p2[i];
+    }
   }
-  return d;
+  return 0;
 }
 
 void *
@@ -74,9 +153,7 @@ strlen(const char* s) {
   if (s == nullptr) {
     return 0;
   }
-  int count = 0;
-  while (*s++) count++;
-  return count;
+  return strlen_impl(s);
 }
 
 struct kernel_sigaction
@@ -96,7 +173,7 @@ sigaction(int signum, const struct sigaction* act, struct sigaction* oldact) {
   if (act != nullptr) {
     kact.k_sa_handler = act->sa_handler;
     kact.sa_flags = act->sa_flags | SA_RESTORER;
-    kact.sa_restorer = &sig_trampoline;
+    kact.sa_restorer = td__sig_trampo;
     kact.sa_mask = act->sa_mask;
   }
 
@@ -210,9 +287,8 @@ int sendmsg(int sockfd, const struct msghdr *msg, int flags) {
 
 void
 bzero(void* s, ssize_t n) {
-  auto p = (char*)s;
-  for (int i = 0; i < n; i++) {
-    *p++ = 0;
+  if (n > 0) {
+    bzero_impl(s, n);
   }
 }
 
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 
 #include <asm/unistd.h>
 #include <unistd.h>
@@ -26,72 +28,55 @@ extern long (*td__syscall_trampo)(long, ...);
 #define SYSCALL td__syscall_trampo
 #endif
 
+/**
+ * A chunk of memory of elements of the same size.
+ *
+ * A chunk of small elements starts with a bitmap of the elements in
+ * use, in 64 bits words.  Bits after the last element are always
+ * set, so that the first zero bit of a word found by ctz is always a
+ * free element.
+ */
 struct chunkinfo_t {
   void* begin;
+  // Chunks in the same list, see |mem_block_t|.
   chunkinfo_t* next;
+  chunkinfo_t* prev;
   uint32_t elm_size;
   uint32_t bytes;
   uint32_t nfree;
+  // The word that the last element was found in.
+  uint32_t hint;
 
   chunkinfo_t(uint32_t element_size, void* begin, uint32_t bytes)
     : begin(begin)
     , next(nullptr)
+    , prev(nullptr)
     , elm_size(element_size)
     , bytes(bytes)
-    , nfree(max_elements()) {
-    auto to_clean = first_element();
-    auto usebits = (uint8_t*)begin;
-    for (uint32_t i = 0; i < to_clean; i++) {
-      usebits[i] = 0;
+    , nfree(0)
+    , hint(0) {
+    nfree = max_elements();
+    auto words = (uint64_t*)begin;
+    auto nwords = num_words();
+    for (uint32_t i = 0; i < nwords; i++) {
+      words[i] = 0;
+    }
+    if (nfree % 64) {
+      words[nwords - 1] = ~0UL << (nfree % 64);
     }
   }
 
-  uint32_t first_element() {
+  uint32_t num_words() {
     auto nelm = bytes / elm_size;
-    auto usebits_size = (nelm + 7) / 8;
-    auto first_elm = (usebits_size + 7) & ~0x7;
-    return first_elm;
-  }
-
-  uint32_t max_elements() {
-    return (bytes - first_element()) / elm_size;
+    return (nelm + 63) / 64;
   }
 
-  int32_t alloc_free_range(uint32_t start, uint32_t stop) {
-    auto usebits = (uint8_t*)begin;
-    for (auto i = start; i < stop; i += 8) {
-      auto byte = usebits[i / 8];
-      if (byte == 0xff) {
-        continue;
-      }
-      for (int j = 0; j < 8; j++) {
-        if (0x1 & (byte >> j)) {
-          continue;
-        }
-        auto found = i + j;
-        if (found < stop) {
-          usebits[i / 8] |= 0x1 << j;
-          nfree--;
-          return found;
-        }
-      }
-    }
-    return -1;
+  uint32_t first_element() {
+    return num_words() * sizeof(uint64_t);
   }
 
-  int32_t alloc_free() {
-    if (nfree == 0) {
-      return -1;
-    }
-    static uint32_t rand = 0;
-    auto max = max_elements();
-    auto start = (rand++ % 8) * max / 8;
-    start = start & ~0x7;
-    auto found = alloc_free_range(start, max);
-    if (found == -1 && start != 0) {
-      found = alloc_free_range(0, start);
-    }
-    return found;
+  uint32_t max_elements() {
+    return (bytes - first_element()) / elm_size;
   }
 
   bool is_part(void* ptr) {
@@ -100,19 +85,33 @@ struct chunkinfo_t {
   }
 
   void* alloc() {
-    auto found = alloc_free();
-    if (found < 0) {
+    if (nfree == 0) {
       return nullptr;
     }
-    return (char*)begin + first_element() + found * elm_size;
+    auto words = (uint64_t*)begin;
+    auto nwords = num_words();
+    auto i = hint;
+    while (words[i] == ~0UL) {
+      if (++i == nwords) {
+        i = 0;
+      }
+    }
+    auto bit = __builtin_ctzl(~words[i]);
+    words[i] |= 1UL << bit;
+    nfree--;
+    hint = i;
+    return (char*)begin + first_element() + (i * 64 + bit) * elm_size;
   }
 
   void free(void* ptr) {
-    assert (is_part(ptr));
+    assert(is_part(ptr));
     auto pos = ((char*)ptr - (char*)begin - first_element()) / elm_size;
-    auto usebits = (uint8_t*)begin;
-    usebits[pos / 8] &= ~(0x1 << (pos % 8));
+    auto words = (uint64_t*)begin;
+    auto mask = 1UL << (pos % 64);
+    assert(words[pos / 64] & mask);
+    words[pos / 64] &= ~mask;
     nfree++;
+    hint = pos / 64;
   }
 
   bool has_free() {
@@ -125,8 +124,335 @@ struct chunkinfo_t {
 #define SMALL_ALLOC_UPPER_POW 8
 #define SMALL_ALLOC_TYPES (SMALL_ALLOC_UPPER_POW - SMALL_ALLOC_LOWER_POW + 1)
 #define SMALL_ALLOC_UPPER (1 << SMALL_ALLOC_UPPER_POW)
-#define MAX_CHUNKS ((SMALL_ALLOC_UPPER_POW - SMALL_ALLOC_UPPER_POW + 1) * 3)
+// Chunks of small elements are of this size, and aligned to it.
+#define SMALL_CHUNK_BYTES 1024
+// The biggest block.
+#define MAX_BLOCK_SIZE (1024 * 1024)
+
+#define PAGE_SIZE 4096
+// Large blocks of this size or bigger are mapped separately.
+#define LARGE_MMAP_MIN (64 * 1024)
+#define LARGE_ARENA_SIZE (256 * 1024)
+// Free lists of large blocks of 2^8, 2^9, ... 2^17 bytes and more.
+#define LARGE_BIN_LOWER_POW 8
+#define LARGE_BINS 10
+// A free block is split if this much is left.
+#define LARGE_MIN_SPLIT 64
+
+/**
+ * The header of a block of large allocations.
+ *
+ * Blocks are placed one after another in arenas with boundary tags.
+ * The size of a free block is repeated in |prev_size| of the block
+ * following it, so that a block being freed can find the previous
+ * one and coalesce with it.  |prev_size| is valid only if the
+ * previous block is free, it is a part of the previous block
+ * otherwise.
+ */
+struct large_blk_t {
+  uint64_t prev_size;
+  // The size of the block including the header, and LB_* flags.
+  uint64_t size_flags;
+  // Free blocks only, in the list of their bin.
+  large_blk_t* next;
+  large_blk_t* prev;
+};
+
+#define LB_IN_USE 0x1UL
+#define LB_PREV_IN_USE 0x2UL
+// Mapped by itself, not in an arena.
+#define LB_MMAPPED 0x4UL
+#define LB_FLAGS 0xfUL
+#define LB_HDR_SIZE (2 * sizeof(uint64_t))
+
+/**
+ * The allocator of large buffers, bigger than small elements.
+ *
+ * Buffers of LARGE_MMAP_MIN or more are mapped separately, and
+ * unmapped at free().  Others are carved from arenas of
+ * LARGE_ARENA_SIZE bytes.  Free blocks are kept in segregated lists
+ * by size, |bin_map| has a bit for every list that is not empty.
+ * Free blocks are coalesced with their neighbors, and an arena that
+ * becomes free as a whole is unmapped if there is another free one
+ * already, so the footprint follows what is in use.
+ *
+ * Every arena ends with a header of a zero sized block in use, so the
+ * last block has a next one as well.
+ */
+class large_heap_t {
+public:
+  uint32_t bin_map;
+  large_blk_t* bins[LARGE_BINS];
+  uint32_t num_arenas;
+  uint32_t free_arenas;
+
+  large_heap_t()
+    : bin_map(0)
+    , num_arenas(0)
+    , free_arenas(0) {
+    for (auto& bin : bins) {
+      bin = nullptr;
+    }
+  }
+
+  static uint64_t blk_size(large_blk_t* blk) {
+    return blk->size_flags & ~LB_FLAGS;
+  }
+
+  static large_blk_t* next_blk(large_blk_t* blk) {
+    return (large_blk_t*)((char*)blk + blk_size(blk));
+  }
+
+  static large_blk_t* get_blk(void* ptr) {
+    return (large_blk_t*)((char*)ptr - LB_HDR_SIZE);
+  }
+
+  static void* get_ptr(large_blk_t* blk) {
+    return (char*)blk + LB_HDR_SIZE;
+  }
+
+  // The usable bytes of a free arena as a whole.
+  static uint64_t arena_blk_size() {
+    return LARGE_ARENA_SIZE - LB_HDR_SIZE;
+  }
+
+  static uint64_t round_size(uint64_t bytes) {
+    auto size = (bytes + LB_HDR_SIZE + 15) & ~15UL;
+    return size < sizeof(large_blk_t) ? sizeof(large_blk_t) : size;
+  }
+
+  static int get_bin(uint64_t size) {
+    auto pow = 63 - __builtin_clzl(size);
+    if (pow < LARGE_BIN_LOWER_POW) {
+      return 0;
+    }
+    pow -= LARGE_BIN_LOWER_POW;
+    return pow < LARGE_BINS ? pow : LARGE_BINS - 1;
+  }
+
+  void link_free(large_blk_t* blk) {
+    auto bin = get_bin(blk_size(blk));
+    blk->prev = nullptr;
+    blk->next = bins[bin];
+    if (bins[bin]) {
+      bins[bin]->prev = blk;
+    }
+    bins[bin] = blk;
+    bin_map |= 1U << bin;
+  }
+
+  void unlink_free(large_blk_t* blk) {
+    auto bin = get_bin(blk_size(blk));
+    if (blk->prev) {
+      blk->prev->next = blk->next;
+    } else {
+      bins[bin] = blk->next;
+    }
+    if (blk->next) {
+      blk->next->prev = blk->prev;
+    }
+    if (bins[bin] == nullptr) {
+      bin_map &= ~(1U << bin);
+    }
+    if (blk_size(blk) == arena_blk_size()) {
+      free_arenas--;
+    }
+  }
+
+  /**
+   * Make |blk| a free block of |size| bytes, and tell the next block.
+   */
+  void set_free(large_blk_t* blk, uint64_t size) {
+    blk->size_flags = size | (blk->size_flags & LB_PREV_IN_USE);
+    auto next = next_blk(blk);
+    next->prev_size = size;
+    next->size_flags &= ~LB_PREV_IN_USE;
+    if (size == arena_blk_size()) {
+      // The arena is free as a whole.
+      if (free_arenas > 0) {
+        SYSCALL(__NR_munmap, (long)blk, LARGE_ARENA_SIZE);
+        num_arenas--;
+        return;
+      }
+      free_arenas++;
+    }
+    link_free(blk);
+  }
+
+  /**
+   * Mark |blk| in use with |size| bytes, and free what is left after
+   * it if it is big enough.
+   */
+  void set_in_use(large_blk_t* blk, uint64_t size) {
+    auto total = blk_size(blk);
+    if (total - size < LARGE_MIN_SPLIT) {
+      size = total;
+    }
+    blk->size_flags = size | LB_IN_USE | (blk->size_flags & LB_PREV_IN_USE);
+    auto next = next_blk(blk);
+    if (size == total) {
+      next->size_flags |= LB_PREV_IN_USE;
+      return;
+    }
+    next->size_flags = LB_PREV_IN_USE;
+    set_free(next, total - size);
+  }
+
+  large_blk_t* new_arena() {
+    auto mem = (char*)SYSCALL(__NR_mmap, nullptr, LARGE_ARENA_SIZE,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((unsigned long)mem >= (unsigned long)-4096) {
+      return nullptr;
+    }
+    num_arenas++;
+    auto end = (large_blk_t*)(mem + arena_blk_size());
+    end->size_flags = LB_IN_USE;
+    auto blk = (large_blk_t*)mem;
+    blk->size_flags = arena_blk_size() | LB_PREV_IN_USE;
+    end->prev_size = arena_blk_size();
+    return blk;
+  }
+
+  /**
+   * Find a free block of |size| bytes or bigger, and take it off its
+   * list.
+   */
+  large_blk_t* take_free(uint64_t size) {
+    auto bin = get_bin(size);
+    // Blocks of the bin may be smaller.
+    for (auto blk = bins[bin]; blk; blk = blk->next) {
+      if (blk_size(blk) >= size) {
+        unlink_free(blk);
+        return blk;
+      }
+    }
+    auto bigger = bin_map & ~((2U << bin) - 1);
+    if (bigger == 0) {
+      return nullptr;
+    }
+    auto blk = bins[__builtin_ctz(bigger)];
+    unlink_free(blk);
+    return blk;
+  }
+
+  void* alloc_mmap(uint64_t size) {
+    size = (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    auto blk = (large_blk_t*)SYSCALL(__NR_mmap, nullptr, size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ((unsigned long)blk >= (unsigned long)-4096) {
+      return nullptr;
+    }
+    blk->size_flags = size | LB_IN_USE | LB_MMAPPED;
+    return get_ptr(blk);
+  }
+
+  void* alloc(uint64_t bytes) {
+    auto size = round_size(bytes);
+    if (size >= LARGE_MMAP_MIN) {
+      return alloc_mmap(size);
+    }
+    auto blk = take_free(size);
+    if (blk == nullptr) {
+      blk = new_arena();
+      if (blk == nullptr) {
+        return nullptr;
+      }
+    }
+    set_in_use(blk, size);
+    return get_ptr(blk);
+  }
+
+  void free(void* ptr) {
+    auto blk = get_blk(ptr);
+    assert(blk->size_flags & LB_IN_USE);
+    auto size = blk_size(blk);
+    if (blk->size_flags & LB_MMAPPED) {
+      SYSCALL(__NR_munmap, (long)blk, size);
+      return;
+    }
+    auto next = next_blk(blk);
+    if (!(next->size_flags & LB_IN_USE)) {
+      unlink_free(next);
+      size += blk_size(next);
+    }
+    if (!(blk->size_flags & LB_PREV_IN_USE)) {
+      auto prev = (large_blk_t*)((char*)blk - blk->prev_size);
+      unlink_free(prev);
+      size += blk_size(prev);
+      blk = prev;
+    }
+    set_free(blk, size);
+  }
+
+  /**
+   * Return the bytes that can be used at |ptr|.
+   */
+  static uint64_t usable_size(void* ptr) {
+    return blk_size(get_blk(ptr)) - LB_HDR_SIZE;
+  }
 
+  /**
+   * Resize the buffer at |ptr| to |bytes| bytes in place, by giving
+   * back the tail or taking the free block following it.  Return
+   * false if it can not be done.
+   */
+  bool resize(void* ptr, uint64_t bytes) {
+    auto blk = get_blk(ptr);
+    auto size = round_size(bytes);
+    if (blk->size_flags & LB_MMAPPED) {
+      size = (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+      if (size < LARGE_MMAP_MIN) {
+        return false;
+      }
+      auto old_size = blk_size(blk);
+      if (size == old_size) {
+        return true;
+      }
+      // Keep the address, the caller may have pointers into it.
+      auto r = SYSCALL(__NR_mremap, (long)blk, old_size, size, 0);
+      if (r != (long)blk) {
+        return false;
+      }
+      blk->size_flags = size | LB_IN_USE | LB_MMAPPED;
+      return true;
+    }
+    if (size >= LARGE_MMAP_MIN) {
+      return false;
+    }
+    auto total = blk_size(blk);
+    auto next = next_blk(blk);
+    if (!(next->size_flags & LB_IN_USE)) {
+      if (total + blk_size(next) < size) {
+        return false;
+      }
+      unlink_free(next);
+      total += blk_size(next);
+    } else if (total < size) {
+      return false;
+    }
+    // Take the whole range, and give back what is left.
+    blk->size_flags = total | (blk->size_flags & LB_FLAGS);
+    set_in_use(blk, size);
+    return true;
+  }
+};
+
+/**
+ * A block of memory that chunks of small elements are carved from.
+ *
+ * Chunks of small elements of a size class that have free elements
+ * are linked in |partial|, an allocation takes the first one.  Small
+ * chunks are aligned to SMALL_CHUNK_BYTES in the block, and |units|
+ * maps every SMALL_CHUNK_BYTES of the block to the chunk there, so
+ * free() finds the chunk of an element without searching.
+ *
+ * The infos of chunks are small elements themselves.  |make_sure()|
+ * keeps one free to allocate the info of the next chunk for them.
+ *
+ * Large buffers are allocated by |large|, out of the block.
+ */
 class mem_block_t {
 public:
   void *start;
@@ -136,44 +462,40 @@ public:
 
   bool in_alloc_chunk;
 
-  chunkinfo_t* buckets[SMALL_ALLOC_TYPES + 1];
+  chunkinfo_t* partial[SMALL_ALLOC_TYPES + 1];
   uint32_t nfrees[SMALL_ALLOC_TYPES + 1];
+  chunkinfo_t* units[MAX_BLOCK_SIZE / SMALL_CHUNK_BYTES];
 
-  chunkinfo_t* large;
-  chunkinfo_t* large_free;
+  large_heap_t large;
 
   mem_block_t(void *mem, uint32_t size)
     : start(mem)
     , next_free(mem)
     , size(size)
     , used(0)
-    , in_alloc_chunk(false)
-    , large(nullptr)
-    , large_free(nullptr) {
+    , in_alloc_chunk(false) {
+    assert(size <= MAX_BLOCK_SIZE);
+    assert(((unsigned long)mem & (SMALL_CHUNK_BYTES - 1)) == 0);
     for (int i = 0; i < SMALL_ALLOC_TYPES + 1; i++) {
-      buckets[i] = nullptr;
+      partial[i] = nullptr;
       nfrees[i] = 0;
     }
+    for (auto& unit : units) {
+      unit = nullptr;
+    }
   }
 
   static int get_type(uint32_t size) {
     if (size <= (1 << SMALL_ALLOC_LOWER_POW)) {
-      return SMALL_ALLOC_LOWER_POW;
+      return 0;
     }
     if (size <= (1 << SMALL_ALLOC_UPPER_POW)) {
-      int i = SMALL_ALLOC_LOWER_POW +1;
-      while (size > (uint32_t)(1 << i)) {
-        i++;
-      }
-      return i - SMALL_ALLOC_LOWER_POW;
+      // The power of two rounded up
+      return 32 - __builtin_clz(size - 1) - SMALL_ALLOC_LOWER_POW;
     }
     return LARGE_CHUNK;
   }
 
-  static uint32_t get_type_pow(uint32_t pow) {
-    return pow - SMALL_ALLOC_LOWER_POW;
-  }
-
   static int get_size(uint32_t type) {
     return 1 << (type + SMALL_ALLOC_LOWER_POW);
   }
@@ -182,17 +504,19 @@ public:
     // Use a temporary chunk, boot_chunk, to allocate space for the
     // real first chunk.
     auto type = get_type(sizeof(chunkinfo_t));
-    chunkinfo_t boot_chunk(get_size(type), start, 256);
+    chunkinfo_t boot_chunk(get_size(type), start, SMALL_CHUNK_BYTES);
 
     // After initialize the first chunk, allocate space from the real
     // first chunk to take it's space from itself.
     auto ptr = boot_chunk.alloc();
-    auto first_chunk = new(ptr) chunkinfo_t(get_size(type), start, 256);
+    auto first_chunk = new(ptr) chunkinfo_t(get_size(type), start,
+                                            SMALL_CHUNK_BYTES);
     first_chunk->alloc();
 
     next_free = (char*)next_free + first_chunk->bytes;
 
-    put_front(first_chunk, nullptr);
+    units[0] = first_chunk;
+    link_partial(first_chunk);
     nfrees[type] = first_chunk->nfree;
   }
 
@@ -208,110 +532,70 @@ public:
     }
   }
 
-  void put_front(chunkinfo_t* chunk, chunkinfo_t* prev) {
+  void link_partial(chunkinfo_t* chunk) {
     auto type = get_type(chunk->elm_size);
-    if (chunk == buckets[type]) {
-      return;
+    chunk->prev = nullptr;
+    chunk->next = partial[type];
+    if (partial[type]) {
+      partial[type]->prev = chunk;
     }
-    if (prev != nullptr) {
-      // So, it is not a new chunk!
-      prev->next = chunk->next;
-    }
-    chunk->next = buckets[type];
-    buckets[type] = chunk;
-  }
-
-  void put_large(chunkinfo_t* chunk) {
-    auto ptr = large;
-    if (ptr == nullptr || ptr->elm_size >= chunk->elm_size) {
-      chunk->next = large;
-      large = chunk;
-      return;
-    }
-    chunkinfo_t* last = nullptr;
-    while (ptr != nullptr) {
-      if (ptr->elm_size < chunk->elm_size) {
-        last = ptr;
-        ptr = ptr->next;
-        continue;
-      }
-      chunk->next = ptr;
-      last->next = chunk;
-      return;
-    }
-    last->next = chunk;
+    partial[type] = chunk;
   }
 
-  void put_large_free(chunkinfo_t* chunk) {
-    auto ptr = large_free;
-    if (ptr == nullptr || ptr->elm_size >= chunk->elm_size) {
-      chunk->next = large_free;
-      large_free = chunk;
-      return;
+  void unlink_partial(chunkinfo_t* chunk) {
+    auto type = get_type(chunk->elm_size);
+    if (chunk->prev) {
+      chunk->prev->next = chunk->next;
+    } else {
+      partial[type] = chunk->next;
     }
-    chunkinfo_t* last = nullptr;
-    while (ptr != nullptr) {
-      if (ptr->elm_size < chunk->elm_size) {
-        last = ptr;
-        ptr = ptr->next;
-        continue;
-      }
-      chunk->next = ptr;
-      last->next = chunk;
-      return;
+    if (chunk->next) {
+      chunk->next->prev = chunk->prev;
     }
-    last->next = chunk;
+    chunk->next = chunk->prev = nullptr;
   }
 
-  chunkinfo_t* _alloc_chunk(uint32_t type, uint32_t bytes) {
+  chunkinfo_t* _alloc_chunk(uint32_t type) {
     auto ptr = _alloc_small(get_type(sizeof(chunkinfo_t)));
     if (ptr == nullptr) {
       return nullptr;
     }
-    auto elm_size = type == LARGE_CHUNK ? bytes : get_size(type);
-    auto chunk = new(ptr) chunkinfo_t(elm_size, next_free, bytes);
-    next_free = (char*)next_free + chunk->bytes;
-
-    if (type == LARGE_CHUNK) {
-      put_large(chunk);
-    } else {
-      put_front(chunk, nullptr);
-      nfrees[type] += chunk->nfree;
+    auto begin = next_free;
+    if ((char*)begin + SMALL_CHUNK_BYTES > (char*)start + size) {
+      free_small(ptr);
+      return nullptr;
     }
-
+    next_free = (char*)begin + SMALL_CHUNK_BYTES;
+    auto chunk = new(ptr) chunkinfo_t(get_size(type), begin,
+                                      SMALL_CHUNK_BYTES);
+    units[((char*)begin - (char*)start) / SMALL_CHUNK_BYTES] = chunk;
+    link_partial(chunk);
+    nfrees[type] += chunk->nfree;
     return chunk;
   }
-  chunkinfo_t* alloc_chunk(uint32_t type, uint32_t bytes = 1024) {
+  chunkinfo_t* alloc_chunk(uint32_t type) {
     assert(!in_alloc_chunk);
     in_alloc_chunk = true;
 
-    auto chunk = _alloc_chunk(type, bytes);
+    auto chunk = _alloc_chunk(type);
 
     in_alloc_chunk = false;
     return chunk;
   }
 
   void* _alloc_small(uint32_t type) {
-    // Find a chunk having free memory or create a new chunk.
-    chunkinfo_t* chunk = nullptr;
-    chunkinfo_t* prev = nullptr;
-    if (nfrees[type]) {
-      chunk = buckets[type];
-      while (chunk && !chunk->has_free()) {
-        prev = chunk;
-        chunk = chunk->next;
-      }
-    } else {
-      chunk = alloc_chunk(type);
-    }
+    // Take a chunk having free elements or create a new chunk.
+    auto chunk = partial[type];
     if (chunk == nullptr) {
-      return nullptr;
+      chunk = alloc_chunk(type);
+      if (chunk == nullptr) {
+        return nullptr;
+      }
     }
 
     auto ptr = chunk->alloc();
-
-    if (chunk->has_free()) {
-      put_front(chunk, prev);
+    if (!chunk->has_free()) {
+      unlink_partial(chunk);
     }
     nfrees[type]--;
 
@@ -323,108 +607,251 @@ public:
     return _alloc_small(type);
   }
 
-  void* alloc_large(uint32_t bytes) {
-    if (large_free) {
-      auto ptr = large_free;
-      if (ptr->elm_size >= bytes) {
-        large_free = ptr->next;
-        put_large(ptr);
-        return ptr->begin;
-      }
-      chunkinfo_t* last = nullptr;
-      while (ptr) {
-        if (ptr->elm_size < bytes) {
-          last = ptr;
-          ptr = ptr->next;
-          continue;
-        }
-        last->next = ptr->next;
-        put_large(ptr);
-        return ptr->begin;
-      }
-    }
-    make_sure();
-    bytes = (bytes + 0xff) & ~0xff;
-    auto chunk = alloc_chunk(LARGE_CHUNK, bytes);
-    return chunk->begin;
-  }
-
   void* alloc(uint32_t size) {
     auto type = get_type(size);
     if (type == LARGE_CHUNK) {
-      return alloc_large(size);
+      return large.alloc(size);
     }
     return alloc_small(type);
   }
 
-  chunkinfo_t* find_chunk_type(uint32_t type, void* ptr, chunkinfo_t** ptrprev) {
-    auto chunk = buckets[type];
-    chunkinfo_t* prev = nullptr;
-    while (chunk) {
-      if (chunk->is_part(ptr)) {
-        if (ptrprev) {
-          *ptrprev = prev;
-        }
-        return chunk;
-      }
-      prev = chunk;
-      chunk = chunk->next;
+  /**
+   * Return the chunk of small elements that |ptr| is in, or nullptr.
+   */
+  chunkinfo_t* find_small_chunk(void* ptr) {
+    auto off = (unsigned long)((char*)ptr - (char*)start);
+    if (off >= size) {
+      return nullptr;
     }
-    return nullptr;
+    auto chunk = units[off / SMALL_CHUNK_BYTES];
+    if (chunk == nullptr || !chunk->is_part(ptr)) {
+      return nullptr;
+    }
+    return chunk;
   }
 
-  chunkinfo_t* find_chunk(void* ptr, chunkinfo_t** ptrprev) {
-    for (int i = SMALL_ALLOC_LOWER_POW; i < SMALL_ALLOC_UPPER_POW; i++) {
-      auto chunk = find_chunk_type(get_type_pow(i), ptr, ptrprev);
-      if (chunk) {
-        return chunk;
-      }
+  void free_small(void* ptr) {
+    auto chunk = find_small_chunk(ptr);
+    assert(chunk);
+    if (!chunk->has_free()) {
+      link_partial(chunk);
     }
-    if (large) {
-      auto chunk = large;
-      if (chunk->begin == ptr) {
-        large = chunk->next;
-        return chunk;
+    chunk->free(ptr);
+    nfrees[get_type(chunk->elm_size)]++;
+  }
+
+  void free(void* ptr) {
+    if (find_small_chunk(ptr)) {
+      free_small(ptr);
+      return;
+    }
+    large.free(ptr);
+  }
+
+  void* realloc(void* ptr, uint32_t size) {
+    if (ptr == nullptr) {
+      return alloc(size);
+    }
+    uint64_t old_size;
+    auto chunk = find_small_chunk(ptr);
+    if (chunk) {
+      old_size = chunk->elm_size;
+      if (size <= old_size) {
+        return ptr;
       }
-      chunkinfo_t* last = nullptr;
-      while (chunk) {
-        if (chunk->begin != ptr) {
-          last = chunk;
-          chunk = chunk->next;
-          continue;
-        }
-        last->next = chunk->next;
-        return chunk;
+    } else {
+      if (large.resize(ptr, size)) {
+        return ptr;
       }
+      old_size = large.usable_size(ptr);
     }
-    return nullptr;
+    auto new_ptr = alloc(size);
+    if (new_ptr == nullptr) {
+      return nullptr;
+    }
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    free(ptr);
+    return new_ptr;
+  }
+};
+
+// Magazines of small elements in front of the block.
+#define MAG_SLOTS 16
+#define MAG_SIZE 64
+
+/**
+ * A cache of free small elements of every size class.
+ */
+struct alignas(64) magazine_t {
+  int busy;
+  uint32_t counts[SMALL_ALLOC_TYPES];
+  void* elms[SMALL_ALLOC_TYPES][MAG_SIZE];
+};
+
+/**
+ * Thread-safe allocation from a mem_block_t.
+ *
+ * Threads of a subject may trap syscalls at the same time.  Small
+ * elements are allocated and freed from magazines without touching
+ * the block, and the block is locked only to refill or flush a
+ * magazine, and for large buffers.
+ *
+ * The scout has no TLS, it runs before the subject sets up its
+ * threads.  A thread takes the magazine picked by the address of its
+ * stack, or the next one that is not busy, so threads running at the
+ * same time mostly take different magazines and a magazine is not
+ * shared by threads.  If all magazines are busy, the block is used
+ * directly.
+ *
+ * A signal handler of the subject may make a trapped syscall while
+ * the scout is allocating on the same thread.  The nested scout
+ * takes another magazine, and signals are blocked while the block is
+ * locked, so it never spins on the lock held by its own thread.
+ */
+class thread_cache_t {
+public:
+  thread_cache_t(mem_block_t* block)
+    : block(block)
+    , lock(0) {
+    bzero(mags, sizeof(mags));
+  }
+
+  void* alloc(size_t size) {
+    auto type = mem_block_t::get_type(size);
+    magazine_t* mag;
+    if (type == LARGE_CHUNK || (mag = get_magazine()) == nullptr) {
+      auto mask = lock_block();
+      auto ptr = block->alloc(size);
+      unlock_block(mask);
+      return ptr;
+    }
+    if (mag->counts[type] == 0) {
+      refill(mag, type);
+    }
+    void* ptr = nullptr;
+    if (mag->counts[type] > 0) {
+      ptr = mag->elms[type][--mag->counts[type]];
+    }
+    put_magazine(mag);
+    return ptr;
   }
 
   void free(void* ptr) {
-    chunkinfo_t* prev;
-    auto chunk = find_chunk(ptr, &prev);
-    assert(chunk);
+    // The chunk of an element doesn't change while it is allocated.
+    auto chunk = block->find_small_chunk(ptr);
+    magazine_t* mag;
+    if (chunk == nullptr || (mag = get_magazine()) == nullptr) {
+      auto mask = lock_block();
+      block->free(ptr);
+      unlock_block(mask);
+      return;
+    }
+    auto type = mem_block_t::get_type(chunk->elm_size);
+    if (mag->counts[type] == MAG_SIZE) {
+      flush(mag, type);
+    }
+    mag->elms[type][mag->counts[type]++] = ptr;
+    put_magazine(mag);
+  }
 
-    if (chunk->elm_size != chunk->bytes) {
-      chunk->free(ptr);
+  void* realloc(void* ptr, size_t size) {
+    if (ptr == nullptr) {
+      return alloc(size);
+    }
+    auto chunk = block->find_small_chunk(ptr);
+    if (chunk == nullptr) {
+      auto mask = lock_block();
+      auto new_ptr = block->realloc(ptr, size);
+      unlock_block(mask);
+      return new_ptr;
+    }
+    if (size <= chunk->elm_size) {
+      return ptr;
+    }
+    auto new_ptr = alloc(size);
+    if (new_ptr == nullptr) {
+      return nullptr;
+    }
+    memcpy(new_ptr, ptr, chunk->elm_size);
+    free(ptr);
+    return new_ptr;
+  }
 
-      put_front(chunk, prev);
+private:
+  magazine_t* get_magazine() {
+    auto sp = (unsigned long)__builtin_frame_address(0);
+    // Stacks of threads are megabytes apart.
+    auto first = (uint32_t)((sp >> 20) * 0x9e3779b1U) % MAG_SLOTS;
+    for (uint32_t i = 0; i < MAG_SLOTS; i++) {
+      auto mag = mags + (first + i) % MAG_SLOTS;
+      if (!__atomic_load_n(&mag->busy, __ATOMIC_RELAXED) &&
+          !__atomic_exchange_n(&mag->busy, 1, __ATOMIC_ACQUIRE)) {
+        return mag;
+      }
+    }
+    return nullptr;
+  }
 
-      auto type = get_type(chunk->elm_size);
-      nfrees[type]++;
-    } else {
-      put_large_free(chunk);
+  void put_magazine(magazine_t* mag) {
+    __atomic_store_n(&mag->busy, 0, __ATOMIC_RELEASE);
+  }
+
+  /**
+   * Block signals and lock the block.  Return the signal mask to
+   * restore with |unlock_block()|.
+   */
+  unsigned long lock_block() {
+    unsigned long all = ~0UL;
+    unsigned long mask = 0;
+    SYSCALL(__NR_rt_sigprocmask, SIG_SETMASK, &all, &mask, sizeof(mask));
+    while (__atomic_exchange_n(&lock, 1, __ATOMIC_ACQUIRE)) {
+      while (__atomic_load_n(&lock, __ATOMIC_RELAXED)) {
+        __builtin_ia32_pause();
+      }
     }
+    return mask;
   }
-};
 
-static mem_block_t *global_mem_block = nullptr;
+  void unlock_block(unsigned long mask) {
+    __atomic_store_n(&lock, 0, __ATOMIC_RELEASE);
+    SYSCALL(__NR_rt_sigprocmask, SIG_SETMASK, &mask, nullptr, sizeof(mask));
+  }
+
+  // Fill half of an empty magazine.
+  void refill(magazine_t* mag, uint32_t type) {
+    auto mask = lock_block();
+    while (mag->counts[type] < MAG_SIZE / 2) {
+      auto ptr = block->alloc_small(type);
+      if (ptr == nullptr) {
+        break;
+      }
+      mag->elms[type][mag->counts[type]++] = ptr;
+    }
+    unlock_block(mask);
+  }
+
+  // Give back half of a full magazine.
+  void flush(magazine_t* mag, uint32_t type) {
+    auto mask = lock_block();
+    while (mag->counts[type] > MAG_SIZE / 2) {
+      block->free_small(mag->elms[type][--mag->counts[type]]);
+    }
+    unlock_block(mask);
+  }
+
+  mem_block_t* block;
+  int lock;
+  magazine_t mags[MAG_SLOTS];
+};
 
 #ifndef TEST
+static thread_cache_t* global_cache = nullptr;
+
 extern "C" {
 void tinymalloc_init() {
-  static char buf[sizeof(mem_block_t)];
-  assert(global_mem_block == nullptr);
+  alignas(mem_block_t) static char buf[sizeof(mem_block_t)];
+  alignas(thread_cache_t) static char cache_buf[sizeof(thread_cache_t)];
+  assert(global_cache == nullptr);
 
   auto mem = (void*)SYSCALL(__NR_mmap,
                             nullptr,
@@ -435,15 +862,19 @@ void tinymalloc_init() {
                             0);
   auto block = new(buf) mem_block_t(mem, 1024 * 1024);
   block->init();
-  global_mem_block = block;
+  global_cache = new(cache_buf) thread_cache_t(block);
 }
 
 void* malloc(size_t size) {
-  return global_mem_block->alloc(size);
+  return global_cache->alloc(size);
 }
 
 void free(void* ptr) {
-  global_mem_block->free(ptr);
+  global_cache->free(ptr);
+}
+
+void* realloc(void* ptr, size_t size) {
+  return global_cache->realloc(ptr, size);
 }
 }
 
@@ -486,34 +917,493 @@ void operator delete[](void* ptr) throw() {
 #ifdef TEST
 
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
-static char mem[8192];
+alignas(SMALL_CHUNK_BYTES) static char mem[8192];
 
-int
-main(int argc, char * const argv[]) {
+static double
+now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Allocate and free batches of small buffers of random sizes, like
+ * tinypack does for messages, with |live| buffers kept allocated
+ * along.  Print the time of a pair of malloc() and free().
+ */
+template<typename Alloc, typename Free>
+static void
+bench(const char* name, int live, Alloc alloc, Free free) {
+  const int rounds = 20000;
+  const int batch = 64;
+  static void* kept[4096];
+  void* ptrs[batch];
+  uint32_t seed = 1;
+  auto next_size = [&]() {
+    seed = seed * 1103515245 + 12345;
+    return 8 + (seed >> 16) % 248;
+  };
+  for (int i = 0; i < live; i++) {
+    kept[i] = alloc(next_size());
+  }
+  auto start = now_ns();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < batch; i++) {
+      ptrs[i] = alloc(next_size());
+    }
+    // Not in the order of allocation
+    for (int i = 0; i < batch; i++) {
+      free(ptrs[(i * 37) % batch]);
+    }
+  }
+  auto ns = (now_ns() - start) / ((double)rounds * batch);
+  for (int i = 0; i < live; i++) {
+    free(kept[i]);
+  }
+  printf("%s, %d live: %.1f ns per malloc/free\n", name, live, ns);
+}
+
+struct thread_args {
+  void* (*alloc)(size_t);
+  void (*free)(void*);
+  int bad;
+};
+
+/**
+ * Allocate, fill, check and free buffers of random sizes.
+ */
+static void*
+thread_main(void* arg) {
+  auto args = (thread_args*)arg;
+  const int batch = 64;
+  unsigned char* ptrs[batch];
+  uint32_t sizes[batch];
+  auto seed = (uint32_t)(unsigned long)arg;
+  for (int r = 0; r < 20000; r++) {
+    for (int i = 0; i < batch; i++) {
+      seed = seed * 1103515245 + 12345;
+      sizes[i] = 1 + (seed >> 16) % (r % 16 ? 255 : 4000);
+      ptrs[i] = (unsigned char*)args->alloc(sizes[i]);
+      memset(ptrs[i], i, sizes[i]);
+    }
+    for (int i = 0; i < batch; i++) {
+      auto j = (i * 37) % batch;
+      if (ptrs[j][0] != j || ptrs[j][sizes[j] - 1] != j) {
+        args->bad++;
+      }
+      args->free(ptrs[j]);
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Run |nthreads| threads of thread_main() at the same time.  Return
+ * the number of buffers found overwritten.
+ */
+static int
+bench_threads(const char* name, int nthreads,
+              void* (*alloc)(size_t), void (*free)(void*)) {
+  pthread_t threads[16];
+  thread_args args[16];
+  auto start = now_ns();
+  for (int i = 0; i < nthreads; i++) {
+    args[i] = thread_args { alloc, free, 0 };
+    pthread_create(&threads[i], nullptr, thread_main, &args[i]);
+  }
+  int bad = 0;
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], nullptr);
+    bad += args[i].bad;
+  }
+  auto ms = (now_ns() - start) / 1e6;
+  printf("%s, %d threads: %.1f ms, bad %d\n", name, nthreads, ms, bad);
+  return bad;
+}
+
+/**
+ * The search of small elements before chunks had bitmaps in words,
+ * kept to compare with.
+ *
+ * A chunk scans its use bits byte by byte from a pseudo random
+ * position.  An allocation walks the list of chunks of its size class
+ * to the first one having free elements, and free() walks the lists
+ * of every size class to find the chunk of an element.  Chunks that
+ * have free elements are moved to the front of their lists.
+ */
+struct bytescan_chunk_t {
+  void* begin;
+  bytescan_chunk_t* next;
+  uint32_t elm_size;
+  uint32_t bytes;
+  uint32_t nfree;
+
+  bytescan_chunk_t(uint32_t element_size, void* begin, uint32_t bytes)
+    : begin(begin)
+    , next(nullptr)
+    , elm_size(element_size)
+    , bytes(bytes)
+    , nfree(max_elements()) {
+    bzero(begin, first_element());
+  }
+
+  uint32_t first_element() {
+    auto nelm = bytes / elm_size;
+    auto usebits_size = (nelm + 7) / 8;
+    return (usebits_size + 7) & ~0x7;
+  }
+
+  uint32_t max_elements() {
+    return (bytes - first_element()) / elm_size;
+  }
+
+  int32_t alloc_free_range(uint32_t start, uint32_t stop) {
+    auto usebits = (uint8_t*)begin;
+    for (auto i = start; i < stop; i += 8) {
+      auto byte = usebits[i / 8];
+      if (byte == 0xff) {
+        continue;
+      }
+      for (int j = 0; j < 8; j++) {
+        if (0x1 & (byte >> j)) {
+          continue;
+        }
+        auto found = i + j;
+        if (found < stop) {
+          usebits[i / 8] |= 0x1 << j;
+          nfree--;
+          return found;
+        }
+      }
+    }
+    return -1;
+  }
+
+  void* alloc() {
+    if (nfree == 0) {
+      return nullptr;
+    }
+    static uint32_t rand = 0;
+    auto max = max_elements();
+    auto start = ((rand++ % 8) * max / 8) & ~0x7;
+    auto found = alloc_free_range(start, max);
+    if (found == -1 && start != 0) {
+      found = alloc_free_range(0, start);
+    }
+    return (char*)begin + first_element() + found * elm_size;
+  }
+
+  bool is_part(void* ptr) {
+    auto off = (char*)ptr - (char*)begin;
+    return off >= first_element() && off < bytes;
+  }
+
+  void free(void* ptr) {
+    auto pos = ((char*)ptr - (char*)begin - first_element()) / elm_size;
+    auto usebits = (uint8_t*)begin;
+    usebits[pos / 8] &= ~(0x1 << (pos % 8));
+    nfree++;
+  }
+};
+
+class bytescan_block_t {
+public:
+  bytescan_block_t(void* mem, uint32_t size)
+    : next_free((char*)mem)
+    , end((char*)mem + size) {
+    bzero(buckets, sizeof(buckets));
+  }
+
+  void* alloc(uint32_t size) {
+    auto type = mem_block_t::get_type(size);
+    assert(type != LARGE_CHUNK);
+    auto chunk = buckets[type];
+    bytescan_chunk_t* prev = nullptr;
+    while (chunk && chunk->nfree == 0) {
+      prev = chunk;
+      chunk = chunk->next;
+    }
+    if (chunk == nullptr) {
+      assert(next_free + SMALL_CHUNK_BYTES <= end);
+      chunk = new bytescan_chunk_t(mem_block_t::get_size(type), next_free,
+                                   SMALL_CHUNK_BYTES);
+      next_free += SMALL_CHUNK_BYTES;
+      prev = nullptr;
+    }
+    auto ptr = chunk->alloc();
+    if (chunk->nfree) {
+      put_front(type, chunk, prev);
+    }
+    return ptr;
+  }
+
+  void free(void* ptr) {
+    for (int type = 0; type < SMALL_ALLOC_TYPES; type++) {
+      bytescan_chunk_t* prev = nullptr;
+      for (auto chunk = buckets[type]; chunk; chunk = chunk->next) {
+        if (chunk->is_part(ptr)) {
+          chunk->free(ptr);
+          put_front(type, chunk, prev);
+          return;
+        }
+        prev = chunk;
+      }
+    }
+    assert(false);
+  }
+
+private:
+  void put_front(int type, bytescan_chunk_t* chunk, bytescan_chunk_t* prev) {
+    if (chunk == buckets[type]) {
+      return;
+    }
+    if (prev != nullptr) {
+      prev->next = chunk->next;
+    }
+    chunk->next = buckets[type];
+    buckets[type] = chunk;
+  }
+
+  char* next_free;
+  char* end;
+  bytescan_chunk_t* buckets[SMALL_ALLOC_TYPES];
+};
+
+static thread_cache_t* bench_cache;
+static int bench_lock;
+
+static void
+run_benchmarks() {
+  const uint32_t block_size = 1024 * 1024;
+  auto mem = mmap(nullptr, block_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  static mem_block_t block(mem, block_size);
+  block.init();
+  static thread_cache_t cache(&block);
+  bench_cache = &cache;
+  const uint32_t bytescan_size = 4 * 1024 * 1024;
+  static bytescan_block_t bytescan(mmap(nullptr, bytescan_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+                                   bytescan_size);
+  static const int lives[] = { 0, 2000 };
+  for (auto live : lives) {
+    bench("byte-scan search", live,
+          [](size_t size) { return bytescan.alloc(size); },
+          [](void* ptr) { bytescan.free(ptr); });
+    bench("tinymalloc", live,
+          [](size_t size) { return block.alloc(size); },
+          [](void* ptr) { block.free(ptr); });
+    bench("tinymalloc magazines", live,
+          [](size_t size) { return cache.alloc(size); },
+          [](void* ptr) { cache.free(ptr); });
+    bench("libc malloc", live,
+          [](size_t size) { return malloc(size); },
+          [](void* ptr) { free(ptr); });
+  }
+
+  static const int nthreads[] = { 1, 4 };
+  for (auto n : nthreads) {
+    // The block behind a lock, as before magazines.
+    bench_threads("tinymalloc locked", n,
+                  [](size_t size) {
+                    while (__atomic_exchange_n(&bench_lock, 1,
+                                               __ATOMIC_ACQUIRE)) {
+                    }
+                    auto ptr = block.alloc(size);
+                    __atomic_store_n(&bench_lock, 0, __ATOMIC_RELEASE);
+                    return ptr;
+                  },
+                  [](void* ptr) {
+                    while (__atomic_exchange_n(&bench_lock, 1,
+                                               __ATOMIC_ACQUIRE)) {
+                    }
+                    block.free(ptr);
+                    __atomic_store_n(&bench_lock, 0, __ATOMIC_RELEASE);
+                  });
+    bench_threads("tinymalloc magazines", n,
+                  [](size_t size) { return bench_cache->alloc(size); },
+                  [](void* ptr) { bench_cache->free(ptr); });
+    bench_threads("libc malloc", n,
+                  [](size_t size) { return malloc(size); },
+                  [](void* ptr) { free(ptr); });
+  }
+}
+
+static int failures;
+
+static void
+check(bool ok, const char* what) {
+  if (!ok) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+static void
+test_block() {
   mem_block_t block(mem, sizeof(mem));
   block.init();
+  void* smalls[20];
   for (int i = 0; i < 20; i++) {
-    printf("%p\n", block.alloc_small(5));
+    smalls[i] = block.alloc_small(5);
+    check(smalls[i] != nullptr, "small");
+    for (int j = 0; j < i; j++) {
+      check(smalls[i] != smalls[j], "small distinct");
+    }
   }
-  printf("try free\n");
   for (int i = 0; i < 11; i++) {
     block.alloc_small(2);
   }
   auto ptr = block.alloc_small(2);
   for (int i = 0; i < 10; i++) {
-    printf("%p\n", ptr);
     block.free(ptr);
-    ptr = block.alloc_small(2);
+    check(block.alloc_small(2) == ptr, "small reused");
   }
-  printf("1024byts\n");
   for (int i = 0; i < 10; i++) {
     auto ptr = block.alloc(1024);
     auto ptr2 = block.alloc(768);
-    printf("%p %p\n", ptr, ptr2);
+    check(ptr != nullptr && ptr2 != nullptr && ptr != ptr2, "large");
     block.free(ptr);
     block.free(ptr2);
   }
+  auto ptr256 = block.alloc(200);
+  block.free(ptr256);
+  for (int i = 0; i < 10; i++) {
+    ptr = block.alloc(200);
+    check(ptr == ptr256, "256 bytes reused");
+    block.free(ptr);
+  }
+
+  void* ptrs[8];
+  for (auto& p : ptrs) {
+    p = block.alloc(3000);
+  }
+  check(block.large.num_arenas == 1, "one arena");
+  // Free every other one, then the rest to join them.
+  for (int i = 0; i < 8; i += 2) {
+    block.free(ptrs[i]);
+  }
+  for (int i = 1; i < 8; i += 2) {
+    block.free(ptrs[i]);
+  }
+  auto big = block.alloc(8 * 3000);
+  check(big == ptrs[0], "coalesced");
+  block.free(big);
+
+  auto buf = (char*)block.alloc(1000);
+  memset(buf, 'x', 1000);
+  auto buf2 = (char*)block.realloc(buf, 2000);
+  check(buf2 == buf, "grown in place");
+  buf = (char*)block.realloc(buf2, 500);
+  check(buf == buf2, "shrunk in place");
+  buf2 = (char*)block.realloc(buf, 100 * 1024);
+  check(buf2 != buf && buf2[499] == 'x', "mapped");
+  buf = (char*)block.realloc(buf2, 200 * 1024);
+  check(buf[0] == 'x', "mapped and grown");
+  block.free(buf);
+  check(block.large.num_arenas == 1, "mapping unmapped");
+}
+
+static volatile int reentered;
+
+/**
+ * Allocate from a signal handler while the thread may be holding the
+ * lock of the block, like a scout trapping a syscall made by a
+ * signal handler of the subject.
+ */
+static void
+reenter(int signum) {
+  bench_cache->free(bench_cache->alloc(4000));
+  reentered++;
+}
+
+static void*
+alloc_large_loop(void* arg) {
+  auto stop = (volatile int*)arg;
+  while (!*stop) {
+    bench_cache->free(bench_cache->alloc(3000));
+  }
+  return nullptr;
+}
+
+static void
+test_magazines() {
+  const uint32_t block_size = 1024 * 1024;
+  auto mem = mmap(nullptr, block_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  static mem_block_t block(mem, block_size);
+  block.init();
+  static thread_cache_t cache(&block);
+  bench_cache = &cache;
+
+  auto ptr = cache.alloc(16);
+  cache.free(ptr);
+  check(cache.alloc(16) == ptr, "magazine reused");
+  cache.free(ptr);
+
+  // Refill and flush magazines several times.
+  static void* ptrs[1000];
+  for (auto& p : ptrs) {
+    p = cache.alloc(100);
+    check(p != nullptr, "magazine alloc");
+    memset(p, 0xaa, 100);
+  }
+  for (auto p : ptrs) {
+    cache.free(p);
+  }
+  for (auto& p : ptrs) {
+    p = cache.alloc(100);
+  }
+  for (int i = 1; i < 1000; i++) {
+    check(ptrs[i] != ptrs[i - 1], "magazine distinct");
+  }
+  for (auto p : ptrs) {
+    cache.free(p);
+  }
+
+  auto bad = bench_threads("magazines", 4,
+                           [](size_t size) { return bench_cache->alloc(size); },
+                           [](void* ptr) { bench_cache->free(ptr); });
+  check(bad == 0, "threads");
+
+  // A signal handler allocating while the block is locked.
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = reenter;
+  sigaction(SIGUSR1, &act, nullptr);
+  int stop = 0;
+  pthread_t thread;
+  pthread_create(&thread, nullptr, alloc_large_loop, &stop);
+  // Fail instead of spinning forever.
+  alarm(30);
+  for (int i = 0; i < 20000; i++) {
+    pthread_kill(thread, SIGUSR1);
+  }
+  stop = 1;
+  pthread_join(thread, nullptr);
+  alarm(0);
+  check(reentered > 0, "reentered");
+}
+
+int
+main(int argc, char * const argv[]) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    run_benchmarks();
+    return 0;
+  }
+
+  test_block();
+  test_magazines();
+  if (failures) {
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
 }
 
 #endif
@@ -0,0 +1,211 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#include "tinystring.h"
+
+#include <stdint.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+typedef uint64_t u64_unaligned __attribute__((may_alias, aligned(1)));
+typedef uint32_t u32_unaligned __attribute__((may_alias, aligned(1)));
+typedef uint16_t u16_unaligned __attribute__((may_alias, aligned(1)));
+
+#define AVX2 __attribute__((target("avx2")))
+
+/**
+ * Copy less than 16 bytes with two moves that may overlap.
+ */
+static inline void
+copy_small(char* d, const char* s, size_t n) {
+  if (n >= 8) {
+    auto head = *(const u64_unaligned*)s;
+    auto tail = *(const u64_unaligned*)(s + n - 8);
+    *(u64_unaligned*)d = head;
+    *(u64_unaligned*)(d + n - 8) = tail;
+  } else if (n >= 4) {
+    auto head = *(const u32_unaligned*)s;
+    auto tail = *(const u32_unaligned*)(s + n - 4);
+    *(u32_unaligned*)d = head;
+    *(u32_unaligned*)(d + n - 4) = tail;
+  } else if (n >= 2) {
+    auto head = *(const u16_unaligned*)s;
+    auto tail = *(const u16_unaligned*)(s + n - 2);
+    *(u16_unaligned*)d = head;
+    *(u16_unaligned*)(d + n - 2) = tail;
+  } else if (n == 1) {
+    *d = *s;
+  }
+}
+
+static inline void
+zero_small(char* d, size_t n) {
+  if (n >= 8) {
+    *(u64_unaligned*)d = 0;
+    *(u64_unaligned*)(d + n - 8) = 0;
+  } else if (n >= 4) {
+    *(u32_unaligned*)d = 0;
+    *(u32_unaligned*)(d + n - 4) = 0;
+  } else if (n >= 2) {
+    *(u16_unaligned*)d = 0;
+    *(u16_unaligned*)(d + n - 2) = 0;
+  } else if (n == 1) {
+    *d = 0;
+  }
+}
+
+void*
+tl_memcpy_sse2(void* dest, const void* src, size_t n) {
+  auto d = (char*)dest;
+  auto s = (const char*)src;
+  if (n < 16) {
+    copy_small(d, s, n);
+    return dest;
+  }
+  // The last 16 bytes, copied at the end.
+  auto tail = _mm_loadu_si128((const __m128i*)(s + n - 16));
+  auto end = d + n - 16;
+  for (; n > 64; n -= 64, d += 64, s += 64) {
+    auto a = _mm_loadu_si128((const __m128i*)s);
+    auto b = _mm_loadu_si128((const __m128i*)(s + 16));
+    auto c = _mm_loadu_si128((const __m128i*)(s + 32));
+    auto e = _mm_loadu_si128((const __m128i*)(s + 48));
+    _mm_storeu_si128((__m128i*)d, a);
+    _mm_storeu_si128((__m128i*)(d + 16), b);
+    _mm_storeu_si128((__m128i*)(d + 32), c);
+    _mm_storeu_si128((__m128i*)(d + 48), e);
+  }
+  for (; n > 16; n -= 16, d += 16, s += 16) {
+    _mm_storeu_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+  }
+  _mm_storeu_si128((__m128i*)end, tail);
+  return dest;
+}
+
+AVX2 void*
+tl_memcpy_avx2(void* dest, const void* src, size_t n) {
+  if (n <= 32) {
+    return tl_memcpy_sse2(dest, src, n);
+  }
+  auto d = (char*)dest;
+  auto s = (const char*)src;
+  auto tail = _mm256_loadu_si256((const __m256i*)(s + n - 32));
+  auto end = d + n - 32;
+  for (; n > 128; n -= 128, d += 128, s += 128) {
+    auto a = _mm256_loadu_si256((const __m256i*)s);
+    auto b = _mm256_loadu_si256((const __m256i*)(s + 32));
+    auto c = _mm256_loadu_si256((const __m256i*)(s + 64));
+    auto e = _mm256_loadu_si256((const __m256i*)(s + 96));
+    _mm256_storeu_si256((__m256i*)d, a);
+    _mm256_storeu_si256((__m256i*)(d + 32), b);
+    _mm256_storeu_si256((__m256i*)(d + 64), c);
+    _mm256_storeu_si256((__m256i*)(d + 96), e);
+  }
+  for (; n > 32; n -= 32, d += 32, s += 32) {
+    _mm256_storeu_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+  }
+  _mm256_storeu_si256((__m256i*)end, tail);
+  return dest;
+}
+
+/*
+ * strlen() reads aligned blocks, that never cross a page, so bytes
+ * after the end of the string can be read safely.  Bits of bytes
+ * before the string in the first block are shifted out.
+ */
+size_t
+tl_strlen_sse2(const char* s) {
+  auto zero = _mm_setzero_si128();
+  auto p = (const char*)((uintptr_t)s & ~(uintptr_t)15);
+  auto eq = _mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero);
+  unsigned mask = _mm_movemask_epi8(eq) >> (s - p);
+  if (mask) {
+    return __builtin_ctz(mask);
+  }
+  for (;;) {
+    p += 16;
+    eq = _mm_cmpeq_epi8(_mm_load_si128((const __m128i*)p), zero);
+    mask = _mm_movemask_epi8(eq);
+    if (mask) {
+      return p + __builtin_ctz(mask) - s;
+    }
+  }
+}
+
+AVX2 size_t
+tl_strlen_avx2(const char* s) {
+  auto zero = _mm256_setzero_si256();
+  auto p = (const char*)((uintptr_t)s & ~(uintptr_t)31);
+  auto eq = _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero);
+  unsigned mask = (unsigned)_mm256_movemask_epi8(eq) >> (s - p);
+  if (mask) {
+    return __builtin_ctz(mask);
+  }
+  for (;;) {
+    p += 32;
+    eq = _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)p), zero);
+    mask = _mm256_movemask_epi8(eq);
+    if (mask) {
+      return p + __builtin_ctz(mask) - s;
+    }
+  }
+}
+
+void
+tl_bzero_sse2(void* s, size_t n) {
+  auto d = (char*)s;
+  if (n < 16) {
+    zero_small(d, n);
+    return;
+  }
+  auto zero = _mm_setzero_si128();
+  auto end = d + n - 16;
+  for (; n > 64; n -= 64, d += 64) {
+    _mm_storeu_si128((__m128i*)d, zero);
+    _mm_storeu_si128((__m128i*)(d + 16), zero);
+    _mm_storeu_si128((__m128i*)(d + 32), zero);
+    _mm_storeu_si128((__m128i*)(d + 48), zero);
+  }
+  for (; n > 16; n -= 16, d += 16) {
+    _mm_storeu_si128((__m128i*)d, zero);
+  }
+  _mm_storeu_si128((__m128i*)end, zero);
+}
+
+AVX2 void
+tl_bzero_avx2(void* s, size_t n) {
+  if (n <= 32) {
+    tl_bzero_sse2(s, n);
+    return;
+  }
+  auto d = (char*)s;
+  auto zero = _mm256_setzero_si256();
+  auto end = d + n - 32;
+  for (; n > 128; n -= 128, d += 128) {
+    _mm256_storeu_si256((__m256i*)d, zero);
+    _mm256_storeu_si256((__m256i*)(d + 32), zero);
+    _mm256_storeu_si256((__m256i*)(d + 64), zero);
+    _mm256_storeu_si256((__m256i*)(d + 96), zero);
+  }
+  for (; n > 32; n -= 32, d += 32) {
+    _mm256_storeu_si256((__m256i*)d, zero);
+  }
+  _mm256_storeu_si256((__m256i*)end, zero);
+}
+
+bool
+tl_has_avx2() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+      !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+    return false;
+  }
+  // The kernel saves the state of SSE and AVX registers.
+  unsigned xcr0_lo, xcr0_hi;
+  asm volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0_lo & 0x6) != 0x6) {
+    return false;
+  }
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+    (ebx & bit_AVX2);
+}
@@ -0,0 +1,29 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#ifndef __tinystring_h_
+#define __tinystring_h_
+
+#include <stddef.h>
+
+/**
+ * Vectorized memory and string functions of tinylibc.
+ *
+ * SSE2 is always there on x86_64.  tinylibc_init() picks the AVX2
+ * ones if the CPU and the kernel support them.
+ */
+extern "C" {
+void* tl_memcpy_sse2(void* dest, const void* src, size_t n);
+void* tl_memcpy_avx2(void* dest, const void* src, size_t n);
+size_t tl_strlen_sse2(const char* s);
+size_t tl_strlen_avx2(const char* s);
+void tl_bzero_sse2(void* s, size_t n);
+void tl_bzero_avx2(void* s, size_t n);
+
+/**
+ * Return true if AVX2 can be used.
+ */
+bool tl_has_avx2();
+}
+
+#endif /* __tinystring_h_ */
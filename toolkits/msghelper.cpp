@@ -49,10 +49,10 @@ send_msg(int sock, void* buf, int bufsz, int sendfd1, int sendfd2) {
     cmsg->cmsg_type = SCM_RIGHTS;
     cmsg->cmsg_len = CMSG_LEN(sizeof(int) * cmsgcnt);
     auto data = (int*)CMSG_DATA(cmsg);
-    if (sendfd1) {
+    if (sendfd1 >= 0) {
       *data++ = sendfd1;
     }
-    if (sendfd2) {
+    if (sendfd2 >= 0) {
       *data++ = sendfd2;
     }
  }
@@ -82,6 +82,7 @@ msg_receiver::receive_one() {
   iovec vec = { data, data_buf_size };
   msghdr msg = { nullptr, 0, &vec, 1, cmsg_buf, cmsg_buf_sz, 0 };
 
+  fd_rcvd_num = 0;
   data_bytes = recvmsg(fd, &msg, 0);
   if (data_bytes < 0) {
     perror("msg_receiver: recvmsg");
@@ -92,7 +93,7 @@ msg_receiver::receive_one() {
 
   if (msg.msg_controllen >= CMSG_SPACE(sizeof(int))) {
     auto cmsg = CMSG_FIRSTHDR(&msg);
-    fd_rcvd_num = cmsg->cmsg_len / CMSG_LEN(sizeof(int));
+    fd_rcvd_num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
     assert(fd_rcvd_num <= fd_rcvd_size);
     for (int i = 0; i < fd_rcvd_num; i++) {
       fd_rcvd[i] = ((int*)CMSG_DATA(cmsg))[i];
@@ -0,0 +1,173 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: set ts=8 sts=2 et sw=2 tw=80:
+ */
+#ifndef __msgring_h_
+#define __msgring_h_
+
+#include <string.h>
+
+/**
+ * A ring of messages in memory shared by two processes, a producer
+ * and a consumer, along with a slot for replies going backward.
+ *
+ * Messages are the size prefixed buffers of |tinypack|, the same as
+ * what are sent through sockets.  They are aligned to 8 bytes, and
+ * never wrap around the end of the ring.  A message that doesn't
+ * fit in the space left at the end is placed at the beginning, and
+ * the space left is marked with |WRAP|.
+ *
+ * |head| and |tail| keep growing, they are taken modulo the size of
+ * the ring to address data.  Only the producer writes |head| and
+ * only the consumer writes |tail|.
+ *
+ * The ring doesn't wait nor wake up anything, it is up to the users.
+ * The consumer bumps |reply_seq| after writing a reply, and the
+ * producer can wait for it with a futex.
+ */
+class msgring {
+public:
+  constexpr static unsigned int data_size = 64 * 1024;
+  constexpr static unsigned int reply_size = 32 * 1024;
+  constexpr static unsigned int WRAP = 0xffffffff;
+
+  /**
+   * Push a message packed by |pack|.
+   *
+   * Return false if the ring is full.
+   */
+  template<typename P>
+  bool push(P& pack) {
+    auto buf = reserve(pack.get_size_prefix());
+    if (buf == nullptr) {
+      return false;
+    }
+    write_size_prefix(pack, buf);
+    commit(pack.get_size_prefix());
+    return true;
+  }
+
+  /**
+   * Push a message that has been packed with the size prefix, |bytes|
+   * bytes including the prefix.
+   */
+  bool push_raw(const char* msg, unsigned int bytes) {
+    auto buf = reserve(bytes);
+    if (buf == nullptr) {
+      return false;
+    }
+    memcpy(buf, msg, bytes);
+    commit(bytes);
+    return true;
+  }
+
+  /**
+   * Return the message at the front, or nullptr if the ring is
+   * empty.  A |WRAP| mark at the front is skipped.  The size of the
+   * message, without the prefix, is returned in |*bytes|.
+   *
+   * Return nullptr as well for a broken ring.  The content of the ring
+   * comes from the other process, it can not be trusted.
+   */
+  const char* front(unsigned int* bytes) {
+    auto h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    if (tail == h) {
+      return nullptr;
+    }
+    auto pos = tail % data_size;
+    auto sz = *(unsigned int*)(data + pos);
+    if (sz == WRAP) {
+      __atomic_store_n(&tail, tail + (data_size - pos), __ATOMIC_RELEASE);
+      return front(bytes);
+    }
+    if (sz > data_size - pos - sizeof(unsigned int) ||
+        align(sz + sizeof(unsigned int)) > h - tail) {
+      return nullptr;
+    }
+    *bytes = sz;
+    return data + pos + sizeof(unsigned int);
+  }
+
+  /**
+   * Remove the message at the front.
+   */
+  void pop() {
+    auto sz = *(unsigned int*)(data + tail % data_size);
+    __atomic_store_n(&tail, tail + align(sz + sizeof(unsigned int)),
+                     __ATOMIC_RELEASE);
+  }
+
+  /**
+   * Write a reply packed by |pack|, and bump |reply_seq|.
+   *
+   * Return false if the reply is too big.
+   */
+  template<typename P>
+  bool put_reply(P& pack) {
+    if ((unsigned int)pack.get_size_prefix() > reply_size) {
+      return false;
+    }
+    write_size_prefix(pack, reply);
+    reply_bytes = pack.get_size_prefix();
+    __atomic_add_fetch(&reply_seq, 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  unsigned int get_reply_seq() {
+    return __atomic_load_n(&reply_seq, __ATOMIC_ACQUIRE);
+  }
+  // The futex word to wait for replies.
+  unsigned int* get_reply_futex() { return &reply_seq; }
+
+  const char* get_reply() { return reply; }
+  unsigned int get_reply_bytes() { return reply_bytes; }
+
+private:
+  static unsigned int align(unsigned int bytes) {
+    return (bytes + 7) & ~7;
+  }
+
+  /**
+   * Find the space for a message of |bytes| bytes, and return the
+   * address.  The message is visible to the consumer after |commit()|.
+   */
+  char* reserve(unsigned int bytes) {
+    bytes = align(bytes);
+    auto h = head;
+    auto t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    auto pos = h % data_size;
+    auto room = data_size - pos;
+    auto need = bytes > room ? room + bytes : bytes;
+    if (need > data_size - (h - t)) {
+      return nullptr;
+    }
+    if (bytes > room) {
+      *(unsigned int*)(data + pos) = WRAP;
+      reserved = h + room;
+      return data;
+    }
+    reserved = h;
+    return data + pos;
+  }
+
+  void commit(unsigned int bytes) {
+    __atomic_store_n(&head, reserved + align(bytes), __ATOMIC_RELEASE);
+  }
+
+  template<typename P>
+  static void write_size_prefix(P& pack, char* buf) {
+    unsigned int sz = pack.get_size();
+    memcpy(buf, &sz, sizeof(sz));
+    pack.writebuf(buf + sizeof(sz));
+  }
+
+  unsigned int head;
+  unsigned int tail;
+  // Where the message being pushed starts, only for the producer.
+  unsigned int reserved;
+  unsigned int reply_seq;
+  unsigned int reply_bytes;
+  char reply[reply_size];
+  char data[data_size];
+};
+
+#endif /* __msgring_h_ */
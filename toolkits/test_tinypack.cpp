@@ -49,4 +49,32 @@ main(int argc, const char * const argv[]) {
   printf("str %s, str_ %s\n", str, str_);
   assert(strcmp(str, str_) == 0);
   assert(memcmp(buf, _buf, 22) == 0);
+
+  auto pack2 = tinypack_fields(tinypacker(), a, b, c, str);
+  assert(pack2.get_size() == pack.get_size() - fbuf.size - 4);
+  auto msg2 = pack2.pack();
+  a_ = 0;
+  b_ = 0;
+  c_ = 0;
+  auto unpack2 = tinyunpack_fields(tinyunpacker(msg2, pack2.get_size()),
+                                   a_, b_, c_, str_);
+  assert(unpack2.check_completed());
+  unpack2.unpack();
+  assert(a == a_ && b == b_ && c == c_);
+  assert(strcmp(str, str_) == 0);
+
+  // A varbuf receives less than its room.
+  varbuf vbuf(buf, 10);
+  auto pack3 = tinypacker().field(a).field(vbuf);
+  auto msg3 = pack3.pack();
+  char vbuf_[22];
+  varbuf vbuf2(vbuf_, 22);
+  auto unpack3 = tinyunpacker(msg3, pack3.get_size()).field(a_).field(vbuf2);
+  assert(unpack3.check_completed());
+  unpack3.unpack();
+  assert(vbuf2.size == 10);
+  assert(memcmp(buf, vbuf_, 10) == 0);
+  varbuf vbuf3(vbuf_, 5);
+  auto unpack4 = tinyunpacker(msg3, pack3.get_size()).field(a_).field(vbuf3);
+  assert(!unpack4.check_completed());
 }
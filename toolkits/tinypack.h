@@ -124,6 +124,49 @@ public:
   }
 };
 
+/**
+ * A buffer of at most |size| bytes.  Unlike fixedbuf, the size of
+ * the data unpacked may be smaller, |size| is updated with it.
+ */
+struct varbuf {
+  varbuf(char* buf, int sz)
+    : buf(buf)
+    , size(sz) {}
+
+  char* buf;
+  int size;
+};
+
+template<>
+class tinypack_value_trait<varbuf> {
+public:
+  static int size(const varbuf& v) {
+    return v.size + sizeof(unsigned int);
+  }
+  static void writebuf(const varbuf& v, char* writeto) {
+    memcpy(writeto, &v.size, sizeof(unsigned int));
+    memcpy(writeto + sizeof(unsigned int), v.buf, v.size);
+  }
+  static int rsize(const varbuf* v, const char* readfrom, unsigned int size) {
+    if (size < sizeof(unsigned int)) {
+      return -1;
+    }
+    unsigned int rcvd_sz;
+    memcpy(&rcvd_sz, readfrom, sizeof(unsigned int));
+    if (rcvd_sz > (unsigned int)v->size ||
+        size - sizeof(unsigned int) < rcvd_sz) {
+      return -1;
+    }
+    return rcvd_sz + sizeof(unsigned int);
+  }
+  static void readbuf(varbuf& v, const char* readfrom) {
+    unsigned int sz;
+    memcpy(&sz, readfrom, sizeof(unsigned int));
+    memcpy(v.buf, readfrom + sizeof(unsigned int), sz);
+    v.size = sz;
+  }
+};
+
 template<>
 class tinypack_value_trait<char*> : public tinypack_value_trait<const char*> {};
 
@@ -296,4 +339,36 @@ private:
 
 typedef tinyunpack<void, void> tinyunpacker;
 
+/**
+ * Add all values to a packer at once.
+ *
+ *   tinypack_fields(tinypacker(), a, b, c)
+ *
+ * is the same as
+ *
+ *   tinypacker().field(a).field(b).field(c)
+ */
+template <typename P>
+P tinypack_fields(P pack) {
+  return pack;
+}
+
+template <typename P, typename V, typename... Rest>
+auto tinypack_fields(P pack, V v, Rest... rest) {
+  return tinypack_fields(pack.field(v), rest...);
+}
+
+/**
+ * Add all variables to an unpacker at once, like |tinypack_fields()|.
+ */
+template <typename U>
+U tinyunpack_fields(U unpack) {
+  return unpack;
+}
+
+template <typename U, typename V, typename... Rest>
+auto tinyunpack_fields(U unpack, V& v, Rest&... rest) {
+  return tinyunpack_fields(unpack.field(v), rest...);
+}
+
 #endif /* __tinypack_h_ */